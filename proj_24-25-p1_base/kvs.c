@@ -1,22 +1,56 @@
 #include "kvs.h"
 #include "string.h"
 #include "utils.h"
+#include "constants.h"
 
 #include <stdlib.h>
-#include <ctype.h>
-
-// Hash function based on key initial.
-// @param key Lowercase alphabetical string.
-// @return hash.
-// NOTE: This is not an ideal hash function, but is useful for test purposes of the project
- int hash(const char *key) {
-    int firstLetter = tolower(key[0]);
-    if (firstLetter >= 'a' && firstLetter <= 'z') {
-        return firstLetter - 'a';
-    } else if (firstLetter >= '0' && firstLetter <= '9') {
-        return firstLetter - '0';
+
+// Marks a slot whose pair was deleted, so that probing goes on past it.
+static KeyNode tombstone;
+#define TOMBSTONE (&tombstone)
+
+// Full hash of a key: FNV-1a followed by the murmur3 64 bit finalizer.
+// The top TABLE_BITS pick the bucket and the low bits the slot inside it.
+uint64_t hash_key(const char *key) {
+    uint64_t h = 14695981039346656037ULL;
+    for (const unsigned char *c = (const unsigned char *)key; *c != '\0'; c++) {
+        h ^= *c;
+        h *= 1099511628211ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+int hash_bucket(uint64_t h) {
+    return (int)(h >> (64 - TABLE_BITS));
+}
+
+void group_keys(size_t num_keys, char keys[][MAX_STRING_SIZE], BatchKey batch[]) {
+    // Counting sort on the bucket, stable so that repeated keys are still
+    // applied in command order
+    size_t starts[TABLE_SIZE + 1] = {0};
+    uint64_t hashes[num_keys];
+    for (size_t i = 0; i < num_keys; i++) {
+        hashes[i] = hash_key(keys[i]);
+        starts[hash_bucket(hashes[i]) + 1]++;
+    }
+    for (int i = 0; i < TABLE_SIZE; i++) {
+        starts[i + 1] += starts[i];
     }
-    return -1; // Invalid index for non-alphabetic or number strings
+    for (size_t i = 0; i < num_keys; i++) {
+        BatchKey *entry = &batch[starts[hash_bucket(hashes[i])]++];
+        entry->hash = hashes[i];
+        entry->index = i;
+    }
+}
+
+void prefetch_pair(HashTable *ht, uint64_t h) {
+    Bucket *bucket = &ht->table[hash_bucket(h)];
+    __builtin_prefetch(&bucket->slots[h & (bucket->capacity - 1)]);
 }
 
 
@@ -24,93 +58,173 @@ struct HashTable* create_hash_table() {
   HashTable *ht = malloc(sizeof(HashTable));
   if (!ht) return NULL;
   for (int i = 0; i < TABLE_SIZE; i++) {
-      ht->table[i] = NULL;
+      Bucket *bucket = &ht->table[i];
+      bucket->slots = calloc(BUCKET_INITIAL_CAPACITY, sizeof(KeyNode *));
+      if (!bucket->slots) {
+          while (i-- > 0) free(ht->table[i].slots);
+          free(ht);
+          return NULL;
+      }
+      bucket->capacity = BUCKET_INITIAL_CAPACITY;
+      bucket->count = 0;
+      bucket->used = 0;
+  }
+  for (int i = 0; i < TABLE_SIZE; i++) {
       rwlock_init(&ht->entry_locks[i]);
   }
-
-  rwlock_init(&ht->rwlock);
   return ht;
 }
 
-int write_pair(HashTable *ht, const char *key, const char *value) {
-    int index = hash(key);
-    KeyNode *keyNode = ht->table[index];
+// Finds the slot holding a key.
+// @param bucket Bucket the key belongs to.
+// @param key The key.
+// @param h Hash of the key.
+// @return index of the slot, or the bucket capacity if the key is not there.
+static size_t find_slot(Bucket *bucket, const char *key, uint64_t h) {
+    size_t mask = bucket->capacity - 1;
+    for (size_t i = h & mask;; i = (i + 1) & mask) {
+        KeyNode *keyNode = bucket->slots[i];
+        if (keyNode == NULL) {
+            return bucket->capacity; // An empty slot ends the probe sequence
+        }
+        if (keyNode != TOMBSTONE && keyNode->hash == h && strcmp(keyNode->key, key) == 0) {
+            return i;
+        }
+    }
+}
+
+// Moves every pair of a bucket to a new slot array, dropping the tombstones.
+// @param bucket The bucket.
+// @param new_capacity Number of slots of the new array (power of two).
+// @return 0 if successful, 1 otherwise.
+static int resize_bucket(Bucket *bucket, size_t new_capacity) {
+    KeyNode **slots = calloc(new_capacity, sizeof(KeyNode *));
+    if (!slots) return 1;
+
+    size_t mask = new_capacity - 1;
+    for (size_t i = 0; i < bucket->capacity; i++) {
+        KeyNode *keyNode = bucket->slots[i];
+        if (keyNode == NULL || keyNode == TOMBSTONE) continue;
+        size_t j = keyNode->hash & mask;
+        while (slots[j] != NULL) {
+            j = (j + 1) & mask;
+        }
+        slots[j] = keyNode;
+    }
+
+    free(bucket->slots);
+    bucket->slots = slots;
+    bucket->capacity = new_capacity;
+    bucket->used = bucket->count;
+    return 0;
+}
+
+int write_pair(HashTable *ht, const char *key, uint64_t h, const char *value) {
+    Bucket *bucket = &ht->table[hash_bucket(h)];
 
     // Search for the key node
-    while (keyNode != NULL) {
-        if (strcmp(keyNode->key, key) == 0) {
-            free(keyNode->value);
-            keyNode->value = strdup(value);
-            return 0;
+    size_t index = find_slot(bucket, key, h);
+    if (index != bucket->capacity) {
+        char *new_value = strdup(value);
+        if (!new_value) return 1;
+        free(bucket->slots[index]->value);
+        bucket->slots[index]->value = new_value;
+        return 0;
+    }
+
+    // Key not found, make sure there is room for one more slot
+    if ((bucket->used + 1) * BUCKET_MAX_LOAD_DEN > bucket->capacity * BUCKET_MAX_LOAD_NUM) {
+        // Only double when live pairs fill the bucket, otherwise purging the tombstones is enough
+        size_t new_capacity = bucket->capacity;
+        if ((bucket->count + 1) * BUCKET_MAX_LOAD_DEN * 2 > bucket->capacity * BUCKET_MAX_LOAD_NUM) {
+            new_capacity *= 2;
         }
-        keyNode = keyNode->next; // Move to the next node
+        if (resize_bucket(bucket, new_capacity) != 0) return 1;
     }
 
-    // Key not found, create a new key node
-    keyNode = malloc(sizeof(KeyNode));
+    KeyNode *keyNode = malloc(sizeof(KeyNode));
+    if (!keyNode) return 1;
     keyNode->key = strdup(key); // Allocate memory for the key
     keyNode->value = strdup(value); // Allocate memory for the value
-    keyNode->next = ht->table[index]; // Link to existing nodes
-    ht->table[index] = keyNode; // Place new key node at the start of the list
+    if (!keyNode->key || !keyNode->value) {
+        free(keyNode->key);
+        free(keyNode->value);
+        free(keyNode);
+        return 1;
+    }
+    keyNode->hash = h;
+
+    // Take the first free slot of the probe sequence, reusing tombstones
+    size_t mask = bucket->capacity - 1;
+    size_t i = h & mask;
+    while (bucket->slots[i] != NULL && bucket->slots[i] != TOMBSTONE) {
+        i = (i + 1) & mask;
+    }
+    if (bucket->slots[i] == NULL) {
+        bucket->used++;
+    }
+    bucket->slots[i] = keyNode;
+    bucket->count++;
     return 0;
 }
 
-char* read_pair(HashTable *ht, const char *key) {
-    int index = hash(key);
-    KeyNode *keyNode = ht->table[index];
-    char* value;
+int read_pair(HashTable *ht, const char *key, uint64_t h, char *value) {
+    Bucket *bucket = &ht->table[hash_bucket(h)];
 
-    while (keyNode != NULL) {
-        if (strcmp(keyNode->key, key) == 0) {
-            value = strdup(keyNode->value);
-            return value; // Return copy of the value if found
-        }
-        keyNode = keyNode->next; // Move to the next node
+    size_t index = find_slot(bucket, key, h);
+    if (index == bucket->capacity) {
+        return 1; // Key not found
     }
-    return NULL; // Key not found
+    // Copy the value into the caller's buffer
+    const char *found = bucket->slots[index]->value;
+    size_t len = strnlen(found, MAX_STRING_SIZE - 1);
+    memcpy(value, found, len);
+    value[len] = '\0';
+    return 0;
 }
 
-int delete_pair(HashTable *ht, const char *key) {
-    int index = hash(key);
-    KeyNode *keyNode = ht->table[index];
-    KeyNode *prevNode = NULL;
+int delete_pair(HashTable *ht, const char *key, uint64_t h) {
+    Bucket *bucket = &ht->table[hash_bucket(h)];
 
     // Search for the key node
-    while (keyNode != NULL) {
-        if (strcmp(keyNode->key, key) == 0) {
-            // Key found; delete this node
-            if (prevNode == NULL) {
-                // Node to delete is the first node in the list
-                ht->table[index] = keyNode->next; // Update the table to point to the next node
-            } else {
-                // Node to delete is not the first; bypass it
-                prevNode->next = keyNode->next; // Link the previous node to the next node
-            }
-            // Free the memory allocated for the key and value
-            free(keyNode->key);
-            free(keyNode->value);
-            free(keyNode); // Free the key node itself
-            return 0; // Exit the function
+    size_t index = find_slot(bucket, key, h);
+    if (index == bucket->capacity) {
+        return 1;
+    }
+
+    KeyNode *keyNode = bucket->slots[index];
+    // Leave a tombstone so that the probe sequences going through this slot stay intact
+    bucket->slots[index] = TOMBSTONE;
+    bucket->count--;
+
+    // Free the memory allocated for the key and value
+    free(keyNode->key);
+    free(keyNode->value);
+    free(keyNode); // Free the key node itself
+    return 0;
+}
+
+KeyNode *next_pair(Bucket *bucket, size_t *pos) {
+    while (*pos < bucket->capacity) {
+        KeyNode *keyNode = bucket->slots[(*pos)++];
+        if (keyNode != NULL && keyNode != TOMBSTONE) {
+            return keyNode;
         }
-        prevNode = keyNode; // Move prevNode to current node
-        keyNode = keyNode->next; // Move to the next node
     }
-    
-    return 1;
+    return NULL;
 }
 
 void free_table(HashTable *ht) {
-    rwlock_destroy(&ht->rwlock);
     for (int i = 0; i < TABLE_SIZE; i++) {
         rwlock_destroy(&ht->entry_locks[i]);
-        KeyNode *keyNode = ht->table[i];
-        while (keyNode != NULL) {
-            KeyNode *temp = keyNode;
-            keyNode = keyNode->next;
-            free(temp->key);
-            free(temp->value);
-            free(temp);
+        size_t pos = 0;
+        KeyNode *keyNode;
+        while ((keyNode = next_pair(&ht->table[i], &pos)) != NULL) {
+            free(keyNode->key);
+            free(keyNode->value);
+            free(keyNode);
         }
+        free(ht->table[i].slots);
     }
     free(ht);
-}
\ No newline at end of file
+}
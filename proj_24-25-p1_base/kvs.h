@@ -1,28 +1,69 @@
 #ifndef KEY_VALUE_STORE_H
 #define KEY_VALUE_STORE_H
 
-#define TABLE_SIZE 26
+#define TABLE_BITS 6
+#define TABLE_SIZE (1 << TABLE_BITS)  // Number of buckets, each one with its own lock
+#define BUCKET_INITIAL_CAPACITY 8     // Must be a power of two
+#define BUCKET_MAX_LOAD_NUM 3         // A bucket grows once it is more than
+#define BUCKET_MAX_LOAD_DEN 4         // NUM/DEN full (tombstones included)
+#define PREFETCH_DISTANCE 4           // Keys of a batch prefetched ahead of the one being looked up
 
 #include <stddef.h>
+#include <stdint.h>
 #include <pthread.h>
 
+#include "constants.h"
+
 typedef struct KeyNode {
     char *key;
     char *value;
-    struct KeyNode *next;
+    uint64_t hash;
 } KeyNode;
 
+// Open addressing table with linear probing. Every slot is either NULL
+// (never used), a tombstone (deleted) or a pointer to a KeyNode.
+typedef struct Bucket {
+    KeyNode **slots;
+    size_t capacity;  // Always a power of two
+    size_t count;     // Number of live pairs
+    size_t used;      // Live pairs plus tombstones
+} Bucket;
+
 typedef struct HashTable {
-    KeyNode *table[TABLE_SIZE];
-    pthread_rwlock_t rwlock;
+    Bucket table[TABLE_SIZE];
     pthread_rwlock_t entry_locks[TABLE_SIZE];
 } HashTable;
 
+// Key of a multi-key command, hashed once for all the lookups of the command.
+typedef struct BatchKey {
+    uint64_t hash;
+    size_t index;  // Position of the key in the command
+} BatchKey;
+
+
+/// Full hash of a key, as taken by the pair functions.
+/// @param key Null terminated string.
+/// @return hash.
+uint64_t hash_key(const char *key);
 
-/// Hash function declaration.
-/// @param key Lowercase alphabetical string.
-/// @return Index within the hash table.
-int hash(const char *key);
+/// Gets the bucket of a hashed key.
+/// @param h Hash of the key.
+/// @return Index of the bucket within the hash table.
+int hash_bucket(uint64_t h);
+
+/// Hashes the keys of a command and orders them by bucket, so that each
+/// bucket lock is taken once per command. Keys of the same bucket keep the
+/// order they were given in.
+/// @param num_keys Number of keys.
+/// @param keys The keys.
+/// @param batch Array of num_keys entries that receives the ordered keys.
+void group_keys(size_t num_keys, char keys[][MAX_STRING_SIZE], BatchKey batch[]);
+
+/// Prefetches the slot a hashed key's lookup starts at, so that looking up
+/// the keys of a batch overlaps their cache misses.
+/// @param ht Hash table to prefetch from.
+/// @param h Hash of the key.
+void prefetch_pair(HashTable *ht, uint64_t h);
 
 /// Creates a new event hash table.
 /// @return Newly created hash table, NULL on failure
@@ -31,21 +72,31 @@ struct HashTable *create_hash_table();
 /// Appends a new key value pair to the hash table.
 /// @param ht Hash table to be modified.
 /// @param key Key of the pair to be written.
+/// @param h Hash of the key, as given by hash_key.
 /// @param value Value of the pair to be written.
 /// @return 0 if the node was appended successfully, 1 otherwise.
-int write_pair(HashTable *ht, const char *key, const char *value);
+int write_pair(HashTable *ht, const char *key, uint64_t h, const char *value);
 
-/// Deletes the value of given key.
-/// @param ht Hash table to delete from.
-/// @param key Key of the pair to be deleted.
-/// @return 0 if the node was deleted successfully, 1 otherwise.
-char* read_pair(HashTable *ht, const char *key);
+/// Reads the value of a given key into a caller provided buffer.
+/// @param ht Hash table to read from.
+/// @param key Key of the pair to read.
+/// @param h Hash of the key, as given by hash_key.
+/// @param value Buffer of MAX_STRING_SIZE bytes that receives the value.
+/// @return 0 if the key was found, 1 otherwise.
+int read_pair(HashTable *ht, const char *key, uint64_t h, char *value);
 
 /// Appends a new node to the list.
 /// @param list Event list to be modified.
 /// @param key Key of the pair to read.
+/// @param h Hash of the key, as given by hash_key.
 /// @return 0 if the node was appended successfully, 1 otherwise.
-int delete_pair(HashTable *ht, const char *key);
+int delete_pair(HashTable *ht, const char *key, uint64_t h);
+
+/// Iterates over the pairs stored in a bucket.
+/// @param bucket Bucket to iterate.
+/// @param pos Iteration cursor, must be set to 0 before the first call.
+/// @return The next pair, NULL once every slot was visited.
+KeyNode *next_pair(Bucket *bucket, size_t *pos);
 
 /// Frees the hashtable.
 /// @param ht Hash table to be deleted.
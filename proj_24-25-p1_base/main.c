@@ -12,7 +12,6 @@
 #include <libgen.h> // NEW
 
 #include <time.h>  // NEW
-#include <sys/wait.h> // NEW
 
 #include <pthread.h> // NEW
 
@@ -23,8 +22,6 @@
 #include "utils.h"
 
 
-int active_backups = 0;
-int MAX_BACKUPS = 0;
 
 
 
@@ -32,7 +29,6 @@ int MAX_BACKUPS = 0;
 
 typedef struct {
     char file_path[MAX_FILE_SIZE];
-    int max_backups;
     int backup_count;
 } ThreadArgs;
 
@@ -151,40 +147,16 @@ void process_jobs_file(int file_fd, int out_fd, const char *job_filename, int *b
         break;
 
       case CMD_BACKUP:
-        
-        // Wait until there's an available slot for a backup process
-        while (active_backups >= MAX_BACKUPS) {
-            printf("Waiting for backup to finish...\n");
-            int status;
-            pid_t finished_pid = wait(&status);
-            if (finished_pid > 0) {
-                active_backups--;
-                printf("Backup process %d finished\n", finished_pid);
-            }
-        }
-
         (*backup_count)++;
         char backup_file[MAX_FILE_SIZE];
         create_backup_file(job_filename, *backup_count, backup_file);
 
-        pid_t pid = fork();
-        if (pid == 0) { // Child process
-            printf("Backup process started for %s\n", backup_file);
-
-            if (kvs_backup(backup_file) != 0) {
-                fprintf(stderr, "Backup failed.\n");
-            }
-
-            _exit(0); // Properly exit child process
-        } else if (pid > 0) { // Parent process
-            active_backups++;
-        } else { // Fork failed
-            fprintf(stderr, "Failed to create backup process.\n");
+        // Only the copy of the table happens here, a backup thread writes it
+        if (kvs_backup(backup_file) != 0) {
+            fprintf(stderr, "Backup failed.\n");
         }
         break;
 
-
-
       case CMD_INVALID:
         fprintf(stderr, "Invalid command. See HELP for usage\n");
         break;
@@ -215,7 +187,6 @@ void process_jobs_file(int file_fd, int out_fd, const char *job_filename, int *b
 void *process_file_thread(void *arg) {
     ThreadArgs *args = (ThreadArgs *)arg;
     const char *file_path = args->file_path;
-    MAX_BACKUPS = args->max_backups;
 
     char out_file_name[MAX_OUT_FILE_SIZE];
     char file_base[MAX_FILE_SIZE];
@@ -265,6 +236,12 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
+    if (max_backups <= 0 || kvs_backups_init((size_t)max_backups)) {
+        fprintf(stderr, "Failed to start the backup threads\n");
+        kvs_terminate();
+        return 1;
+    }
+
     DIR *d;
     struct dirent *dir;
     pthread_t threads[max_threads];
@@ -295,7 +272,6 @@ int main(int argc, char *argv[]) {
 
         ThreadArgs *args = &thread_args[thread_count];
         strncpy(args->file_path, job_files[i], MAX_FILE_SIZE);
-        args->max_backups = max_backups;
         args->backup_count = 0;
 
         if (pthread_create(&threads[thread_count], NULL, process_file_thread, &thread_args[thread_count]) != 0) {
@@ -1,3 +1,5 @@
+#include <errno.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,6 +16,24 @@
 
 static struct HashTable* kvs_table = NULL;
 
+// Backups are written by a pool of threads from a copy of the table, a
+// BACKUP only holds its job thread while the pairs are copied.
+typedef struct BackupRequest {
+  char path[MAX_FILE_SIZE];
+  char *contents;  // The pairs, already in the SHOW format
+  size_t length;
+  struct BackupRequest *next;
+} BackupRequest;
+
+static pthread_t *backup_threads = NULL;
+static size_t num_backup_threads = 0;
+static BackupRequest *backups_head = NULL;  // Requests not yet taken by a thread
+static BackupRequest *backups_tail = NULL;
+static size_t pending_backups = 0;          // Requested but not yet written
+static bool stop_backups = false;
+static pthread_mutex_t backups_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t backups_changed = PTHREAD_COND_INITIALIZER;
+
 /// Calculates a timespec from a delay in milliseconds.
 /// @param delay_ms Delay in milliseconds.
 /// @return Timespec with the given delay.
@@ -32,6 +52,156 @@ int kvs_init() {
   return kvs_table == NULL;
 }
 
+/// Writes every byte of a buffer, retrying on short writes.
+/// @param fd File descriptor to write to.
+/// @param contents The bytes.
+/// @param length Number of bytes.
+/// @return 0 on success, 1 on failure.
+static int write_contents(int fd, const char *contents, size_t length) {
+  size_t done = 0;
+  while (done < length) {
+    ssize_t written = write(fd, contents + done, length - done);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return 1;
+    }
+    done += (size_t)written;
+  }
+  return 0;
+}
+
+/// Copies every pair in the SHOW format. Every bucket is locked at once, so
+/// that the copy is the state of the table at a single point: writers only
+/// wait for the copy, not for it to be written out. The pairs are not
+/// versioned here, a reader would need to know when an old value can be
+/// freed, so the copy stays stop-the-world and is kept to a single pass.
+/// @param length Receives the length of the copy.
+/// @return the copy, to be freed by the caller, NULL on failure.
+static char *copy_pairs(size_t *length) {
+  size_t capacity = 4096;  // Doubled as needed
+  char *contents = malloc(capacity);
+
+  for (int i = 0; i < TABLE_SIZE; i++) {
+    rwlock_rdlock(&kvs_table->entry_locks[i]);
+  }
+
+  *length = 0;
+  for (int i = 0; i < TABLE_SIZE && contents != NULL; i++) {
+    size_t pos = 0;
+    KeyNode *keyNode;
+    while (contents != NULL && (keyNode = next_pair(&kvs_table->table[i], &pos)) != NULL) {
+      // "(" + key + ", " + value + ")\n"
+      size_t needed = strlen(keyNode->key) + strlen(keyNode->value) + 5;
+      if (*length + needed + 1 > capacity) {
+        while (*length + needed + 1 > capacity) {
+          capacity *= 2;
+        }
+        char *grown = realloc(contents, capacity);
+        if (grown == NULL) {
+          free(contents);
+        }
+        contents = grown;
+        if (contents == NULL) {
+          break;
+        }
+      }
+      int written = snprintf(contents + *length, capacity - *length, "(%s, %s)\n",
+                             keyNode->key, keyNode->value);
+      *length += (size_t)written;
+    }
+  }
+
+  for (int i = 0; i < TABLE_SIZE; i++) {
+    rwlock_unlock(&kvs_table->entry_locks[i]);
+  }
+  return contents;
+}
+
+/// Writes the backups requested to the pool, until it is stopped.
+static void *write_backups() {
+  mutex_lock(&backups_lock);
+  while (1) {
+    while (backups_head == NULL && !stop_backups) {
+      pthread_cond_wait(&backups_changed, &backups_lock);
+    }
+    if (backups_head == NULL) {
+      break;  // Stopped, and every request was taken
+    }
+    BackupRequest *request = backups_head;
+    backups_head = request->next;
+    if (backups_head == NULL) {
+      backups_tail = NULL;
+    }
+    mutex_unlock(&backups_lock);
+
+    // Written next to the backup file and renamed over it once complete, the
+    // backup file is never left half written
+    char temp_path[MAX_FILE_SIZE + sizeof(".tmp")];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", request->path);
+    int backup_fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (backup_fd == -1) {
+      fprintf(stderr, "Failed to open backup file\n");
+    } else {
+      int failed = write_contents(backup_fd, request->contents, request->length);
+      if (close(backup_fd) != 0 || failed || rename(temp_path, request->path) != 0) {
+        fprintf(stderr, "Failed to write backup file\n");
+        unlink(temp_path);
+      }
+    }
+    free(request->contents);
+    free(request);
+
+    mutex_lock(&backups_lock);
+    pending_backups--;
+    pthread_cond_broadcast(&backups_changed);
+  }
+  mutex_unlock(&backups_lock);
+  return NULL;
+}
+
+/// Stops the backup threads once every requested backup is written.
+static void stop_backup_threads() {
+  if (num_backup_threads == 0) {
+    return;
+  }
+
+  mutex_lock(&backups_lock);
+  stop_backups = true;
+  pthread_cond_broadcast(&backups_changed);
+  mutex_unlock(&backups_lock);
+
+  for (size_t i = 0; i < num_backup_threads; i++) {
+    pthread_join(backup_threads[i], NULL);
+  }
+  free(backup_threads);
+  backup_threads = NULL;
+  num_backup_threads = 0;
+}
+
+int kvs_backups_init(size_t max_backups) {
+  if (num_backup_threads != 0) {
+    fprintf(stderr, "Backups have already been initialized\n");
+    return 1;
+  }
+
+  backup_threads = malloc(max_backups * sizeof(pthread_t));
+  if (backup_threads == NULL) {
+    return 1;
+  }
+
+  stop_backups = false;
+  for (; num_backup_threads < max_backups; num_backup_threads++) {
+    if (pthread_create(&backup_threads[num_backup_threads], NULL, write_backups, NULL) != 0) {
+      fprintf(stderr, "Failed to create backup thread\n");
+      stop_backup_threads();
+      return 1;
+    }
+  }
+  return 0;
+}
+
 int kvs_terminate() {
   //Verify if the hash table is initialized
   if (kvs_table == NULL) {
@@ -39,11 +209,68 @@ int kvs_terminate() {
     return 1;
   }
 
+  stop_backup_threads();
   free_table(kvs_table);
 
   return 0;
 }
 
+/// Operation run on a key of a batch, with the key's bucket locked.
+/// @param key The key.
+/// @param h Hash of the key.
+/// @param index Position of the key in the command.
+/// @param ctx Context given to run_batch.
+typedef void (*BatchOp)(const char *key, uint64_t h, size_t index, void *ctx);
+
+/// Runs an operation on every key of a command. Keys are grouped by bucket
+/// and each bucket is locked once, in ascending order so that commands
+/// cannot deadlock, with the lookups of a group prefetched ahead.
+/// @param num_keys Number of keys.
+/// @param keys The keys.
+/// @param exclusive Whether the buckets are locked for writing.
+/// @param op Operation to run on each key.
+/// @param ctx Context given to op.
+static void run_batch(size_t num_keys, char keys[][MAX_STRING_SIZE], bool exclusive,
+                      BatchOp op, void *ctx) {
+  BatchKey batch[num_keys];
+  group_keys(num_keys, keys, batch);
+
+  size_t start = 0;
+  while (start < num_keys) {
+    int bucket = hash_bucket(batch[start].hash);
+    size_t end = start;
+    while (end < num_keys && hash_bucket(batch[end].hash) == bucket) {
+      end++;
+    }
+
+    if (exclusive) {
+      rwlock_wrlock(&kvs_table->entry_locks[bucket]);
+    } else {
+      rwlock_rdlock(&kvs_table->entry_locks[bucket]);
+    }
+
+    for (size_t i = start; i < end && i < start + PREFETCH_DISTANCE; i++) {
+      prefetch_pair(kvs_table, batch[i].hash);
+    }
+    for (size_t i = start; i < end; i++) {
+      if (i + PREFETCH_DISTANCE < end) {
+        prefetch_pair(kvs_table, batch[i + PREFETCH_DISTANCE].hash);
+      }
+      op(keys[batch[i].index], batch[i].hash, batch[i].index, ctx);
+    }
+
+    rwlock_unlock(&kvs_table->entry_locks[bucket]);
+    start = end;
+  }
+}
+
+static void write_op(const char *key, uint64_t h, size_t index, void *ctx) {
+  char (*values)[MAX_STRING_SIZE] = ctx;
+  if (write_pair(kvs_table, key, h, values[index]) != 0) {
+    fprintf(stderr, "Failed to write keypair (%s,%s)\n", key, values[index]);
+  }
+}
+
 int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE]) {
   //Verify if the hash table is initialized  
   if (kvs_table == NULL) {
@@ -51,18 +278,19 @@ int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_
     return 1;
   }
 
-  for (size_t i = 0; i < num_pairs; i++) {
-    int index = hash(keys[i]);
-    rwlock_wrlock(&kvs_table->entry_locks[index]); // Lock the entry before writing
-
-    if (write_pair(kvs_table, keys[i], values[i]) != 0) {
-      fprintf(stderr, "Failed to write keypair (%s,%s)\n", keys[i], values[i]);
-    }
+  run_batch(num_pairs, keys, true, write_op, values);
+  return 0;
+}
 
-    rwlock_unlock(&kvs_table->entry_locks[index]); // Unlock the entry after writing
-  }
+// Results of a READ command, one entry per key.
+typedef struct {
+  char (*values)[MAX_STRING_SIZE];
+  int *missing;
+} ReadResults;
 
-  return 0;
+static void read_op(const char *key, uint64_t h, size_t index, void *ctx) {
+  ReadResults *results = ctx;
+  results->missing[index] = read_pair(kvs_table, key, h, results->values[index]);
 }
 
 int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], int out_fd) {
@@ -76,28 +304,26 @@ int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], int out_fd) {
   // Sort the keys array to ensure a consistent order
   qsort(keys, num_pairs, MAX_STRING_SIZE, (int (*)(const void *, const void *))strcmp);
 
+  // Look every key up first, the output is written once the locks are released
+  char values[num_pairs][MAX_STRING_SIZE];
+  int missing[num_pairs];
+  ReadResults results = {values, missing};
+  run_batch(num_pairs, keys, false, read_op, &results);
+
   write(out_fd, "[", 1);
 
   for (size_t i = 0; i < num_pairs; i++) {
-    int index = hash(keys[i]);
-    rwlock_rdlock(&kvs_table->entry_locks[index]); // Lock the entry before reading
-
-    char *result = read_pair(kvs_table, keys[i]);
-
-    rwlock_unlock(&kvs_table->entry_locks[index]); // Unlock the entry after reading
-    
     write(out_fd, "(", 1);
     write(out_fd, keys[i], strlen(keys[i]));
     write(out_fd, ",", 1);
     
     // Write the result or error message
-    if (result == NULL) {
+    if (missing[i]) {
       const char *error_str = "KVSERROR";
       write(out_fd, error_str, strlen(error_str));
     } else {
-      write(out_fd, result, strlen(result));
+      write(out_fd, values[i], strlen(values[i]));
     }
-    free(result);
     
     // Close parenthesis
     write(out_fd, ")", 1);
@@ -108,6 +334,10 @@ int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], int out_fd) {
   return 0;
 }
 
+static void delete_op(const char *key, uint64_t h, size_t index, void *ctx) {
+  int *missing = ctx;
+  missing[index] = delete_pair(kvs_table, key, h);
+}
 
 int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], int out_fd) {
   //Verify if the hash table is initialized
@@ -116,7 +346,9 @@ int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], int out_fd) {
     return 1;
   }
 
-  rwlock_wrlock(&kvs_table->rwlock); // Lock the table before deleting
+  // Only the buckets of the keys are locked, each one once
+  int missing[num_pairs];
+  run_batch(num_pairs, keys, true, delete_op, missing);
 
   // Start building the output string
   char buffer[1024] = "[";  // Buffer to store the result
@@ -124,29 +356,21 @@ int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], int out_fd) {
   int missing_found = 0;    // Flag to indicate if any KVSMISSING was found
 
   for (size_t i = 0; i < num_pairs; i++) {
-    int index = hash(keys[i]);
-    rwlock_wrlock(&kvs_table->entry_locks[index]); // Lock the entry before deleting
-
-    // Attempt to delete the pair
-    if (delete_pair(kvs_table, keys[i]) != 0) {
+    if (missing[i]) {
       // Add the error message to the buffer
       int written = snprintf(buffer + buffer_len, sizeof(buffer) - buffer_len,
                              "(%s,KVSMISSING)", keys[i]);
       if (written < 0) {
         fprintf(stderr, "Error formatting string\n");
-        rwlock_unlock(&kvs_table->rwlock);
         return 1;
       }
       buffer_len += (size_t)written; // Update buffer length
       missing_found = 1;            // Mark that at least one missing key was found
     }
-
-    rwlock_unlock(&kvs_table->entry_locks[index]); // Unlock the entry after deleting
   }
 
   // If no missing keys were found, do not write anything to the output file
   if (!missing_found) {
-    rwlock_unlock(&kvs_table->rwlock); // Unlock before returning
     return 0;
   }
 
@@ -157,13 +381,11 @@ int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], int out_fd) {
     buffer[buffer_len] = '\0';
   } else {
     fprintf(stderr, "Buffer overflow while finalizing results\n");
-    rwlock_unlock(&kvs_table->rwlock);
     return 1;
   }
 
   // Write the entire output to the file descriptor
   write(out_fd, buffer, buffer_len);
-  rwlock_unlock(&kvs_table->rwlock); // Unlock after writing
   return 0;
 }
 
@@ -176,23 +398,15 @@ void kvs_show(int out_fd) {
     return;
   }
 
-  rwlock_wrlock(&kvs_table->rwlock); // Write lock before showing the table
-
-  for (int i = 0; i < TABLE_SIZE; i++) {
-    KeyNode *keyNode = kvs_table->table[i];
-    while (keyNode != NULL) {
-      // Print "(key, value)\n" for each key-value pair
-      write(out_fd, "(", 1);
-      write(out_fd, keyNode->key, strlen(keyNode->key));
-      write(out_fd, ", ", 2);
-      write(out_fd, keyNode->value, strlen(keyNode->value));
-      write(out_fd, ")\n", 2);
-
-      keyNode = keyNode->next; // Move to the next node
-    }
+  // Printed once the buckets are unlocked, writers only wait for the copy
+  size_t length;
+  char *contents = copy_pairs(&length);
+  if (contents == NULL) {
+    fprintf(stderr, "Failed to copy the table\n");
+    return;
   }
-
-  rwlock_unlock(&kvs_table->rwlock); // Unlock after showing the table
+  write_contents(out_fd, contents, length);
+  free(contents);
 }
 
 int kvs_backup(const char *backup_file) {
@@ -200,18 +414,47 @@ int kvs_backup(const char *backup_file) {
     fprintf(stderr, "KVS state must be initialized\n");
     return 1;
   }
+  if (num_backup_threads == 0) {
+    fprintf(stderr, "Backups must be initialized\n");
+    return 1;
+  }
 
-  int backup_fd = open(backup_file, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
-  if (backup_fd == -1) {
-    fprintf(stderr, "Failed to open backup file\n");
+  BackupRequest *request = malloc(sizeof(BackupRequest));
+  if (request == NULL) {
+    return 1;
+  }
+  strncpy(request->path, backup_file, sizeof(request->path) - 1);
+  request->path[sizeof(request->path) - 1] = '\0';
+  request->next = NULL;
+
+  request->contents = copy_pairs(&request->length);
+  if (request->contents == NULL) {
+    fprintf(stderr, "Failed to copy the table for the backup\n");
+    free(request);
     return 1;
   }
 
-  kvs_show(backup_fd);
-  close(backup_fd);
+  mutex_lock(&backups_lock);
+  if (backups_tail == NULL) {
+    backups_head = request;
+  } else {
+    backups_tail->next = request;
+  }
+  backups_tail = request;
+  pending_backups++;
+  pthread_cond_broadcast(&backups_changed);
+  mutex_unlock(&backups_lock);
   return 0;
 }
 
+void kvs_wait_backup() {
+  mutex_lock(&backups_lock);
+  while (pending_backups > 0) {
+    pthread_cond_wait(&backups_changed, &backups_lock);
+  }
+  mutex_unlock(&backups_lock);
+}
+
 void kvs_wait(unsigned int delay_ms) {
   struct timespec delay = delay_to_timespec(delay_ms);
   nanosleep(&delay, NULL);
@@ -36,12 +36,21 @@ int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], int out_fd);
 /// @param fd File descriptor to write the output.
 void kvs_show(int out_fd);
 
+/// Starts the threads that write the backups.
+/// @param max_backups Number of backups written at the same time.
+/// @return 0 if the threads were started, 1 otherwise.
+int kvs_backups_init(size_t max_backups);
+
 /// Creates a backup of the KVS state and stores it in the correspondent
-/// backup file
+/// backup file. The calling thread only copies the pairs, the file is
+/// written by a backup thread.
 /// @param backup_file Path to the backup file.
-/// @return 0 if the backup was successful, 1 otherwise.
+/// @return 0 if the backup was requested, 1 otherwise.
 int kvs_backup(const char *backup_file);
 
+/// Waits for every requested backup to be written.
+void kvs_wait_backup();
+
 /// Waits for a given amount of time.
 /// @param delay_us Delay in milliseconds.
 void kvs_wait(unsigned int delay_ms);
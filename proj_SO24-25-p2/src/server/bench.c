@@ -0,0 +1,85 @@
+// Lookup benchmark for the table engines: fills a table and measures how many
+// read_pair calls per second it serves, for present and for missing keys.
+// Built by `make bench`, once per engine (kvs_bench and kvs_bench_swiss).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "kvs.h"
+
+#define BENCH_DEFAULT_KEYS 500000
+#define BENCH_ROUNDS 5
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/// Reads every key of a family once per round.
+/// @param ht The hash table.
+/// @param num_keys Number of keys.
+/// @param prefix Prefix of the keys ("key" exist, "miss" do not).
+/// @param found Incremented for each key found.
+/// @return lookups per second.
+static double lookup_rate(HashTable *ht, size_t num_keys, const char *prefix, size_t *found) {
+  char key[MAX_STRING_SIZE];
+  char value[MAX_VALUE_SIZE];
+  double start = now_seconds();
+  for (int round = 0; round < BENCH_ROUNDS; round++) {
+    for (size_t i = 0; i < num_keys; i++) {
+      snprintf(key, sizeof(key), "%s%zu", prefix, i * 7919 % num_keys);
+      if (read_pair(ht, key, value) == 0) {
+        (*found)++;
+      }
+    }
+  }
+  return (double)num_keys * BENCH_ROUNDS / (now_seconds() - start);
+}
+
+int main(int argc, char *argv[]) {
+  size_t num_keys = BENCH_DEFAULT_KEYS;
+  if (argc > 1) {
+    num_keys = strtoul(argv[1], NULL, 10);
+  }
+  if (num_keys == 0) {
+    fprintf(stderr, "Usage: %s [num_keys]\n", argv[0]);
+    return 1;
+  }
+
+  HashTable *ht = create_hash_table();
+  if (ht == NULL) {
+    fprintf(stderr, "Failed to create the table\n");
+    return 1;
+  }
+
+  char key[MAX_STRING_SIZE];
+  double start = now_seconds();
+  for (size_t i = 0; i < num_keys; i++) {
+    snprintf(key, sizeof(key), "key%zu", i);
+    size_t index = stripe_index(key);
+    stripe_write_lock(ht, index);
+    int failed = write_pair(ht, key, "value");
+    stripe_write_unlock(ht, index);
+    if (failed) {
+      fprintf(stderr, "Failed to write %s\n", key);
+      free_table(ht);
+      return 1;
+    }
+  }
+  double insert_rate = (double)num_keys / (now_seconds() - start);
+
+  size_t hits = 0;
+  size_t misses = 0;
+  double hit_rate = lookup_rate(ht, num_keys, "key", &hits);
+  double miss_rate = lookup_rate(ht, num_keys, "miss", &misses);
+
+  printf("engine %s, %zu keys\n", KVS_ENGINE, num_keys);
+  printf("  inserts: %10.0f /s\n", insert_rate);
+  printf("  hits:    %10.0f /s (%zu found)\n", hit_rate, hits);
+  printf("  misses:  %10.0f /s (%zu found)\n", miss_rate, misses);
+
+  free_table(ht);
+  return 0;
+}
@@ -1,3 +1,5 @@
 #define MAX_WRITE_SIZE 256
 #define MAX_STRING_SIZE 40
 #define MAX_JOB_FILE_NAME_SIZE 256
+#define MAX_VALUE_SIZE 4096  // Values, unlike keys, are not limited to MAX_STRING_SIZE
+#define MAX_SHARDS 64  // Independent tables the store may be split in
@@ -0,0 +1,163 @@
+#include "epoch.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#define RETIRE_LIST_INITIAL_CAPACITY 64
+
+// Per thread announcement of the epoch it is reading in (0 when quiescent).
+// Records are never freed, a record whose thread exited is reused.
+typedef struct EpochRecord {
+  _Atomic uint64_t local;
+  atomic_bool in_use;
+  unsigned int nesting;  // Only touched by the owning thread
+  struct EpochRecord *next;
+} EpochRecord;
+
+static _Atomic uint64_t global_epoch = 1;
+static _Atomic(EpochRecord *) records = NULL;
+
+static pthread_key_t record_key;
+static pthread_once_t record_key_once = PTHREAD_ONCE_INIT;
+static _Thread_local EpochRecord *self = NULL;
+
+// Hands the record of an exiting thread back to the pool.
+static void release_record(void *arg) {
+  EpochRecord *record = arg;
+  atomic_store(&record->local, 0);
+  atomic_store(&record->in_use, false);
+}
+
+static void create_record_key(void) {
+  pthread_key_create(&record_key, release_record);
+}
+
+// Gets a record for the calling thread, reusing a free one when possible.
+// Returns the record, NULL if none could be allocated.
+static EpochRecord *acquire_record(void) {
+  pthread_once(&record_key_once, create_record_key);
+
+  for (EpochRecord *record = atomic_load(&records); record != NULL; record = record->next) {
+    bool expected = false;
+    if (atomic_compare_exchange_strong(&record->in_use, &expected, true)) {
+      record->nesting = 0;
+      pthread_setspecific(record_key, record);
+      return record;
+    }
+  }
+
+  EpochRecord *record = malloc(sizeof(EpochRecord));
+  if (record == NULL) {
+    return NULL;
+  }
+  atomic_init(&record->local, 0);
+  atomic_init(&record->in_use, true);
+  record->nesting = 0;
+  record->next = atomic_load(&records);
+  while (!atomic_compare_exchange_weak(&records, &record->next, record))
+    ;
+  pthread_setspecific(record_key, record);
+  return record;
+}
+
+void epoch_enter(void) {
+  if (self == NULL) {
+    self = acquire_record();
+    if (self == NULL) {
+      abort();  // Readers cannot run unprotected
+    }
+  }
+  if (self->nesting++ == 0) {
+    // seq_cst, so that the announcement is visible before any shared load
+    atomic_store(&self->local, atomic_load(&global_epoch));
+  }
+}
+
+void epoch_exit(void) {
+  if (--self->nesting == 0) {
+    atomic_store_explicit(&self->local, 0, memory_order_release);
+  }
+}
+
+// Moves the global epoch forward if every active reader has observed it.
+// Returns the (possibly new) global epoch.
+static uint64_t try_advance(void) {
+  uint64_t epoch = atomic_load(&global_epoch);
+  for (EpochRecord *record = atomic_load(&records); record != NULL; record = record->next) {
+    uint64_t local = atomic_load(&record->local);
+    if (local != 0 && local != epoch) {
+      return epoch;  // A reader is still in an older epoch
+    }
+  }
+  if (atomic_compare_exchange_strong(&global_epoch, &epoch, epoch + 1)) {
+    return epoch + 1;
+  }
+  return epoch;  // Someone else advanced it, epoch holds the new value
+}
+
+void epoch_synchronize(void) {
+  uint64_t target = atomic_load(&global_epoch) + 2;
+  while (try_advance() < target) {
+    sched_yield();
+  }
+}
+
+void retire_list_init(RetireList *list) {
+  list->items = NULL;
+  list->head = 0;
+  list->tail = 0;
+  list->capacity = 0;
+}
+
+int retire(RetireList *list, void *ptr) {
+  if (list->tail == list->capacity) {
+    // Reclaim the space of released items before growing
+    if (list->head > 0) {
+      for (size_t i = list->head; i < list->tail; i++) {
+        list->items[i - list->head] = list->items[i];
+      }
+      list->tail -= list->head;
+      list->head = 0;
+    }
+    if (list->tail == list->capacity) {
+      size_t capacity = list->capacity ? list->capacity * 2 : RETIRE_LIST_INITIAL_CAPACITY;
+      RetiredItem *items = realloc(list->items, capacity * sizeof(RetiredItem));
+      if (items == NULL) {
+        return 1;
+      }
+      list->items = items;
+      list->capacity = capacity;
+    }
+  }
+  list->items[list->tail].ptr = ptr;
+  list->items[list->tail].epoch = atomic_load(&global_epoch);
+  list->tail++;
+  return 0;
+}
+
+void retire_collect(RetireList *list, void (*release)(void *ctx, void *ptr), void *ctx) {
+  if (list->head == list->tail) {
+    return;
+  }
+  uint64_t epoch = try_advance();
+  // Items are in retirement order, so the released ones form a prefix
+  while (list->head < list->tail && list->items[list->head].epoch + 2 <= epoch) {
+    release(ctx, list->items[list->head].ptr);
+    list->head++;
+  }
+  if (list->head == list->tail) {
+    list->head = 0;
+    list->tail = 0;
+  }
+}
+
+void retire_list_destroy(RetireList *list, void (*release)(void *ctx, void *ptr), void *ctx) {
+  for (size_t i = list->head; i < list->tail; i++) {
+    release(ctx, list->items[i].ptr);
+  }
+  free(list->items);
+  retire_list_init(list);
+}
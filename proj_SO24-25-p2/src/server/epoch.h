@@ -0,0 +1,58 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Epoch based reclamation. Lock-free readers run between epoch_enter and
+// epoch_exit; memory they may still be looking at is retired instead of
+// freed, and only released once every thread has left the epoch in which
+// it was retired (the global epoch moved two steps ahead of it).
+
+typedef struct {
+  void *ptr;
+  uint64_t epoch;  // Global epoch when the pointer was retired
+} RetiredItem;
+
+// Retired pointers waiting for their grace period, in retirement order.
+// Not thread safe, the owner must serialize the calls.
+typedef struct {
+  RetiredItem *items;
+  size_t head;      // First item still waiting
+  size_t tail;      // One past the last item
+  size_t capacity;
+} RetireList;
+
+// Marks the calling thread as reading shared memory. Calls may be nested.
+void epoch_enter(void);
+
+// Leaves the section started by the matching epoch_enter.
+void epoch_exit(void);
+
+// Initializes an empty retire list.
+// @param list The list.
+void retire_list_init(RetireList *list);
+
+// Queues a pointer to be released once no reader can be using it.
+// @param list The list.
+// @param ptr The pointer.
+// Returns 0 on success, 1 if the list could not grow (the pointer was not queued).
+int retire(RetireList *list, void *ptr);
+
+// Releases the retired pointers whose grace period is over.
+// @param list The list.
+// @param release Function called for each released pointer.
+// @param ctx Passed to release.
+void retire_collect(RetireList *list, void (*release)(void *ctx, void *ptr), void *ctx);
+
+// Waits until every reader that might hold a reference to something retired
+// so far has left its read-side section.
+void epoch_synchronize(void);
+
+// Releases every retired pointer without waiting, for teardown.
+// @param list The list.
+// @param release Function called for each released pointer.
+// @param ctx Passed to release.
+void retire_list_destroy(RetireList *list, void (*release)(void *ctx, void *ptr), void *ctx);
+
+#endif // EPOCH_H
@@ -0,0 +1,88 @@
+#include "file_writer.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+// Syncs the directory holding a file, which makes a rename into it durable.
+// @param path Path of the file.
+// Returns 0 on success, 1 on failure.
+static int sync_directory(const char *path) {
+  const char *slash = strrchr(path, '/');
+  char directory[FILE_WRITER_PATH_SIZE];
+  snprintf(directory, sizeof(directory), "%.*s", slash != NULL ? (int)(slash - path + 1) : 1,
+           slash != NULL ? path : ".");
+  int dir_fd = open(directory, O_RDONLY);
+  if (dir_fd == -1) {
+    return 1;
+  }
+  int failed = fsync(dir_fd) != 0;
+  close(dir_fd);
+  return failed;
+}
+
+int file_writer_open(FileWriter *writer, const char *path) {
+  if (strlen(path) >= MAX_JOB_FILE_NAME_SIZE) {
+    return 1;
+  }
+  strcpy(writer->path, path);
+  snprintf(writer->temp_path, sizeof(writer->temp_path), "%s%s", path, FILE_WRITER_TEMP_SUFFIX);
+
+  writer->fd = open(writer->temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (writer->fd == -1) {
+    return 1;
+  }
+  if (output_open(&writer->out, writer->fd, FILE_WRITER_BUFFER_SIZE) != 0) {
+    close(writer->fd);
+    unlink(writer->temp_path);
+    return 1;
+  }
+  return 0;
+}
+
+int file_writer_write(FileWriter *writer, const void *data, size_t length) {
+  return output_write(&writer->out, data, length);
+}
+
+int file_writer_flush(FileWriter *writer) {
+  return output_flush(&writer->out);
+}
+
+int file_writer_commit(FileWriter *writer, bool sync) {
+  if (file_writer_flush(writer) != 0 || (sync && fsync(writer->fd) != 0)) {
+    file_writer_abort(writer);
+    return 1;
+  }
+  output_close(&writer->out);
+  if (close(writer->fd) != 0 || rename(writer->temp_path, writer->path) != 0) {
+    unlink(writer->temp_path);
+    return 1;
+  }
+  // The rename is only durable once the directory is
+  return sync ? sync_directory(writer->path) : 0;
+}
+
+int file_writer_link(const char *path, const char *target, bool sync) {
+  if (strlen(target) >= MAX_JOB_FILE_NAME_SIZE) {
+    return 1;
+  }
+  // Through a temporary name too, link fails on a target that exists
+  char temp_path[FILE_WRITER_PATH_SIZE];
+  snprintf(temp_path, sizeof(temp_path), "%s%s", target, FILE_WRITER_TEMP_SUFFIX);
+  unlink(temp_path);
+  if (link(path, temp_path) != 0) {
+    return 1;
+  }
+  if (rename(temp_path, target) != 0) {
+    unlink(temp_path);
+    return 1;
+  }
+  return sync ? sync_directory(target) : 0;
+}
+
+void file_writer_abort(FileWriter *writer) {
+  output_close(&writer->out);
+  close(writer->fd);
+  unlink(writer->temp_path);
+}
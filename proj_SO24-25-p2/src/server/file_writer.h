@@ -0,0 +1,68 @@
+#ifndef FILE_WRITER_H
+#define FILE_WRITER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "constants.h"
+#include "output.h"
+
+#define FILE_WRITER_BUFFER_SIZE (1 << 20)  // Bytes gathered before each write
+#define FILE_WRITER_TEMP_SUFFIX ".tmp"
+#define FILE_WRITER_PATH_SIZE (MAX_JOB_FILE_NAME_SIZE + sizeof(FILE_WRITER_TEMP_SUFFIX))
+
+// Writes a file through an Output with large buffers, so that however small
+// the pieces added are, the file takes one system call per
+// FILE_WRITER_BUFFER_SIZE bytes.
+//
+// The data goes to a temporary file next to the target, which is only
+// renamed over the target once complete: the target is either its previous
+// version or the whole new one, even if the server crashes halfway.
+// Not thread safe.
+typedef struct {
+  int fd;               // Of the temporary file
+  Output out;
+  char path[FILE_WRITER_PATH_SIZE];
+  char temp_path[FILE_WRITER_PATH_SIZE];
+} FileWriter;
+
+// Creates the temporary file of a target, replacing any left by a crash.
+// @param writer The writer.
+// @param path Path of the target.
+// Returns 0 on success, 1 on failure.
+int file_writer_open(FileWriter *writer, const char *path);
+
+// Adds bytes to the file.
+// @param writer The writer.
+// @param data The bytes.
+// @param length Number of bytes.
+// Returns 0 on success, 1 if this or an earlier write failed.
+int file_writer_write(FileWriter *writer, const void *data, size_t length);
+
+// Writes out what is buffered, so that writer->fd holds every byte added.
+// Once flushed, the file may be written to at an offset by pwrite.
+// @param writer The writer.
+// Returns 0 on success, 1 if this or an earlier write failed.
+int file_writer_flush(FileWriter *writer);
+
+// Flushes and closes the file and renames it over the target. Does nothing
+// but discard it if a write failed.
+// @param writer The writer.
+// @param sync Whether to fsync the file before the rename and its directory
+// after it, so that the new version survives a crash of the system too.
+// Returns 0 on success, 1 on failure.
+int file_writer_commit(FileWriter *writer, bool sync);
+
+// Gives a committed file another name, by a hard link: both names share the
+// data, written once. The target is replaced the same way as by a commit.
+// @param path Path of the file.
+// @param target The other name.
+// @param sync Whether to sync the directory of the target after.
+// Returns 0 on success, 1 on failure.
+int file_writer_link(const char *path, const char *target, bool sync);
+
+// Closes and removes the temporary file, leaving the target as it was.
+// @param writer The writer.
+void file_writer_abort(FileWriter *writer);
+
+#endif // FILE_WRITER_H
@@ -1,119 +1,1246 @@
 #include "kvs.h"
 #include "string.h"
-#include <ctype.h>
 
+#include <sched.h>
 #include <stdlib.h>
+#include <time.h>
 
-// Hash function based on key initial.
-// @param key Lowercase alphabetical string.
+// Marks a slot whose pair was deleted, so that probing goes on past it.
+static KeyNode tombstone;
+#define TOMBSTONE (&tombstone)
+
+// Retired slot arrays and values are tagged in their low bits to tell them
+// from nodes.
+#define ARRAY_TAG ((uintptr_t)1)
+#define VALUE_TAG ((uintptr_t)2)
+#define RETIRED_TAGS (ARRAY_TAG | VALUE_TAG)
+
+// Slot accessors. Writers publish with release so that a reader that sees a
+// pointer also sees the node it points to.
+#define SLOT_LOAD(array, i) atomic_load_explicit(&(array)->slots[i], memory_order_acquire)
+#define SLOT_STORE(array, i, node) atomic_store_explicit(&(array)->slots[i], (node), memory_order_release)
+
+// Writers stamp new values with current_version. Starting a snapshot moves it
+// forward while no write is in progress, so a snapshot sees exactly the
+// values stamped with its own version or an older one.
+static _Atomic uint64_t current_version = 1;
+static pthread_mutex_t snapshots_lock = PTHREAD_MUTEX_INITIALIZER;
+static Snapshot *oldest = NULL;                 // Active snapshots, by version
+static Snapshot *newest = NULL;
+static _Atomic uint64_t oldest_snapshot = 0;    // Version of oldest, 0 if none
+
+#ifdef KVS_SWISS_TABLE
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Control bytes: a full slot holds the 7 bit fingerprint of its key's hash,
+// free slots have the high bit set so that one sign mask finds them all.
+#define CTRL_EMPTY ((uint8_t)0x80)
+#define CTRL_DELETED ((uint8_t)0xFE)
+
+// Fingerprint of a hash, taken from bits used neither by the stripe nor by
+// the slot index.
+static uint8_t fingerprint(uint64_t h) {
+    return (uint8_t)((h >> (64 - TABLE_STRIPE_BITS - 7)) & 0x7f);
+}
+
+// Compares the control bytes of a group with a value.
+// @param ctrl First control byte of the group.
+// @param byte Value to look for.
+// @return bit mask with bit i set if ctrl[i] == byte.
+static uint32_t group_match(const uint8_t *ctrl, uint8_t byte) {
+#ifdef __SSE2__
+    __m128i group = _mm_loadu_si128((const __m128i *)(const void *)ctrl);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)byte)));
+#else
+    uint32_t mask = 0;
+    for (unsigned int i = 0; i < GROUP_SIZE; i++) {
+        mask |= (uint32_t)(ctrl[i] == byte) << i;
+    }
+    return mask;
+#endif
+}
+
+// Finds the free (empty or deleted) slots of a group.
+// @param ctrl First control byte of the group.
+// @return bit mask with bit i set if slot i is free.
+static uint32_t group_match_free(const uint8_t *ctrl) {
+#ifdef __SSE2__
+    __m128i group = _mm_loadu_si128((const __m128i *)(const void *)ctrl);
+    return (uint32_t)_mm_movemask_epi8(group);
+#else
+    uint32_t mask = 0;
+    for (unsigned int i = 0; i < GROUP_SIZE; i++) {
+        mask |= (uint32_t)(ctrl[i] >> 7) << i;
+    }
+    return mask;
+#endif
+}
+#else
+
+// Computes the BLOOM_HASHES counters of a hash in an array's filter, by
+// double hashing a remix of it: the bits of the hash itself are partly the
+// same for every key of a stripe or shard.
+// @param array The slot array.
+// @param h The hash.
+// @param counters Receives the counter indexes.
+static void bloom_counters(const SlotArray *array, uint64_t h, size_t counters[BLOOM_HASHES]) {
+    h ^= h >> 31;
+    h *= 0x9e3779b97f4a7c15ULL;
+    h ^= h >> 29;
+    size_t mask = array->capacity * BLOOM_COUNTERS_PER_SLOT - 1;
+    size_t step = (size_t)(h >> 32) | 1;
+    for (size_t k = 0; k < BLOOM_HASHES; k++) {
+        counters[k] = ((size_t)h + k * step) & mask;
+    }
+}
+
+// Reads a 4 bit counter of a filter.
+static unsigned int bloom_get(const SlotArray *array, size_t counter) {
+    return (array->bloom[counter / 2] >> (counter % 2 * 4)) & 0xf;
+}
+
+// Changes a 4 bit counter of a filter. A counter that reached 15 is never
+// changed again, it may stand for more keys than it can count.
+static void bloom_update(SlotArray *array, size_t counter, int delta) {
+    unsigned int value = bloom_get(array, counter);
+    if (value == 0xf) return;
+    unsigned int shift = (unsigned int)(counter % 2 * 4);
+    value = (unsigned int)((int)value + delta);
+    array->bloom[counter / 2] = (uint8_t)((array->bloom[counter / 2] & ~(0xfu << shift)) | (value << shift));
+}
+
+// Checks whether a key may be in an array. Like the control bytes, the filter
+// is only a hint for readers, what they read is validated afterwards.
+// @param array The slot array.
+// @param h Hash of the key.
+// @return false if the key is certainly not in the array.
+static bool bloom_may_contain(const SlotArray *array, uint64_t h) {
+    size_t counters[BLOOM_HASHES];
+    bloom_counters(array, h, counters);
+    for (size_t k = 0; k < BLOOM_HASHES; k++) {
+        if (bloom_get(array, counters[k]) == 0) return false;
+    }
+    return true;
+}
+#endif
+
+// Stores a node (or a tombstone) in a slot, keeping its control byte and the
+// filter in sync. A tombstone removes the node it replaces from the filter.
+// Control bytes are only hints for readers, the slot pointer is what counts.
+// @param array The slot array.
+// @param i Index of the slot.
+// @param keyNode The node.
+static void set_slot(SlotArray *array, size_t i, KeyNode *keyNode) {
+#ifdef KVS_SWISS_TABLE
+    array->ctrl[i] = keyNode == TOMBSTONE ? CTRL_DELETED : fingerprint(keyNode->hash);
+#else
+    KeyNode *counted = keyNode == TOMBSTONE ? SLOT_LOAD(array, i) : keyNode;
+    size_t counters[BLOOM_HASHES];
+    bloom_counters(array, counted->hash, counters);
+    for (size_t k = 0; k < BLOOM_HASHES; k++) {
+        bloom_update(array, counters[k], keyNode == TOMBSTONE ? -1 : 1);
+    }
+#endif
+    SLOT_STORE(array, i, keyNode);
+}
+
+// Hash function: FNV-1a over the whole key, followed by the murmur3 64 bit
+// finalizer so that the low bits (used to index the table) are well mixed.
+// @param key Null terminated string.
 // @return hash.
-// NOTE: This is not an ideal hash function, but is useful for test purposes of the project
-int hash(const char *key) {
-    int firstLetter = tolower(key[0]);
-    if (firstLetter >= 'a' && firstLetter <= 'z') {
-        return firstLetter - 'a';
-    } else if (firstLetter >= '0' && firstLetter <= '9') {
-        return firstLetter - '0';
+uint64_t hash(const char *key) {
+    uint64_t h = 14695981039346656037ULL;
+    for (const unsigned char *c = (const unsigned char *)key; *c != '\0'; c++) {
+        h ^= *c;
+        h *= 1099511628211ULL;
     }
-    return -1; // Invalid index for non-alphabetic or number strings
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+size_t stripe_index(const char *key) {
+    return (size_t)(hash(key) >> (64 - TABLE_STRIPE_BITS));
+}
+
+size_t shard_index(const char *key, size_t num_shards) {
+    return (size_t)((hash(key) >> 32) & 0xffff) % num_shards;
+}
+
+// Stripe owning a hash: the top bits pick the stripe, the low bits the slot.
+static Stripe *stripe_of(HashTable *ht, uint64_t h) {
+    return &ht->stripes[h >> (64 - TABLE_STRIPE_BITS)];
+}
+
+// Adds to the memory accounted to a stripe, whose lock must be held.
+// @param st The stripe.
+// @param delta Bytes allocated (or freed, as a negative value wrapping around).
+static void account(Stripe *st, size_t delta) {
+    atomic_store_explicit(&st->bytes, atomic_load_explicit(&st->bytes, memory_order_relaxed) + delta,
+                          memory_order_relaxed);
+}
+
+// Size of a slot array.
+// @param capacity Number of slots.
+// @return bytes.
+static size_t array_size(size_t capacity) {
+#ifdef KVS_SWISS_TABLE
+    return sizeof(SlotArray) + capacity * (sizeof(_Atomic(KeyNode *)) + 1);
+#else
+    size_t bloom_size = capacity * BLOOM_COUNTERS_PER_SLOT / 2;
+    return sizeof(SlotArray) + capacity * sizeof(_Atomic(KeyNode *)) + bloom_size;
+#endif
+}
+
+// Allocates an empty slot array.
+// @param capacity Number of slots (power of two).
+// @return the array, NULL on failure.
+static SlotArray *alloc_array(size_t capacity) {
+    SlotArray *array = calloc(1, array_size(capacity));
+    if (!array) return NULL;
+#ifdef KVS_SWISS_TABLE
+    array->ctrl = (uint8_t *)&array->slots[capacity];
+    memset(array->ctrl, CTRL_EMPTY, capacity);
+#else
+    array->bloom = (uint8_t *)&array->slots[capacity];
+#endif
+    array->capacity = capacity;
+    return array;
 }
 
 struct HashTable* create_hash_table() {
-	HashTable *ht = malloc(sizeof(HashTable));
+	HashTable *ht = aligned_alloc(CACHE_LINE_SIZE, sizeof(HashTable));
 	if (!ht) return NULL;
-	for (int i = 0; i < TABLE_SIZE; i++) {
-		ht->table[i] = NULL;
+	for (size_t i = 0; i < TABLE_STRIPES; i++) {
+		Stripe *stripe = &ht->stripes[i];
+		SlotArray *table = alloc_array(TABLE_INITIAL_CAPACITY);
+		if (!table) {
+			while (i-- > 0) free(atomic_load(&ht->stripes[i].table));
+			free(ht);
+			return NULL;
+		}
+		atomic_init(&stripe->table, table);
+		atomic_init(&stripe->old_table, NULL);
+		atomic_init(&stripe->seq, 0);
+		stripe->count = 0;
+		stripe->used = 0;
+		stripe->old_count = 0;
+		stripe->rehash_pos = 0;
+		slab_init(&stripe->nodes, sizeof(KeyNode));
+		slab_classes_init(&stripe->values);
+		atomic_init(&stripe->bytes, array_size(TABLE_INITIAL_CAPACITY));
+		atomic_init(&stripe->retained, 0);
+		stripe->changed = 0;
+		stripe->expires_until = 0;
+		retire_list_init(&stripe->retired);
+	}
+	timer_wheel_init(&ht->expiry, TIMER_TICKS(monotonic_ms()));
+	ht->on_discard = NULL;
+	ht->memory_limit = 0;
+	ht->clock_stripe = 0;
+	ht->clock_pos = 0;
+	pthread_mutex_init(&ht->clock_lock, NULL);
+	if (skiplist_init(&ht->index) != 0) {
+		for (size_t i = 0; i < TABLE_STRIPES; i++) free(atomic_load(&ht->stripes[i].table));
+		free(ht);
+		return NULL;
+	}
+	for (size_t i = 0; i < TABLE_STRIPES; i++) {
+		pthread_rwlock_init(&ht->stripes[i].lock, NULL);
 	}
-	pthread_rwlock_init(&ht->tablelock, NULL);
 	return ht;
 }
 
+// Releases a retired node, value or slot array, once no reader can see it
+// anymore.
+// @param ctx The stripe it belonged to.
+// @param ptr The node, the value tagged with VALUE_TAG or the array tagged
+// with ARRAY_TAG.
+static void release_retired(void *ctx, void *ptr) {
+    Stripe *st = ctx;
+    uintptr_t tag = (uintptr_t)ptr & RETIRED_TAGS;
+    void *object = (void *)((uintptr_t)ptr & ~RETIRED_TAGS);
+    if (tag == ARRAY_TAG) {
+        free(object);
+    } else if (tag == VALUE_TAG) {
+        slab_classes_free(&st->values, ((Value *)object)->size_class, object);
+    } else {
+        slab_free(&st->nodes, object);
+    }
+}
+
+// Retires a node or a (tagged) value or slot array of a stripe. If the retire list
+// cannot grow, waits for the readers instead and releases it right away.
+// @param st The stripe.
+// @param ptr What to retire.
+static void retire_in(Stripe *st, void *ptr) {
+    if (retire(&st->retired, ptr) != 0) {
+        epoch_synchronize();
+        release_retired(st, ptr);
+    }
+}
+
+void stripe_write_lock(HashTable *ht, size_t index) {
+    Stripe *st = &ht->stripes[index];
+    pthread_rwlock_wrlock(&st->lock);
+    atomic_fetch_add_explicit(&st->seq, 1, memory_order_relaxed);
+    // Readers that see the new pointers must also see the odd sequence
+    atomic_thread_fence(memory_order_release);
+}
+
+void stripe_write_unlock(HashTable *ht, size_t index) {
+    Stripe *st = &ht->stripes[index];
+    // Memory of the previous writers may have become unreachable for readers
+    retire_collect(&st->retired, release_retired, st);
+    atomic_fetch_add_explicit(&st->seq, 1, memory_order_release);
+    pthread_rwlock_unlock(&st->lock);
+}
+
+unsigned int stripe_read_begin(HashTable *ht, size_t index) {
+    return atomic_load_explicit(&ht->stripes[index].seq, memory_order_acquire);
+}
+
+int stripe_read_retry(HashTable *ht, size_t index, unsigned int seq) {
+    // Order the reads of the stripe before the second look at the sequence
+    atomic_thread_fence(memory_order_acquire);
+    return (seq & 1) || atomic_load_explicit(&ht->stripes[index].seq, memory_order_relaxed) != seq;
+}
+
+// Copies a key into a KeyNode, truncating it to MAX_STRING_SIZE - 1
+// characters.
+// @param dest Key field of the node.
+// @param src String to copy.
+static void copy_string(char *dest, const char *src) {
+    size_t len = strnlen(src, MAX_STRING_SIZE - 1);
+    memcpy(dest, src, len);
+    dest[len] = '\0';
+}
+
+// Allocates a Value holding a copy of a string, truncated to
+// MAX_VALUE_SIZE - 1 characters, and accounts it to the stripe.
+// @param st The stripe.
+// @param src String to copy.
+// @return the value, NULL on failure.
+static Value *alloc_value(Stripe *st, const char *src) {
+    size_t len = strnlen(src, MAX_VALUE_SIZE - 1);
+    unsigned int size_class = slab_class_of(sizeof(Value) + len + 1);
+    Value *value = slab_classes_alloc(&st->values, size_class);
+    if (!value) return NULL;
+    value->version = atomic_load_explicit(&current_version, memory_order_relaxed);
+    value->expires_at = 0;
+    atomic_init(&value->older, NULL);
+    value->length = (uint32_t)len;
+    value->size_class = (uint16_t)size_class;
+    value->deleted = false;
+    memcpy(value->data, src, len);
+    value->data[len] = '\0';
+    account(st, st->values.classes[size_class].object_size);
+    return value;
+}
+
+// Retires a value that readers may still be looking at.
+// @param st The stripe.
+// @param value The value.
+static void retire_value(Stripe *st, Value *value) {
+    account(st, -st->values.classes[value->size_class].object_size);
+    retire_in(st, (void *)((uintptr_t)value | VALUE_TAG));
+}
+
+const Value *pair_value(const KeyNode *keyNode) {
+    return atomic_load_explicit(&keyNode->value, memory_order_acquire);
+}
+
+// Adds to the number of versions a stripe keeps for snapshots, whose lock
+// must be held.
+// @param st The stripe.
+// @param delta Versions kept (or released, as a negative value wrapping around).
+static void retain(Stripe *st, size_t delta) {
+    atomic_store_explicit(&st->retained, atomic_load_explicit(&st->retained, memory_order_relaxed) + delta,
+                          memory_order_relaxed);
+}
+
+// Records that a stripe changed, for changed_stripes. The stripe lock must
+// be held.
+// @param st The stripe.
+static void mark_changed(Stripe *st) {
+    st->changed = atomic_load_explicit(&current_version, memory_order_relaxed);
+}
+
+// Makes a value the newest version of a pair, keeping the previous ones
+// until prune_versions drops them. The stripe lock must be held.
+// @param st The stripe.
+// @param keyNode The pair.
+// @param value The new version.
+static void push_version(Stripe *st, KeyNode *keyNode, Value *value) {
+    Value *current = atomic_load_explicit(&keyNode->value, memory_order_relaxed);
+    // Counted are the versions but the newest, and the deletions
+    if (!current->deleted) retain(st, 1);
+    if (value->deleted) retain(st, 1);
+    atomic_store_explicit(&value->older, current, memory_order_relaxed);
+    atomic_store_explicit(&keyNode->value, value, memory_order_release);
+}
+
+// Drops the versions of a pair that no active snapshot can read: each one
+// reads the newest version not newer than itself, so nothing older than the
+// one the oldest snapshot reads is needed. The stripe lock must be held.
+// @param st The stripe.
+// @param keyNode The pair.
+// @return true if the pair is deleted for every snapshot, and can be unlinked.
+static bool prune_versions(Stripe *st, KeyNode *keyNode) {
+    uint64_t oldest_version = atomic_load(&oldest_snapshot);
+    Value *current = atomic_load_explicit(&keyNode->value, memory_order_relaxed);
+    Value *kept = current;
+    Value *older;
+    while (oldest_version != 0 && kept->version > oldest_version &&
+           (older = atomic_load_explicit(&kept->older, memory_order_relaxed)) != NULL) {
+        kept = older;
+    }
+
+    Value *dropped = atomic_load_explicit(&kept->older, memory_order_relaxed);
+    atomic_store_explicit(&kept->older, NULL, memory_order_relaxed);
+    while (dropped != NULL) {
+        older = atomic_load_explicit(&dropped->older, memory_order_relaxed);
+        retain(st, (size_t)-1);
+        retire_value(st, dropped);
+        dropped = older;
+    }
+    return kept == current && current->deleted;
+}
+
+uint64_t monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+// Gets the wall clock in milliseconds since the epoch.
+// @return current time.
+static uint64_t realtime_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+uint64_t expiry_to_deadline(uint64_t expires_at) {
+    if (expires_at == 0) return 0;
+    uint64_t now = monotonic_ms();
+    uint64_t left = expires_at > now ? expires_at - now : 0;
+    return realtime_ms() + left;
+}
+
+uint64_t ttl_to_deadline(uint64_t ttl_ms) {
+    return realtime_ms() + ttl_ms;
+}
+
+uint64_t deadline_to_ttl(uint64_t deadline) {
+    uint64_t now = realtime_ms();
+    return deadline > now ? deadline - now : 0;
+}
+
+// Checks whether a pair outlived its TTL.
+// @param keyNode The pair.
+// @return true if it expired.
+static bool is_expired(const KeyNode *keyNode) {
+    uint64_t expires_at = keyNode->expires_at;
+    return expires_at != 0 && expires_at <= monotonic_ms();
+}
+
+// Removes the TTL of a pair. The stripe lock must be held.
+// @param ht The hash table.
+// @param keyNode The pair.
+static void clear_expiry(HashTable *ht, KeyNode *keyNode) {
+    if (keyNode->expires_at == 0) return;
+    timer_wheel_lock(&ht->expiry);
+    timer_cancel(&keyNode->timer);
+    timer_wheel_unlock(&ht->expiry);
+    keyNode->expires_at = 0;
+}
+
+// Records an access to a pair for the eviction hand. Skips the store when
+// the bit is already set, to keep readers from dirtying shared cache lines.
+// @param keyNode The pair.
+static void mark_referenced(KeyNode *keyNode) {
+    if (!atomic_load_explicit(&keyNode->referenced, memory_order_relaxed)) {
+        atomic_store_explicit(&keyNode->referenced, true, memory_order_relaxed);
+    }
+}
+
+// Finds the slot holding a key in one slot array.
+// @param array The slot array.
+// @param key The key.
+// @param h Hash of the key.
+// @return index of the slot, capacity if the key is not in the array.
+#ifdef KVS_SWISS_TABLE
+static size_t find_in(SlotArray *array, const char *key, uint64_t h) {
+    size_t mask = array->capacity - 1;
+    uint8_t fp = fingerprint(h);
+    // Groups are probed in order, starting with the one holding the home slot
+    size_t group = h & mask & ~(size_t)(GROUP_SIZE - 1);
+    for (size_t probed = 0; probed < array->capacity; probed += GROUP_SIZE) {
+        // The slots of a hit are fetched while its control bytes are compared
+        __builtin_prefetch(&array->slots[group]);
+        __builtin_prefetch(&array->slots[group + GROUP_SIZE / 2]);
+        for (uint32_t hits = group_match(&array->ctrl[group], fp); hits != 0; hits &= hits - 1) {
+            size_t i = group + (size_t)__builtin_ctz(hits);
+            KeyNode *keyNode = SLOT_LOAD(array, i);
+            if (keyNode != NULL && keyNode != TOMBSTONE && keyNode->hash == h &&
+                strcmp(keyNode->key, key) == 0) {
+                return i;
+            }
+        }
+        if (group_match(&array->ctrl[group], CTRL_EMPTY) != 0) {
+            return array->capacity; // An empty slot ends the probe sequence
+        }
+        group = (group + GROUP_SIZE) & mask;
+    }
+    return array->capacity;
+}
+
+// Finds the first free slot (empty or deleted) of a hash's probe sequence.
+// @param array The slot array, never full.
+// @param h The hash.
+// @return index of the slot.
+static size_t free_slot(SlotArray *array, uint64_t h) {
+    size_t mask = array->capacity - 1;
+    size_t group = h & mask & ~(size_t)(GROUP_SIZE - 1);
+    uint32_t free_mask;
+    while ((free_mask = group_match_free(&array->ctrl[group])) == 0) {
+        group = (group + GROUP_SIZE) & mask;
+    }
+    return group + (size_t)__builtin_ctz(free_mask);
+}
+#else
+static size_t find_in(SlotArray *array, const char *key, uint64_t h) {
+    if (!bloom_may_contain(array, h)) {
+        return array->capacity;
+    }
+    size_t mask = array->capacity - 1;
+    for (size_t i = h & mask;; i = (i + 1) & mask) {
+        KeyNode *keyNode = SLOT_LOAD(array, i);
+        if (keyNode == NULL) {
+            return array->capacity; // An empty slot ends the probe sequence
+        }
+        if (keyNode != TOMBSTONE && keyNode->hash == h && strcmp(keyNode->key, key) == 0) {
+            return i;
+        }
+    }
+}
+
+// Finds the first free slot (empty or tombstone) of a hash's probe sequence.
+// @param array The slot array, never full.
+// @param h The hash.
+// @return index of the slot.
+static size_t free_slot(SlotArray *array, uint64_t h) {
+    size_t mask = array->capacity - 1;
+    size_t i = h & mask;
+    KeyNode *current;
+    while ((current = SLOT_LOAD(array, i)) != NULL && current != TOMBSTONE) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+#endif
+
+// Finds the node of a key, looking into the array being migrated too.
+// @param st The stripe.
+// @param key The key.
+// @param h Hash of the key.
+// @param array Set to the array holding the node.
+// @param index Set to the slot holding the node.
+// @return the node, NULL if the key is not in the stripe.
+static KeyNode *find_node(Stripe *st, const char *key, uint64_t h, SlotArray **array, size_t *index) {
+    // The old array is checked first: a migrated node is stored in the new
+    // array before its old slot becomes a tombstone
+    SlotArray *arrays[2] = {atomic_load_explicit(&st->old_table, memory_order_acquire),
+                            atomic_load_explicit(&st->table, memory_order_acquire)};
+    for (int k = 0; k < 2; k++) {
+        if (arrays[k] == NULL) continue;
+        size_t i = find_in(arrays[k], key, h);
+        if (i != arrays[k]->capacity) {
+            KeyNode *keyNode = SLOT_LOAD(arrays[k], i);
+            if (keyNode == TOMBSTONE) {
+                return NULL; // Deleted after the probe, lock-free readers retry
+            }
+            *array = arrays[k];
+            *index = i;
+            return keyNode;
+        }
+    }
+    return NULL;
+}
+
+// Places a node in the first free slot of its probe sequence in the current
+// array, reusing tombstones.
+// @param st The stripe.
+// @param keyNode Node to place.
+static void insert_node(Stripe *st, KeyNode *keyNode) {
+    SlotArray *table = atomic_load_explicit(&st->table, memory_order_relaxed);
+    size_t i = free_slot(table, keyNode->hash);
+    if (SLOT_LOAD(table, i) == NULL) {
+        st->used++;
+    }
+    set_slot(table, i, keyNode);
+}
+
+// Migrates some slots of the old array into the current one, retiring the
+// old array once it has been fully moved.
+// @param st The stripe.
+// @param steps Maximum number of old slots to visit.
+static void rehash_step(Stripe *st, size_t steps) {
+    SlotArray *old = atomic_load_explicit(&st->old_table, memory_order_relaxed);
+    if (old == NULL) return;
+
+    for (; steps > 0 && st->rehash_pos < old->capacity; steps--) {
+        KeyNode *keyNode = SLOT_LOAD(old, st->rehash_pos);
+        if (keyNode != NULL && keyNode != TOMBSTONE) {
+            insert_node(st, keyNode);
+            // Keep the probe sequences of the keys still to migrate intact
+            set_slot(old, st->rehash_pos, TOMBSTONE);
+            st->old_count--;
+        }
+        st->rehash_pos++;
+    }
+
+    if (st->rehash_pos == old->capacity) {
+        atomic_store_explicit(&st->old_table, NULL, memory_order_release);
+        st->rehash_pos = 0;
+        account(st, -array_size(old->capacity));
+        retire_in(st, (void *)((uintptr_t)old | ARRAY_TAG));
+    }
+}
+
+// Starts moving every pair to a new slot array. A resize still in progress
+// is completed first.
+// @param st The stripe.
+// @param new_capacity Number of slots of the new array (power of two).
+// @return 0 if successful, 1 otherwise.
+static int start_resize(Stripe *st, size_t new_capacity) {
+    SlotArray *table = alloc_array(new_capacity);
+    if (!table) return 1;
+    account(st, array_size(new_capacity));
+
+    rehash_step(st, SIZE_MAX);
+
+    st->old_count = st->count;
+    st->rehash_pos = 0;
+    st->used = 0;
+    atomic_store_explicit(&st->old_table, atomic_load_explicit(&st->table, memory_order_relaxed),
+                          memory_order_release);
+    atomic_store_explicit(&st->table, table, memory_order_release);
+    return 0;
+}
+
 int write_pair(HashTable *ht, const char *key, const char *value) {
-    int index = hash(key);
+    uint64_t h = hash(key);
+    Stripe *st = stripe_of(ht, h);
+
+    rehash_step(st, REHASH_STEP);
 
     // Search for the key node
-	KeyNode *keyNode = ht->table[index];
-    KeyNode *previousNode;
-
-    while (keyNode != NULL) {
-        if (strcmp(keyNode->key, key) == 0) {
-            // overwrite value
-            free(keyNode->value);
-            keyNode->value = strdup(value);
-            return 0;
-        }
-        previousNode = keyNode;
-        keyNode = previousNode->next; // Move to the next node
-    }
-    // Key not found, create a new key node
-    keyNode = malloc(sizeof(KeyNode));
-    keyNode->key = strdup(key); // Allocate memory for the key
-    keyNode->value = strdup(value); // Allocate memory for the value
-    keyNode->next = ht->table[index]; // Link to existing nodes
-    ht->table[index] = keyNode; // Place new key node at the start of the list
+    SlotArray *array;
+    size_t index;
+    KeyNode *keyNode = find_node(st, key, h, &array, &index);
+    if (keyNode != NULL) {
+        if (is_expired(keyNode) && ht->on_discard) {
+            ht->on_discard(keyNode->key); // Reclaimed lazily, then written again
+        }
+        // Swap in a new value, readers may still hold the old one and
+        // snapshots may still need it (also when the pair was deleted)
+        Value *new_value = alloc_value(st, value);
+        if (!new_value) return 1;
+        push_version(st, keyNode, new_value);
+        prune_versions(st, keyNode);
+        clear_expiry(ht, keyNode);
+        mark_changed(st);
+        return 0;
+    }
+
+    if (strlen(key) >= MAX_STRING_SIZE) return 1;
+
+    // Key not found, make sure there is room for one more slot, counting the
+    // pairs that are still waiting to be migrated
+    SlotArray *table = atomic_load_explicit(&st->table, memory_order_relaxed);
+    if ((st->used + st->old_count + 1) * TABLE_MAX_LOAD_DEN > table->capacity * TABLE_MAX_LOAD_NUM) {
+        // Only double when live pairs fill the stripe, otherwise purging the tombstones is enough
+        size_t new_capacity = table->capacity;
+        if ((st->count + 1) * TABLE_MAX_LOAD_DEN * 2 > table->capacity * TABLE_MAX_LOAD_NUM) {
+            new_capacity *= 2;
+        }
+        if (start_resize(st, new_capacity) != 0) return 1;
+        rehash_step(st, REHASH_STEP);
+    }
+
+    keyNode = slab_alloc(&st->nodes);
+    if (!keyNode) return 1;
+    Value *new_value = alloc_value(st, value);
+    if (!new_value) {
+        slab_free(&st->nodes, keyNode);
+        return 1;
+    }
+    atomic_init(&keyNode->value, new_value);
+    keyNode->hash = h;
+    keyNode->expires_at = 0;
+    timer_entry_init(&keyNode->timer);
+    // New pairs get a second chance before the first eviction
+    atomic_init(&keyNode->referenced, true);
+    copy_string(keyNode->key, key);
+    size_t index_size;
+    if (skiplist_insert(&ht->index, keyNode->key, keyNode, &index_size) != 0) {
+        account(st, -st->values.classes[new_value->size_class].object_size);
+        slab_classes_free(&st->values, new_value->size_class, new_value);
+        slab_free(&st->nodes, keyNode);
+        return 1;
+    }
+
+    insert_node(st, keyNode);
+    st->count++;
+    account(st, st->nodes.object_size + index_size);
+    mark_changed(st);
     return 0;
 }
 
-char* read_pair(HashTable *ht, const char *key) {
-    int index = hash(key);
+// Looks up the current value of a pair whose key was hashed already.
+// @param ht Hash table to read from.
+// @param key Key of the pair.
+// @param h Hash of the key.
+// @return the value, NULL if the key was not found.
+static const Value *peek_hashed(HashTable *ht, const char *key, uint64_t h) {
+    SlotArray *array;
+    size_t index;
+    KeyNode *keyNode = find_node(stripe_of(ht, h), key, h, &array, &index);
+    if (keyNode == NULL || is_expired(keyNode)) {
+        return NULL; // Key not found
+    }
+    const Value *value = pair_value(keyNode);
+    if (value->deleted) {
+        return NULL; // Only kept for the snapshots
+    }
+    mark_referenced(keyNode);
+    return value;
+}
+
+const Value *peek_value(HashTable *ht, const char *key) {
+    return peek_hashed(ht, key, hash(key));
+}
+
+// Copies a value into a caller provided buffer.
+// @param dest Buffer of MAX_VALUE_SIZE bytes, NULL to copy nothing.
+// @param value The value, NULL if the key was not found.
+// @return 0 if there was a value, 1 otherwise.
+static int copy_value(char *dest, const Value *value) {
+    if (value == NULL) return 1;
+    if (dest != NULL) {
+        memcpy(dest, value->data, value->length + 1);
+    }
+    return 0;
+}
 
-	KeyNode *keyNode = ht->table[index];
-    KeyNode *previousNode;
-    char *value;
+int read_pair(HashTable *ht, const char *key, char *value) {
+    // Hashed once, for the stripe and the lookup
+    uint64_t h = hash(key);
+    size_t index = (size_t)(h >> (64 - TABLE_STRIPE_BITS));
 
-    while (keyNode != NULL) {
-        if (strcmp(keyNode->key, key) == 0) {
-            value = strdup(keyNode->value);
-            return value; // Return the value if found
+    epoch_enter();
+    for (int tries = 0; tries < READ_OPTIMISTIC_TRIES; tries++) {
+        unsigned int seq = stripe_read_begin(ht, index);
+        if (seq & 1) {
+            sched_yield(); // A writer holds the stripe
+            continue;
+        }
+        const Value *found = peek_hashed(ht, key, h);
+        if (!stripe_read_retry(ht, index, seq)) {
+            // The value is immutable, the epoch keeps it alive while copying
+            int result = copy_value(value, found);
+            epoch_exit();
+            return result;
         }
-        previousNode = keyNode;
-        keyNode = previousNode->next; // Move to the next node
     }
+    epoch_exit();
+
+    // Writers keep getting in the way, wait for them like a locked reader
+    pthread_rwlock_rdlock(&ht->stripes[index].lock);
+    int result = copy_value(value, peek_hashed(ht, key, h));
+    pthread_rwlock_unlock(&ht->stripes[index].lock);
+    return result;
+}
+
+// Unlinks a pair from its stripe, the index and the expiry wheel, with all
+// its versions. The stripe lock must be held.
+// @param ht The hash table.
+// @param st The stripe.
+// @param keyNode The pair.
+// @param array Slot array holding it.
+// @param index Slot holding it.
+static void unlink_node(HashTable *ht, Stripe *st, KeyNode *keyNode, SlotArray *array, size_t index) {
+    // Leave a tombstone so that the probe sequences going through this slot stay intact
+    set_slot(array, index, TOMBSTONE);
+    st->count--;
+    if (array == atomic_load_explicit(&st->old_table, memory_order_relaxed)) {
+        st->old_count--;
+    }
+
+    clear_expiry(ht, keyNode);
+    // Readers may still be looking at the node
+    size_t index_size = skiplist_remove(&ht->index, keyNode->key);
+    account(st, -(st->nodes.object_size + index_size));
+    Value *current = atomic_load_explicit(&keyNode->value, memory_order_relaxed);
+    for (Value *value = current, *older; value != NULL; value = older) {
+        older = atomic_load_explicit(&value->older, memory_order_relaxed);
+        if (value != current || value->deleted) retain(st, (size_t)-1);
+        retire_value(st, value);
+    }
+    retire_in(st, keyNode);
+}
 
-    return NULL; // Key not found
+// Removes a pair. While snapshots are active it only gets a deletion
+// version, snapshot_collect unlinks it once no snapshot can see it anymore.
+// The stripe lock must be held.
+// @param ht The hash table.
+// @param st The stripe.
+// @param keyNode The pair.
+// @param array Slot array holding it.
+// @param index Slot holding it.
+static void remove_node(HashTable *ht, Stripe *st, KeyNode *keyNode, SlotArray *array, size_t index) {
+    mark_changed(st);
+    // No snapshot can start while the stripe is locked
+    if (atomic_load(&oldest_snapshot) != 0) {
+        Value *deletion = alloc_value(st, "");
+        if (deletion != NULL) {
+            deletion->deleted = true;
+            clear_expiry(ht, keyNode);
+            push_version(st, keyNode, deletion);
+            return;
+        }
+        // Out of memory, the snapshots will miss the pair
+    }
+    unlink_node(ht, st, keyNode, array, index);
 }
 
 int delete_pair(HashTable *ht, const char *key) {
-    int index = hash(key);
+    uint64_t h = hash(key);
+    Stripe *st = stripe_of(ht, h);
 
-    // Search for the key node
-    KeyNode *keyNode = ht->table[index];
-    KeyNode *prevNode = NULL;
-
-    while (keyNode != NULL) {
-        if (strcmp(keyNode->key, key) == 0) {
-            // Key found; delete this node
-            if (prevNode == NULL) {
-                // Node to delete is the first node in the list
-                ht->table[index] = keyNode->next; // Update the table to point to the next node
-            } else {
-                // Node to delete is not the first; bypass it
-                prevNode->next = keyNode->next; // Link the previous node to the next node
+    rehash_step(st, REHASH_STEP);
+
+    SlotArray *array;
+    size_t index;
+    KeyNode *keyNode = find_node(st, key, h, &array, &index);
+    if (keyNode == NULL || pair_value(keyNode)->deleted) {
+        return 1;
+    }
+
+    bool expired = is_expired(keyNode);
+    if (expired && ht->on_discard) {
+        ht->on_discard(keyNode->key);
+    }
+    remove_node(ht, st, keyNode, array, index);
+    return expired ? 1 : 0;
+}
+
+int set_expiry(HashTable *ht, const char *key, uint64_t ttl_ms) {
+    uint64_t h = hash(key);
+    Stripe *st = stripe_of(ht, h);
+
+    SlotArray *array;
+    size_t index;
+    KeyNode *keyNode = find_node(st, key, h, &array, &index);
+    if (keyNode == NULL || is_expired(keyNode) || pair_value(keyNode)->deleted) {
+        return 1;
+    }
+
+    uint64_t expires_at = monotonic_ms() + ttl_ms;
+    Value *current = atomic_load_explicit(&keyNode->value, memory_order_relaxed);
+    // No snapshot can start while the stripe is locked. One that started
+    // since the value was written keeps reading it with its old expiry.
+    if (atomic_load(&oldest_snapshot) != 0 &&
+        current->version < atomic_load_explicit(&current_version, memory_order_relaxed)) {
+        Value *expiring = alloc_value(st, current->data);
+        if (expiring != NULL) {
+            expiring->expires_at = expires_at;
+            push_version(st, keyNode, expiring);
+            prune_versions(st, keyNode);
+            current = expiring;
+        }
+        // Out of memory, the snapshots see the new expiry
+    }
+    current->expires_at = expires_at;
+    keyNode->expires_at = expires_at;
+    mark_changed(st);
+    if (keyNode->expires_at > st->expires_until) {
+        st->expires_until = keyNode->expires_at;
+    }
+    timer_wheel_lock(&ht->expiry);
+    // Rounded up, a timer never fires before its pair expired
+    timer_schedule(&ht->expiry, &keyNode->timer, TIMER_TICKS(keyNode->expires_at + TIMER_TICK_MS - 1));
+    timer_wheel_unlock(&ht->expiry);
+    return 0;
+}
+
+size_t memory_used(HashTable *ht) {
+    size_t bytes = 0;
+    for (size_t i = 0; i < TABLE_STRIPES; i++) {
+        bytes += atomic_load_explicit(&ht->stripes[i].bytes, memory_order_relaxed);
+    }
+    return bytes;
+}
+
+size_t evict_pairs(HashTable *ht) {
+    // Removing pairs while snapshots are active only adds deletion versions
+    if (ht->memory_limit == 0 || atomic_load(&oldest_snapshot) != 0) return 0;
+
+    pthread_mutex_lock(&ht->clock_lock);
+    size_t evicted = 0;
+    // Stripe visits without any eviction. After every stripe was visited
+    // twice all the reference bits were cleared, so nothing is left to evict.
+    size_t idle_visits = 0;
+    while (memory_used(ht) > ht->memory_limit && idle_visits < 2 * TABLE_STRIPES) {
+        size_t stripe = ht->clock_stripe;
+        Stripe *st = &ht->stripes[stripe];
+        size_t before = evicted;
+
+        stripe_write_lock(ht, stripe);
+        KeyNode *keyNode = NULL;
+        while (memory_used(ht) > ht->memory_limit && (keyNode = next_pair(st, &ht->clock_pos)) != NULL) {
+            if (atomic_load_explicit(&keyNode->referenced, memory_order_relaxed)) {
+                atomic_store_explicit(&keyNode->referenced, false, memory_order_relaxed);
+                continue;
             }
-            // Free the memory allocated for the key and value
-            free(keyNode->key);
-            free(keyNode->value);
-            free(keyNode); // Free the key node itself
-            return 0; // Exit the function
+            SlotArray *array;
+            size_t index;
+            find_node(st, keyNode->key, keyNode->hash, &array, &index);
+            if (ht->on_discard) {
+                ht->on_discard(keyNode->key);
+            }
+            remove_node(ht, st, keyNode, array, index);
+            evicted++;
+        }
+        if (keyNode == NULL) {
+            // The hand went through the whole stripe, move on to the next one
+            ht->clock_stripe = (stripe + 1) % TABLE_STRIPES;
+            ht->clock_pos = 0;
         }
-        prevNode = keyNode; // Move prevNode to current node
-        keyNode = keyNode->next; // Move to the next node
+        stripe_write_unlock(ht, stripe);
+
+        idle_visits = evicted == before ? idle_visits + 1 : 0;
     }
+    pthread_mutex_unlock(&ht->clock_lock);
+    return evicted;
+}
 
-    return 1;
+size_t expire_pairs(HashTable *ht) {
+    size_t expired = 0;
+    size_t batch;
+    do {
+        char keys[EXPIRE_BATCH][MAX_STRING_SIZE];
+        batch = 0;
+
+        // The popped nodes are no longer linked in the wheel, only the epoch
+        // keeps them alive until their keys are copied
+        epoch_enter();
+        timer_wheel_lock(&ht->expiry);
+        uint64_t now_tick = TIMER_TICKS(monotonic_ms());
+        TimerEntry *entry;
+        while (batch < EXPIRE_BATCH && (entry = timer_wheel_pop(&ht->expiry, now_tick)) != NULL) {
+            KeyNode *keyNode = (KeyNode *)(void *)((char *)entry - offsetof(KeyNode, timer));
+            strcpy(keys[batch++], keyNode->key);
+        }
+        timer_wheel_unlock(&ht->expiry);
+        epoch_exit();
+
+        // The pairs may have been rewritten or deleted meanwhile, check again
+        for (size_t i = 0; i < batch; i++) {
+            uint64_t h = hash(keys[i]);
+            size_t stripe = (size_t)(h >> (64 - TABLE_STRIPE_BITS));
+            stripe_write_lock(ht, stripe);
+            SlotArray *array;
+            size_t index;
+            KeyNode *keyNode = find_node(&ht->stripes[stripe], keys[i], h, &array, &index);
+            if (keyNode != NULL && is_expired(keyNode)) {
+                if (ht->on_discard) {
+                    ht->on_discard(keyNode->key);
+                }
+                remove_node(ht, &ht->stripes[stripe], keyNode, array, index);
+                expired++;
+            }
+            stripe_write_unlock(ht, stripe);
+        }
+    } while (batch == EXPIRE_BATCH);
+    return expired;
 }
 
-void free_table(HashTable *ht) {
-    for (int i = 0; i < TABLE_SIZE; i++) {
-        KeyNode *keyNode = ht->table[i];
-        while (keyNode != NULL) {
-            KeyNode *temp = keyNode;
-            keyNode = keyNode->next;
-            free(temp->key);
-            free(temp->value);
-            free(temp);
+// Reads the value of a pair reached through the index, validating it against
+// the sequence of the pair's stripe. Must be called inside an epoch.
+// @param ht The hash table.
+// @param node Index node of the pair.
+// @param value Buffer of MAX_VALUE_SIZE bytes that receives the value.
+// @return 0 if the pair exists, 1 if it was deleted, -1 if writers kept
+// changing the stripe.
+static int read_indexed(HashTable *ht, SkipNode *node, char *value) {
+    size_t index = (size_t)(node->pair->hash >> (64 - TABLE_STRIPE_BITS));
+    for (int tries = 0; tries < READ_OPTIMISTIC_TRIES; tries++) {
+        unsigned int seq = stripe_read_begin(ht, index);
+        if (seq & 1) {
+            sched_yield();
+            continue;
         }
+        bool removed = atomic_load_explicit(&node->removed, memory_order_relaxed) || is_expired(node->pair);
+        const Value *found = removed ? NULL : pair_value(node->pair);
+        if (!stripe_read_retry(ht, index, seq)) {
+            if (removed || found->deleted) return 1;
+            mark_referenced(node->pair);
+            return copy_value(value, found);
+        }
+    }
+    return -1;
+}
+
+// Walks the index from the first key not smaller than from, while keys stay
+// within to (if set) and start with prefix (if set).
+static void scan_pairs(HashTable *ht, const char *from, const char *to, const char *prefix,
+                       pair_visitor visit, void *ctx) {
+    size_t prefix_len = prefix ? strlen(prefix) : 0;
+    char key[MAX_STRING_SIZE];
+    char value[MAX_VALUE_SIZE];
+
+    epoch_enter();
+    SkipNode *node = skiplist_seek(&ht->index, from);
+    while (node != NULL) {
+        strcpy(key, node->key);
+        if ((to && strcmp(key, to) > 0) || (prefix && strncmp(key, prefix, prefix_len) != 0)) {
+            break;
+        }
+
+        int result = read_indexed(ht, node, value);
+        if (result < 0) {
+            // Never wait for a writer inside the epoch, writers may be
+            // waiting for this reader to leave it
+            epoch_exit();
+            result = read_pair(ht, key, value);
+            epoch_enter();
+            node = skiplist_seek(&ht->index, key);
+            if (node != NULL && strcmp(node->key, key) == 0) {
+                node = skiplist_next(node);
+            }
+        } else {
+            node = skiplist_next(node);
+        }
+
+        if (result == 0) {
+            visit(ctx, key, value);
+        }
+    }
+    epoch_exit();
+}
+
+void range_pairs(HashTable *ht, const char *from, const char *to, pair_visitor visit, void *ctx) {
+    scan_pairs(ht, from, to, NULL, visit, ctx);
+}
+
+void prefix_pairs(HashTable *ht, const char *prefix, pair_visitor visit, void *ctx) {
+    scan_pairs(ht, prefix, NULL, prefix, visit, ctx);
+}
+
+void snapshot_begin(Snapshot *snapshot) {
+    pthread_mutex_lock(&snapshots_lock);
+    // Versions only grow, so the list stays sorted by appending
+    snapshot->version = atomic_fetch_add(&current_version, 1);
+    snapshot->time_ms = monotonic_ms();
+    snapshot->prev = newest;
+    snapshot->next = NULL;
+    if (newest != NULL) {
+        newest->next = snapshot;
+    } else {
+        oldest = snapshot;
+    }
+    newest = snapshot;
+    atomic_store(&oldest_snapshot, oldest->version);
+    pthread_mutex_unlock(&snapshots_lock);
+}
+
+void snapshot_end(Snapshot *snapshot) {
+    pthread_mutex_lock(&snapshots_lock);
+    if (snapshot->prev != NULL) {
+        snapshot->prev->next = snapshot->next;
+    } else {
+        oldest = snapshot->next;
+    }
+    if (snapshot->next != NULL) {
+        snapshot->next->prev = snapshot->prev;
+    } else {
+        newest = snapshot->prev;
+    }
+    atomic_store(&oldest_snapshot, oldest != NULL ? oldest->version : 0);
+    pthread_mutex_unlock(&snapshots_lock);
+}
+
+void snapshot_collect(HashTable *ht) {
+    for (size_t i = 0; i < TABLE_STRIPES; i++) {
+        Stripe *st = &ht->stripes[i];
+        // Most stripes kept nothing, skip them without disturbing the readers
+        if (atomic_load_explicit(&st->retained, memory_order_relaxed) == 0) continue;
+
+        stripe_write_lock(ht, i);
+        SlotArray *arrays[2] = {atomic_load_explicit(&st->old_table, memory_order_relaxed),
+                                atomic_load_explicit(&st->table, memory_order_relaxed)};
+        for (int k = 0; k < 2; k++) {
+            if (arrays[k] == NULL) continue;
+            for (size_t j = 0; j < arrays[k]->capacity; j++) {
+                KeyNode *keyNode = SLOT_LOAD(arrays[k], j);
+                if (keyNode != NULL && keyNode != TOMBSTONE && prune_versions(st, keyNode)) {
+                    unlink_node(ht, st, keyNode, arrays[k], j);
+                }
+            }
+        }
+        stripe_write_unlock(ht, i);
+    }
+}
+
+_Static_assert(TABLE_STRIPES <= 64, "changed_stripes returns one bit per stripe");
+
+uint64_t changed_stripes(HashTable *ht, uint64_t version, uint64_t time_ms) {
+    uint64_t changed = 0;
+    for (size_t i = 0; i < TABLE_STRIPES; i++) {
+        // A pair that expired since was in the snapshot, and is no more
+        const Stripe *st = &ht->stripes[i];
+        if (st->changed > version || st->expires_until > time_ms) {
+            changed |= (uint64_t)1 << i;
+        }
+    }
+    return changed;
+}
+
+// Finds the version of a pair a snapshot reads. Must be called inside an
+// epoch, the snapshot keeps that version from being pruned.
+// @param keyNode The pair.
+// @param version Version of the snapshot.
+// @return the value, NULL if the pair did not exist yet.
+static const Value *snapshot_value(const KeyNode *keyNode, uint64_t version) {
+    const Value *value = pair_value(keyNode);
+    while (value != NULL && value->version > version) {
+        value = atomic_load_explicit(&value->older, memory_order_acquire);
+    }
+    return value;
+}
+
+size_t split_pairs(HashTable *ht, size_t parts, char keys[][MAX_STRING_SIZE]) {
+    const char *split[parts];
+    epoch_enter();
+    size_t count = parts > 1 ? skiplist_split(&ht->index, parts, split) : 0;
+    for (size_t i = 0; i < count; i++) {
+        strcpy(keys[i], split[i]);
+    }
+    epoch_exit();
+    return count;
+}
+
+// Gets the value of an index node a snapshot sees. Must be called in an
+// epoch section.
+// @param node The index node.
+// @param snapshot An active snapshot.
+// @return the value, NULL if the snapshot does not see the pair.
+static const Value *snapshot_node_value(const SkipNode *node, const Snapshot *snapshot) {
+    if (atomic_load_explicit(&node->removed, memory_order_relaxed)) return NULL;
+    const Value *value = snapshot_value(node->pair, snapshot->version);
+    // Expired as of the start of the snapshot, whatever happened since
+    if (value == NULL || value->deleted ||
+        (value->expires_at != 0 && value->expires_at <= snapshot->time_ms)) {
+        return NULL;
+    }
+    return value;
+}
+
+// Moves an index cursor to the first node from a given one on that a
+// snapshot sees. Must be called in an epoch section.
+// @param node Node to start from, NULL at the end of the index.
+// @param snapshot An active snapshot.
+// @param value Receives the value of the node found.
+// @return the node, NULL at the end of the index.
+static SkipNode *snapshot_seek_visible(SkipNode *node, const Snapshot *snapshot, const Value **value) {
+    for (; node != NULL; node = skiplist_next(node)) {
+        *value = snapshot_node_value(node, snapshot);
+        if (*value != NULL) return node;
+    }
+    return NULL;
+}
+
+void snapshot_range_pairs(HashTable *ht, const Snapshot *snapshot, const char *from, const char *to,
+                          snapshot_visitor visit, void *ctx) {
+    epoch_enter();
+    // Pairs are only unlinked from the index once every snapshot sees them
+    // deleted, so the index still holds every pair of the snapshot
+    for (SkipNode *node = skiplist_seek(&ht->index, from); node != NULL; node = skiplist_next(node)) {
+        if (to != NULL && strcmp(node->key, to) >= 0) break;
+        const Value *value = snapshot_node_value(node, snapshot);
+        if (value != NULL) {
+            visit(ctx, node->key, value->data, value->expires_at);
+        }
+    }
+    epoch_exit();
+}
+
+void snapshot_pairs(HashTable *tables[], size_t num_tables, const Snapshot *snapshot,
+                    snapshot_visitor visit, void *ctx) {
+    // A key lives in a single table: merging the ordered walks of the indexes
+    // gives every pair once, in key order, without copying any of them
+    SkipNode *cursors[num_tables];
+    const Value *values[num_tables];
+    epoch_enter();
+    for (size_t i = 0; i < num_tables; i++) {
+        cursors[i] = snapshot_seek_visible(skiplist_seek(&tables[i]->index, ""), snapshot, &values[i]);
+    }
+    while (1) {
+        size_t min = num_tables;
+        for (size_t i = 0; i < num_tables; i++) {
+            if (cursors[i] != NULL &&
+                (min == num_tables || strcmp(cursors[i]->key, cursors[min]->key) < 0)) {
+                min = i;
+            }
+        }
+        if (min == num_tables) break;
+        visit(ctx, cursors[min]->key, values[min]->data, values[min]->expires_at);
+        cursors[min] = snapshot_seek_visible(skiplist_next(cursors[min]), snapshot, &values[min]);
+    }
+    epoch_exit();
+}
+
+KeyNode *next_pair(Stripe *st, size_t *pos) {
+    SlotArray *old = atomic_load_explicit(&st->old_table, memory_order_acquire);
+    SlotArray *table = atomic_load_explicit(&st->table, memory_order_acquire);
+    size_t old_capacity = old ? old->capacity : 0;
+
+    // Positions below old_capacity walk the array being migrated, the rest walk the current one
+    while (*pos < old_capacity + table->capacity) {
+        KeyNode *keyNode;
+        if (*pos < old_capacity) {
+            keyNode = SLOT_LOAD(old, *pos);
+        } else {
+            keyNode = SLOT_LOAD(table, *pos - old_capacity);
+        }
+        (*pos)++;
+        if (keyNode != NULL && keyNode != TOMBSTONE && !is_expired(keyNode) && !pair_value(keyNode)->deleted) {
+            return keyNode;
+        }
+    }
+    return NULL;
+}
+
+void free_table(HashTable *ht) {
+    skiplist_destroy(&ht->index);
+    timer_wheel_destroy(&ht->expiry);
+    pthread_mutex_destroy(&ht->clock_lock);
+    for (size_t i = 0; i < TABLE_STRIPES; i++) {
+        Stripe *st = &ht->stripes[i];
+        retire_list_destroy(&st->retired, release_retired, st);
+        slab_destroy(&st->nodes); // Releases every node at once
+        slab_classes_destroy(&st->values);
+        free(atomic_load(&st->old_table));
+        free(atomic_load(&st->table));
+        pthread_rwlock_destroy(&st->lock);
     }
-    pthread_rwlock_destroy(&ht->tablelock);
     free(ht);
 }
@@ -1,46 +1,359 @@
 #ifndef KEY_VALUE_STORE_H
 #define KEY_VALUE_STORE_H
-#define TABLE_SIZE 26
+#define TABLE_STRIPE_BITS 6
+#define TABLE_STRIPES (1 << TABLE_STRIPE_BITS)  // Independently locked parts of the table
+#define TABLE_INITIAL_CAPACITY 16  // Slots per stripe, must be a power of two
+#define TABLE_MAX_LOAD_NUM 3       // A stripe grows once it is more than
+#define TABLE_MAX_LOAD_DEN 4       // NUM/DEN full (tombstones included)
+#define REHASH_STEP 64             // Old slots migrated by each write/delete while resizing
+#define EXPIRE_BATCH 64             // Expired keys collected by the sweeper per wheel lock
+#define READ_OPTIMISTIC_TRIES 4    // Lock-free attempts before a reader takes the stripe lock
+#define BLOOM_COUNTERS_PER_SLOT 8  // Counters of the negative lookup filter, 4 bits each
+#define BLOOM_HASHES 3             // Counters touched by each key
+#define CACHE_LINE_SIZE 64
 
+#ifdef KVS_SWISS_TABLE
+#define GROUP_SIZE 16              // Slots probed at once, TABLE_INITIAL_CAPACITY is a multiple
+#define KVS_ENGINE "swiss"
+#else
+#define KVS_ENGINE "linear"
+#endif
+
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
 #include <pthread.h>
 
+#include "constants.h"
+#include "slab.h"
+#include "epoch.h"
+#include "skiplist.h"
+#include "timer_wheel.h"
+
+// Value of a pair, allocated from its stripe's size classes. Values are never
+// changed once published: writing a pair swaps in a new Value and retires the
+// old one, so readers inside an epoch can use the one they loaded as is.
+// While snapshots are active the old values are kept instead, linked from
+// the newest to the oldest, and deleting a pair pushes a deletion version:
+// each snapshot reads the newest version not newer than itself. A version
+// also has its own expiry, which snapshots judge by their start time.
+typedef struct Value {
+    uint64_t version;      // Snapshot version the value was written in
+    uint64_t expires_at;   // Monotonic time in ms, 0 if it never expires
+    _Atomic(struct Value *) older;  // Previous version, while a snapshot may read it
+    uint32_t length;       // Without the terminating null byte
+    uint16_t size_class;   // Class it was allocated from
+    bool deleted;          // The pair was deleted in this version
+    char data[];
+} Value;
+
+// Keys are capped at MAX_STRING_SIZE, so they are stored inline: every pair
+// is a node taken from its stripe's slab plus its Value, which may be up to
+// MAX_VALUE_SIZE bytes. The key never changes once the node is published.
+// A pair with a TTL is linked in the table's expiry wheel through timer; once
+// expires_at passes it is hidden from readers until it is reclaimed.
 typedef struct KeyNode {
-    char *key;
-    char *value;
-    struct KeyNode *next;
+    uint64_t hash;
+    uint64_t expires_at;   // Monotonic time in ms, 0 if the pair never expires
+    atomic_bool referenced;  // Set on access, cleared by the eviction hand
+    TimerEntry timer;
+    char key[MAX_STRING_SIZE];
+    _Atomic(Value *) value;
 } KeyNode;
 
+// Slot array of an open addressing table with linear probing. Every slot is
+// either NULL (never used), a tombstone (deleted) or a pointer to a KeyNode.
+// The Swiss table engine (make ENGINE=swiss) also keeps one control byte per
+// slot holding 7 bits of the key's hash, so that a group of GROUP_SIZE slots
+// is filtered with a single SIMD compare before any key is looked at.
+// With linear probing every array also has a counting Bloom filter of the
+// keys it holds, so that lookups of absent keys usually end without probing
+// any slot. The Swiss engine's first group already ends most of them.
+typedef struct SlotArray {
+    size_t capacity;             // Always a power of two
+#ifdef KVS_SWISS_TABLE
+    uint8_t *ctrl;               // Control bytes, stored after the slots
+#else
+    uint8_t *bloom;              // Two 4 bit counters per byte, stored last
+#endif
+    _Atomic(KeyNode *) slots[];
+} SlotArray;
+
+// Each stripe owns the keys whose hash starts with its index. Writers hold
+// its lock for writing and bump seq around their changes; readers do not
+// lock, they validate what they read against seq and retry (see read_pair).
+// Resizing is incremental: while old_table is set, each write/delete moves
+// a few of its slots into table and lookups have to check both arrays.
+// Nodes and arrays that readers may still see are retired, not freed.
+typedef struct Stripe {
+    _Alignas(CACHE_LINE_SIZE) pthread_rwlock_t lock;
+    atomic_uint seq;                 // Odd while a writer is changing the stripe
+    _Atomic(SlotArray *) table;      // Current array, new pairs always go here
+    _Atomic(SlotArray *) old_table;  // Array being migrated, NULL when not resizing
+    size_t count;          // Number of live pairs (in both arrays)
+    size_t used;           // Live pairs plus tombstones in table
+    size_t old_count;      // Live pairs still in old_table
+    size_t rehash_pos;     // Next slot of old_table to migrate
+    Slab nodes;            // Allocator of the KeyNodes
+    SlabClasses values;    // Allocator of the Values
+    atomic_size_t bytes;   // Memory held by pairs, index nodes and slot arrays
+    atomic_size_t retained;  // Old versions and deletions kept for snapshots
+    uint64_t changed;      // Snapshot version of its last write or removal
+    uint64_t expires_until;  // Latest expiry of a TTL set in it, see changed_stripes
+    RetireList retired;    // Nodes, values and arrays waiting for readers to move on
+} Stripe;
+
 typedef struct HashTable {
-    KeyNode *table[TABLE_SIZE];
-    pthread_rwlock_t tablelock;
+    Stripe stripes[TABLE_STRIPES];
+    SkipList index;        // Every pair in key order, for range scans
+    TimerWheel expiry;     // Pairs with a TTL
+    size_t memory_limit;   // Bytes, 0 for no limit
+    pthread_mutex_t clock_lock;  // Serializes the eviction hand
+    size_t clock_stripe;   // Position of the CLOCK hand
+    size_t clock_pos;
+    void (*on_discard)(const char *key);  // Called with the stripe locked for each pair expired or evicted
 } HashTable;
 
+// Point-in-time view of every table, see snapshot_begin.
+typedef struct Snapshot {
+    uint64_t version;      // Sees the values written up to this version
+    uint64_t time_ms;      // Monotonic time when it started
+    struct Snapshot *prev; // Active snapshots, oldest first
+    struct Snapshot *next;
+} Snapshot;
+
+// Called by the scans with a copy of each pair found.
+// @param ctx Argument given to the scan.
+// @param key The key.
+// @param value The value.
+typedef void (*pair_visitor)(void *ctx, const char *key, const char *value);
+
+// Called by the snapshot scans with a copy of each pair found.
+// @param ctx Argument given to the scan.
+// @param key The key.
+// @param value The value.
+// @param expires_at Monotonic time in ms the pair expires at, 0 if never.
+typedef void (*snapshot_visitor)(void *ctx, const char *key, const char *value, uint64_t expires_at);
+
 /// Creates a new KVS hash table.
 /// @return Newly created hash table, NULL on failure
 struct HashTable *create_hash_table();
 
-int hash(const char *key); 
+/// Hashes a key (FNV-1a followed by a 64 bit finalizer).
+/// @param key The key.
+/// @return hash of the key.
+uint64_t hash(const char *key);
+
+/// Computes the stripe a key belongs to.
+/// @param key The key.
+/// @return index of the stripe in ht->stripes.
+size_t stripe_index(const char *key);
+
+/// Computes the shard a key belongs to, when the store is split in several
+/// independent tables. Uses hash bits that neither the stripe, the slot nor
+/// the fingerprint depend on, so that every shard is evenly filled.
+/// @param key The key.
+/// @param num_shards Number of shards.
+/// @return index of the shard.
+size_t shard_index(const char *key, size_t num_shards);
+
+/// Locks a stripe for writing. write_pair and delete_pair must only be
+/// called with the key's stripe locked this way.
+/// @param ht The hash table.
+/// @param index Index of the stripe.
+void stripe_write_lock(HashTable *ht, size_t index);
 
-// Writes a key value pair in the hash table.
+/// Unlocks a stripe locked with stripe_write_lock.
+/// @param ht The hash table.
+/// @param index Index of the stripe.
+void stripe_write_unlock(HashTable *ht, size_t index);
+
+/// Starts an optimistic read of a stripe.
+/// @param ht The hash table.
+/// @param index Index of the stripe.
+/// @return sequence number to validate the read with, odd if a writer holds the stripe.
+unsigned int stripe_read_begin(HashTable *ht, size_t index);
+
+/// Checks whether a stripe changed since stripe_read_begin.
+/// @param ht The hash table.
+/// @param index Index of the stripe.
+/// @param seq Value returned by stripe_read_begin.
+/// @return 1 if what was read must be discarded, 0 if it is consistent.
+int stripe_read_retry(HashTable *ht, size_t index, unsigned int seq);
+
+// Writes a key value pair in the hash table, removing its TTL if it had one.
 // @param ht The hash table.
 // @param key The key.
 // @param value The value.
-// @return 0 if successful.
+// @return 0 if successful, 1 otherwise (also when the key does not fit
+// in MAX_STRING_SIZE, values longer than MAX_VALUE_SIZE - 1 are truncated).
 int write_pair(HashTable *ht, const char *key, const char *value);
 
-// Reads the value of a given key.
+// Reads the value of a given key without taking any lock, copying it into a
+// caller provided buffer so that no allocation is needed. Falls back to the
+// stripe's read lock if writers keep invalidating the optimistic attempts.
+// @param ht The hash table.
+// @param key The key.
+// @param value Buffer of MAX_VALUE_SIZE bytes that receives the value, NULL
+// to only check that the key exists.
+// @return 0 if the key was found, 1 otherwise.
+int read_pair(HashTable *ht, const char *key, char *value);
+
+// Looks a key up without any validation. The caller must either hold the
+// key's stripe lock, or be inside epoch_enter/epoch_exit and discard the
+// result if stripe_read_retry says so. Either way the Value stays valid
+// until the lock is released or the epoch is left.
 // @param ht The hash table.
 // @param key The key.
-// return the value if found, NULL otherwise.
-char* read_pair(HashTable *ht, const char *key);
+// @return the value, NULL if the key was not found.
+const Value *peek_value(HashTable *ht, const char *key);
+
+/// Gets the value of a pair. The stripe lock or an epoch must be held.
+/// @param keyNode The pair.
+/// @return the value.
+const Value *pair_value(const KeyNode *keyNode);
 
 /// Deletes a pair from the table.
 /// @param ht Hash table to read from.
 /// @param key Key of the pair to be deleted.
-/// @return 0 if the node was deleted successfully, 1 otherwise.
+/// @return 0 if the node was deleted successfully, 1 otherwise (also when it
+/// had already expired).
 int delete_pair(HashTable *ht, const char *key);
 
+/// Gets the monotonic clock in milliseconds, the time base of the TTLs.
+/// @return current time.
+uint64_t monotonic_ms(void);
+
+/// Converts the expiry of a pair to wall clock time, which unlike the
+/// monotonic clock still means the same once the server restarts.
+/// @param expires_at Monotonic time in ms, 0 if the pair never expires.
+/// @return milliseconds since the epoch, 0 if the pair never expires.
+uint64_t expiry_to_deadline(uint64_t expires_at);
+
+/// Converts a TTL starting now to a wall clock deadline.
+/// @param ttl_ms Time to live in ms.
+/// @return milliseconds since the epoch.
+uint64_t ttl_to_deadline(uint64_t ttl_ms);
+
+/// Converts a wall clock deadline back to a TTL.
+/// @param deadline Milliseconds since the epoch.
+/// @return time to live in ms, 0 if the deadline passed (or is 0).
+uint64_t deadline_to_ttl(uint64_t deadline);
+
+/// Makes a pair expire after some time. Writing the pair again removes its
+/// TTL. Must be called with the key's stripe locked by stripe_write_lock.
+/// @param ht The hash table.
+/// @param key The key.
+/// @param ttl_ms Time to live in milliseconds.
+/// @return 0 if successful, 1 if the key does not exist.
+int set_expiry(HashTable *ht, const char *key, uint64_t ttl_ms);
+
+/// Computes the memory accounted against memory_limit: pairs, their index
+/// nodes and the slot arrays. Free lists of the allocators are not counted.
+/// @param ht The hash table.
+/// @return bytes in use.
+size_t memory_used(HashTable *ht);
+
+/// Evicts pairs with the CLOCK policy (pairs accessed since the hand last
+/// passed get a second chance) until the memory used is under
+/// ht->memory_limit, calling ht->on_discard for each. Locks the stripes
+/// itself, one at a time, so no stripe lock may be held by the caller.
+/// Does nothing while a snapshot is active, evicting would only add versions.
+/// @param ht The hash table.
+/// @return number of pairs evicted.
+size_t evict_pairs(HashTable *ht);
+
+/// Reclaims the pairs whose TTL ran out, calling ht->on_discard for each.
+/// Locks the stripes itself, one at a time.
+/// @param ht The hash table.
+/// @return number of pairs reclaimed.
+size_t expire_pairs(HashTable *ht);
+
+/// Visits, in key order, the pairs whose key is between from and to (both
+/// included). Writers are not blocked: each pair is read consistently, but
+/// pairs written while the scan runs may or may not be visited.
+/// @param ht The hash table.
+/// @param from Smallest key.
+/// @param to Largest key.
+/// @param visit Called for each pair.
+/// @param ctx Passed to visit.
+void range_pairs(HashTable *ht, const char *from, const char *to, pair_visitor visit, void *ctx);
+
+/// Visits, in key order, the pairs whose key starts with prefix, with the
+/// same guarantees as range_pairs.
+/// @param ht The hash table.
+/// @param prefix The prefix.
+/// @param visit Called for each pair.
+/// @param ctx Passed to visit.
+void prefix_pairs(HashTable *ht, const char *prefix, pair_visitor visit, void *ctx);
+
+/// Starts a snapshot: until snapshot_end, the values and deletions written
+/// after this point are kept apart from what the snapshot sees. Every stripe
+/// of every table must be locked (for reading at least), so that no write is
+/// halfway done; they can be unlocked as soon as this returns.
+/// @param snapshot The snapshot, valid until snapshot_end.
+void snapshot_begin(Snapshot *snapshot);
+
+/// Ends a snapshot. The versions only it could read are released by
+/// snapshot_collect.
+/// @param snapshot The snapshot.
+void snapshot_end(Snapshot *snapshot);
+
+/// Releases the old versions and deleted pairs of a table that no active
+/// snapshot can read anymore. Locks the stripes itself, one at a time.
+/// @param ht The hash table.
+void snapshot_collect(HashTable *ht);
+
+/// Finds the stripes of a table that changed since a snapshot started: those
+/// written to or removed from since, and those with a TTL that may have run
+/// out since. Every stripe must be locked (for reading at least).
+/// @param ht The hash table.
+/// @param version Version of the snapshot.
+/// @param time_ms Time the snapshot started at.
+/// @return bit i set if stripe i changed.
+uint64_t changed_stripes(HashTable *ht, uint64_t version, uint64_t time_ms);
+
+/// Splits the keys of a table in ranges holding about the same number of
+/// pairs, so that they can be scanned in parallel.
+/// @param ht The hash table.
+/// @param parts Number of ranges wanted.
+/// @param keys Receives up to parts - 1 keys, in order: each range goes from
+/// a key (included) to the next (excluded), the first from "" and the last
+/// to the end.
+/// @return number of keys, less than parts - 1 if the table is too small.
+size_t split_pairs(HashTable *ht, size_t parts, char keys[][MAX_STRING_SIZE]);
+
+/// Visits the pairs of a table whose key is in a range as they were when a
+/// snapshot started, like snapshot_pairs.
+/// @param ht The hash table.
+/// @param snapshot An active snapshot.
+/// @param from Smallest key.
+/// @param to Key the range ends before, NULL to go to the end.
+/// @param visit Called for each pair.
+/// @param ctx Passed to visit.
+void snapshot_range_pairs(HashTable *ht, const Snapshot *snapshot, const char *from, const char *to,
+                          snapshot_visitor visit, void *ctx);
+
+/// Visits the pairs of several tables as they were when a snapshot started,
+/// in key order across all of them, without blocking writers. The values
+/// given to visit are not copies, they are only valid during the call.
+/// Pairs whose TTL ran out are skipped.
+/// @param tables The hash tables, no key in more than one of them.
+/// @param num_tables Number of tables.
+/// @param snapshot An active snapshot.
+/// @param visit Called for each pair.
+/// @param ctx Passed to visit.
+void snapshot_pairs(HashTable *tables[], size_t num_tables, const Snapshot *snapshot,
+                    snapshot_visitor visit, void *ctx);
+
+/// Iterates over the pairs stored in a stripe, skipping expired and deleted
+/// ones. The stripe lock must be held.
+/// @param stripe Stripe to iterate.
+/// @param pos Iteration cursor, must be set to 0 before the first call.
+/// @return The next pair, NULL once every slot was visited.
+KeyNode *next_pair(Stripe *stripe, size_t *pos);
+
 /// Frees the hashtable.
 /// @param ht Hash table to be deleted.
 void free_table(HashTable *ht);
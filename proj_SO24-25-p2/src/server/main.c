@@ -2,11 +2,11 @@
 #include <dirent.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <sys/wait.h>
 #include <stdio.h>
 #include <errno.h>
 #include <signal.h>
@@ -17,6 +17,7 @@
 #include "io.h"
 #include "pthread.h"
 #include "pc_queue.h"
+#include "snapshot_file.h"
 
 #include "../common/constants.h"
 #include "../common/io.h"
@@ -29,9 +30,7 @@ struct SharedData {
 };
 
 pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t n_current_backups_lock = PTHREAD_MUTEX_INITIALIZER;
 
-size_t active_backups = 0;     // Number of active backups
 size_t max_backups;            // Maximum allowed simultaneous backups
 size_t max_threads;            // Maximum allowed simultaneous threads
 char* jobs_directory = NULL;
@@ -78,25 +77,27 @@ static int entry_files(const char* dir, struct dirent* entry, char* in_path, cha
   return 0;
 }
 
-static int run_job(int in_fd, int out_fd, char* filename) {
+static int run_job(int in_fd, Output* out, char* filename) {
   size_t file_backups = 0; 
   while (1) {
     char keys[MAX_WRITE_SIZE][MAX_STRING_SIZE] = {0};   
-    char values[MAX_WRITE_SIZE][MAX_STRING_SIZE] = {0}; 
+    char *values[MAX_WRITE_SIZE] = {0};  // Allocated by parse_write
+    unsigned int ttls[MAX_WRITE_SIZE] = {0};
     unsigned int delay; 
     size_t num_pairs;
 
     switch (get_next(in_fd)) { 
       case CMD_WRITE: 
-        num_pairs = parse_write(in_fd, keys, values, MAX_WRITE_SIZE, MAX_STRING_SIZE);  
+        num_pairs = parse_write(in_fd, keys, values, ttls, MAX_WRITE_SIZE, MAX_STRING_SIZE);  
         if (num_pairs == 0) {
           write_str(STDERR_FILENO, "Invalid command. See HELP for usage\n");
           continue;
         }
 
-        if (kvs_write(num_pairs, keys, values)) {
+        if (kvs_write(num_pairs, keys, values, ttls)) {
           write_str(STDERR_FILENO, "Failed to write pair\n");
         }
+        free_values(values, num_pairs);
         break;
 
       case CMD_READ:
@@ -107,7 +108,7 @@ static int run_job(int in_fd, int out_fd, char* filename) {
           continue;
         }
 
-        if (kvs_read(num_pairs, keys, out_fd)) {
+        if (kvs_read(num_pairs, keys, out)) {
           write_str(STDERR_FILENO, "Failed to read pair\n");
         }
         break;
@@ -120,13 +121,108 @@ static int run_job(int in_fd, int out_fd, char* filename) {
           continue;
         }
 
-        if (kvs_delete(num_pairs, keys, out_fd)) {
+        if (kvs_delete(num_pairs, keys, out)) {
           write_str(STDERR_FILENO, "Failed to delete pair\n");
         }
         break;
 
+      case CMD_RANGE:
+        num_pairs = parse_read_delete(in_fd, keys, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+
+        if (num_pairs != 2) {
+          write_str(STDERR_FILENO, "Invalid command. See HELP for usage\n");
+          continue;
+        }
+
+        if (kvs_range(keys[0], keys[1], out)) {
+          write_str(STDERR_FILENO, "Failed to scan range\n");
+        }
+        break;
+
+      case CMD_PREFIX:
+        num_pairs = parse_read_delete(in_fd, keys, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+
+        if (num_pairs != 1) {
+          write_str(STDERR_FILENO, "Invalid command. See HELP for usage\n");
+          continue;
+        }
+
+        if (kvs_prefix(keys[0], out)) {
+          write_str(STDERR_FILENO, "Failed to scan prefix\n");
+        }
+        break;
+
+      case CMD_EXPIRE: {
+        num_pairs = parse_read_delete(in_fd, keys, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+
+        char *end;
+        unsigned long ttl = num_pairs == 2 ? strtoul(keys[1], &end, 10) : 0;
+        if (num_pairs != 2 || keys[1][0] == '\0' || *end != '\0' || ttl > UINT_MAX) {
+          write_str(STDERR_FILENO, "Invalid command. See HELP for usage\n");
+          continue;
+        }
+
+        if (kvs_expire(keys[0], (unsigned int)ttl, out)) {
+          write_str(STDERR_FILENO, "Failed to set expiry\n");
+        }
+        break;
+      }
+
+      case CMD_CAS: {
+        char *expected[MAX_WRITE_SIZE] = {0};
+        num_pairs = parse_cas(in_fd, keys, expected, values, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+        if (num_pairs == 0) {
+          write_str(STDERR_FILENO, "Invalid command. See HELP for usage\n");
+          continue;
+        }
+
+        if (kvs_cas(num_pairs, keys, expected, values, out)) {
+          write_str(STDERR_FILENO, "Failed to compare and swap pair\n");
+        }
+        free_values(expected, num_pairs);
+        free_values(values, num_pairs);
+        break;
+      }
+
+      case CMD_INCR: {
+        num_pairs = parse_read_delete(in_fd, keys, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+
+        char *delta_end;
+        errno = 0;
+        long long delta = num_pairs == 2 ? strtoll(keys[1], &delta_end, 10) : 0;
+        if (num_pairs != 2 || keys[1][0] == '\0' || *delta_end != '\0' || errno != 0) {
+          write_str(STDERR_FILENO, "Invalid command. See HELP for usage\n");
+          continue;
+        }
+
+        if (kvs_incr(keys[0], delta, out)) {
+          write_str(STDERR_FILENO, "Failed to increment pair\n");
+        }
+        break;
+      }
+
+      case CMD_APPEND: {
+        num_pairs = parse_write(in_fd, keys, values, ttls, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+        if (num_pairs == 0) {
+          write_str(STDERR_FILENO, "Invalid command. See HELP for usage\n");
+          continue;
+        }
+
+        bool has_ttl = false;
+        for (size_t i = 0; i < num_pairs; i++) {
+          has_ttl = has_ttl || ttls[i] > 0;
+        }
+        if (has_ttl) {
+          write_str(STDERR_FILENO, "Invalid command. See HELP for usage\n");
+        } else if (kvs_append(num_pairs, keys, values, out)) {
+          write_str(STDERR_FILENO, "Failed to append to pair\n");
+        }
+        free_values(values, num_pairs);
+        break;
+      }
+
       case CMD_SHOW:
-        kvs_show(out_fd);
+        kvs_show(out);
         break;
 
       case CMD_WAIT:
@@ -136,25 +232,18 @@ static int run_job(int in_fd, int out_fd, char* filename) {
         }
 
         if (delay > 0) {
+          // Nothing sits in the buffer while the job sleeps
+          output_flush(out);
           printf("Waiting %d seconds\n", delay / 1000);
           kvs_wait(delay);
         }
         break;
 
       case CMD_BACKUP:
-        pthread_mutex_lock(&n_current_backups_lock);
-        if (active_backups >= max_backups) {
-          wait(NULL);
-        } else {
-          active_backups++;
-        }
-        pthread_mutex_unlock(&n_current_backups_lock);
-        int aux = kvs_backup(++file_backups, filename, jobs_directory);
-
-        if (aux < 0) {
+        // The output up to the backup is in the file once it is taken
+        output_flush(out);
+        if (kvs_backup(++file_backups, filename, jobs_directory) < 0) {
             write_str(STDERR_FILENO, "Failed to do backup\n");
-        } else if (aux == 1) {
-          return 1;
         }
         break;
 
@@ -165,9 +254,15 @@ static int run_job(int in_fd, int out_fd, char* filename) {
       case CMD_HELP:
         write_str(STDOUT_FILENO,
             "Available commands:\n"
-            "  WRITE [(key,value)(key2,value2),...]\n"
+            "  WRITE [(key,value)(key2,value2,ttl_ms),...]\n"
             "  READ [key,key2,...]\n"
             "  DELETE [key,key2,...]\n"
+            "  RANGE [from,to]\n"
+            "  PREFIX [prefix]\n"
+            "  EXPIRE [key,ttl_ms]\n"
+            "  CAS [(key,expected,new)(key2,expected2,new2),...]\n"
+            "  INCR [key,delta]\n"
+            "  APPEND [(key,suffix)(key2,suffix2),...]\n"
             "  SHOW\n"
             "  WAIT <delay_ms>\n"
             "  BACKUP\n" // Not implemented
@@ -224,20 +319,25 @@ static void* get_file(void* arguments) {
       pthread_exit(NULL);
     }
 
-    int out = run_job(in_fd, out_fd, entry->d_name);
-
-    close(in_fd);
-    close(out_fd);
+    Output out;
+    if (output_open(&out, out_fd, OUTPUT_JOB_BUFFER_SIZE) != 0) {
+      write_str(STDERR_FILENO, "Failed to open output file: ");
+      write_str(STDERR_FILENO, out_path);
+      write_str(STDERR_FILENO, "\n");
+      pthread_exit(NULL);
+    }
 
-    if (out) {
-      if (closedir(dir) == -1) {
-        fprintf(stderr, "Failed to close directory\n");
-        return 0;
-      }
+    run_job(in_fd, &out, entry->d_name);
 
-      exit(0);
+    if (output_close(&out) != 0) {
+      write_str(STDERR_FILENO, "Failed to write output file: ");
+      write_str(STDERR_FILENO, out_path);
+      write_str(STDERR_FILENO, "\n");
     }
 
+    close(in_fd);
+    close(out_fd);
+
     if (pthread_mutex_lock(&thread_data->directory_mutex) != 0) {
       fprintf(stderr, "Thread failed to lock directory_mutex\n");
       return NULL;
@@ -588,13 +688,44 @@ void *server_fifo_handler(){
 
 
 
+/// Parses a memory size, in bytes or with a K, M or G suffix.
+/// @param str The string.
+/// @param size Receives the size in bytes.
+/// @return 0 if successful, 1 otherwise.
+static int parse_memory_size(const char *str, size_t *size) {
+  char *endptr;
+  unsigned long long value = strtoull(str, &endptr, 10);
+  if (endptr == str) {
+    return 1;
+  }
+
+  unsigned int shift = 0;
+  switch (*endptr) {
+    case 'K': shift = 10; endptr++; break;
+    case 'M': shift = 20; endptr++; break;
+    case 'G': shift = 30; endptr++; break;
+    default: break;
+  }
+  if (*endptr != '\0' || value > (SIZE_MAX >> shift)) {
+    return 1;
+  }
+
+  *size = (size_t)value << shift;
+  return 0;
+}
+
 int main(int argc, char** argv) {
-  if (argc < 4) { 
+  if (argc < 5) { 
     write_str(STDERR_FILENO, "Usage: ");
     write_str(STDERR_FILENO, argv[0]);
     write_str(STDERR_FILENO, " <jobs_dir>");
 		write_str(STDERR_FILENO, " <max_threads>");
-		write_str(STDERR_FILENO, " <max_backups> \n");
+		write_str(STDERR_FILENO, " <max_backups>");
+		write_str(STDERR_FILENO, " <server_pipe> [--max-memory <bytes>[K|M|G]] [--shards <n>]");
+    write_str(STDERR_FILENO, " [--backup-format text|binary [--backup-deltas <n>] [--backup-segments <n>]] [--backup-sync]");
+    write_str(STDERR_FILENO, " [--backup-window <ms>] [--io-uring]");
+    write_str(STDERR_FILENO, " [--restore <backup>]");
+    write_str(STDERR_FILENO, " [--wal <log> [--wal-sync always|never|<ms>]]\n");
     return 1;
   }
 
@@ -625,10 +756,126 @@ int main(int argc, char** argv) {
 		return 0;
 	}
 
-  if (kvs_init()) {
+  // Optional arguments, after the server pipe name
+  size_t max_memory = 0;
+  size_t shards = 1;
+  bool binary_backups = false;
+  unsigned long backup_deltas = 0;
+  unsigned long backup_segments = 1;
+  const char *restore_path = NULL;
+  const char *wal_path = NULL;
+  enum WalSync wal_sync = WAL_SYNC_ALWAYS;
+  unsigned long wal_interval = 0;
+  for (int i = 5; i < argc; i++) {
+    if (strcmp(argv[i], "--max-memory") == 0 && i + 1 < argc) {
+      if (parse_memory_size(argv[++i], &max_memory) != 0) {
+        fprintf(stderr, "Invalid max_memory value\n");
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--shards") == 0 && i + 1 < argc) {
+      // One shard per job thread keeps the threads off each other's tables
+      shards = strtoul(argv[++i], &endptr, 10);
+      if (*endptr != '\0' || shards == 0 || shards > MAX_SHARDS) {
+        fprintf(stderr, "Invalid shards value\n");
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--backup-format") == 0 && i + 1 < argc) {
+      i++;
+      if (strcmp(argv[i], "binary") == 0) {
+        kvs_set_backup_format(BACKUP_BINARY);
+        binary_backups = true;
+      } else if (strcmp(argv[i], "text") != 0) {
+        fprintf(stderr, "Invalid backup format\n");
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--backup-deltas") == 0 && i + 1 < argc) {
+      i++;
+      backup_deltas = strtoul(argv[i], &endptr, 10);
+      if (argv[i][0] == '\0' || *endptr != '\0') {
+        fprintf(stderr, "Invalid backup-deltas value\n");
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--backup-segments") == 0 && i + 1 < argc) {
+      i++;
+      backup_segments = strtoul(argv[i], &endptr, 10);
+      if (argv[i][0] == '\0' || *endptr != '\0' || backup_segments == 0 ||
+          backup_segments > MAX_SNAPSHOT_SEGMENTS) {
+        fprintf(stderr, "Invalid backup-segments value\n");
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--backup-sync") == 0) {
+      kvs_set_backup_sync(true);
+    } else if (strcmp(argv[i], "--backup-window") == 0 && i + 1 < argc) {
+      // BACKUPs within the window with no write in between share one snapshot
+      i++;
+      unsigned long backup_window = strtoul(argv[i], &endptr, 10);
+      if (argv[i][0] == '\0' || *endptr != '\0' || backup_window > UINT_MAX) {
+        fprintf(stderr, "Invalid backup-window value\n");
+        return 1;
+      }
+      kvs_set_backup_window((unsigned int)backup_window);
+    } else if (strcmp(argv[i], "--io-uring") == 0) {
+      // Job output and backups are written by the kernel while the threads go on
+      if (output_use_io_uring() != 0) {
+        fprintf(stderr, "io_uring is not available, writing the files directly\n");
+      }
+    } else if (strcmp(argv[i], "--restore") == 0 && i + 1 < argc) {
+      restore_path = argv[++i];
+    } else if (strcmp(argv[i], "--wal") == 0 && i + 1 < argc) {
+      wal_path = argv[++i];
+    } else if (strcmp(argv[i], "--wal-sync") == 0 && i + 1 < argc) {
+      i++;
+      if (strcmp(argv[i], "always") == 0) {
+        wal_sync = WAL_SYNC_ALWAYS;
+      } else if (strcmp(argv[i], "never") == 0) {
+        wal_sync = WAL_SYNC_NEVER;
+      } else {
+        wal_sync = WAL_SYNC_PERIODIC;
+        wal_interval = strtoul(argv[i], &endptr, 10);
+        if (argv[i][0] == '\0' || *endptr != '\0' || wal_interval == 0 || wal_interval > UINT_MAX) {
+          fprintf(stderr, "Invalid wal-sync value\n");
+          return 1;
+        }
+      }
+    } else {
+      fprintf(stderr, "Unknown option: %s\n", argv[i]);
+      return 1;
+    }
+  }
+
+  // Deltas and segments are only restored from binary backups
+  if (backup_deltas > 0 && !binary_backups) {
+    fprintf(stderr, "--backup-deltas requires --backup-format binary\n");
+    return 1;
+  }
+  if (backup_segments > 1 && !binary_backups) {
+    fprintf(stderr, "--backup-segments requires --backup-format binary\n");
+    return 1;
+  }
+  kvs_set_backup_deltas(backup_deltas);
+  kvs_set_backup_segments(backup_segments);
+
+  if (kvs_init(shards)) {
     write_str(STDERR_FILENO, "Failed to initialize KVS\n");
     return 1;
   }
+  kvs_set_max_memory(max_memory);
+  if (kvs_backups_init(max_backups)) {
+    write_str(STDERR_FILENO, "Failed to start the backup threads\n");
+    kvs_terminate();
+    return 1;
+  }
+  // The pairs of the backup are in place before any job runs
+  if (restore_path != NULL && kvs_restore(restore_path)) {
+    write_str(STDERR_FILENO, "Failed to restore backup\n");
+    kvs_terminate();
+    return 1;
+  }
+  // Then the changes made after it
+  if (wal_path != NULL && kvs_wal_open(wal_path, wal_sync, (unsigned int)wal_interval)) {
+    kvs_terminate();
+    return 1;
+  }
 
   DIR* dir = opendir(argv[1]);
   if (dir == NULL) {
@@ -720,10 +967,7 @@ int main(int argc, char** argv) {
     return 0;
   }
 
-  while (active_backups > 0) {
-    wait(NULL);
-    active_backups--;
-  }
+  kvs_wait_backup();
 
   //kvs_terminate();
 
@@ -1,21 +1,29 @@
 #include "operations.h"
 
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
 
 #include "constants.h"
+#include "file_writer.h"
 #include "io.h"
 #include "kvs.h"
+#include "snapshot_file.h"
+#include "wal.h"
 #include "../common/constants.h"
 #include "../common/io.h"
 
-static struct HashTable *kvs_table = NULL;
+// The store is split in independent tables, each with its own locks, index,
+// expiry wheel and allocators. Keys are routed to them by hash.
+static struct HashTable *kvs_shards[MAX_SHARDS];
+static size_t num_shards = 0;
 
 //static Subscription subscriptions[MAX_NUMBER_SUB];
 static pthread_rwlock_t subscriptions_lock = PTHREAD_RWLOCK_INITIALIZER;
@@ -23,6 +31,88 @@ static pthread_rwlock_t subscriptions_lock = PTHREAD_RWLOCK_INITIALIZER;
 static client_t *clients[MAX_SESSION_COUNT];
 static pthread_rwlock_t clients_lock = PTHREAD_RWLOCK_INITIALIZER;
 
+static pthread_t expiry_sweeper;
+static atomic_bool stop_sweeper = false;
+static _Atomic uint64_t discards_logged = 0;  // Position to commit the discarded pairs up to
+
+static Wal wal;
+static bool wal_enabled = false;
+static uint64_t restored_log_position = 0;  // Of the snapshot restored, replayed from
+
+// Room for a pair, its parentheses, a separator and an end of a few bytes each
+#define PAIR_STR_SIZE (MAX_STRING_SIZE + MAX_VALUE_SIZE + 8)
+
+#define MAX_RESTORE_THREADS 16
+#define RESTORE_MIN_CHUNK 4096  // Records worth starting a restore thread for
+
+#define SEGMENT_PATH_SIZE (MAX_JOB_FILE_NAME_SIZE + 24)
+
+// Other name of the file of a backup, for a BACKUP coalesced into it.
+typedef struct BackupLink {
+  char path[MAX_JOB_FILE_NAME_SIZE];
+  struct BackupLink *next;
+} BackupLink;
+
+// Backups are written from snapshots by a pool of threads, a BACKUP only
+// holds its job thread while the snapshot is taken. Requests beyond what the
+// threads can write at once wait in a queue that never fills up, so a job
+// thread never waits for another backup either.
+typedef struct BackupRequest {
+  Snapshot snapshot;
+  char path[MAX_JOB_FILE_NAME_SIZE];
+  uint64_t id;          // Binary backups only, see SnapshotHeader
+  uint64_t log_position;  // Binary backups only
+  bool delta;
+  uint64_t partitions;  // Deltas only: stripes changed since the base
+  uint64_t base_id;     // Deltas only
+  char base[MAX_JOB_FILE_NAME_SIZE];  // Deltas only: file name of the base
+  BackupLink *links;    // Linked to the file once it is written
+  char source[MAX_JOB_FILE_NAME_SIZE];  // Coalesced into a backup already
+                                        // written: its file, only linked to
+  struct BackupRequest *next;
+} BackupRequest;
+
+// Last backup taken, the BACKUPs requested in the window after it are
+// coalesced into.
+typedef struct {
+  BackupRequest *request;  // Until it is written
+  char path[MAX_JOB_FILE_NAME_SIZE];
+  uint64_t version;        // Of its snapshot
+  uint64_t time_ms;        // When its snapshot started
+} LastBackup;
+
+// Last full binary backup, that the deltas are based on.
+typedef struct {
+  uint64_t id;
+  uint64_t version;  // Of its snapshot
+  uint64_t time_ms;  // When its snapshot started
+  char directory[MAX_JOB_FILE_NAME_SIZE];
+  char name[MAX_JOB_FILE_NAME_SIZE];
+} BackupBase;
+
+static pthread_t *backup_threads = NULL;
+static size_t num_backup_threads = 0;
+static BackupRequest *backups_head = NULL;  // Requests not yet taken by a thread
+static BackupRequest *backups_tail = NULL;
+static size_t pending_backups = 0;          // Requested but not yet written
+static LastBackup last_backup;
+static bool has_last_backup = false;
+static bool stop_backups = false;
+static pthread_mutex_t pending_backups_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t backups_queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t backups_done = PTHREAD_COND_INITIALIZER;
+static enum BackupFormat backup_format = BACKUP_TEXT;
+static bool backup_sync = false;
+static size_t backup_segments = 1;  // Files each binary backup is written to in parallel
+static unsigned int backup_window_ms = 0;  // 0 to never coalesce BACKUPs
+static pthread_mutex_t backup_base_lock = PTHREAD_MUTEX_INITIALIZER;
+static BackupBase backup_base;
+static bool has_backup_base = false;
+static size_t backup_deltas = 0;      // Written since backup_base
+static size_t max_backup_deltas = 0;  // 0 for full backups only
+
+static void stop_backup_threads();
+
 
 
 /// Calculates a timespec from a delay in milliseconds.
@@ -32,166 +122,1521 @@ static struct timespec delay_to_timespec(unsigned int delay_ms) {
   return (struct timespec){delay_ms / 1000, (delay_ms % 1000) * 1000000};
 }
 
-int kvs_init() {
-  if (kvs_table != NULL) {
+/// Gets the shard holding a key.
+/// @param key The key.
+/// @return the shard's table.
+static struct HashTable *shard_of(const char *key) {
+  return kvs_shards[shard_index(key, num_shards)];
+}
+
+// Stripes are identified across shards by shard * TABLE_STRIPES + stripe.
+#define STRIPE_ID(shard, stripe) ((shard) * TABLE_STRIPES + (stripe))
+#define STRIPE_SHARD(id) (kvs_shards[(id) / TABLE_STRIPES])
+#define STRIPE_INDEX(id) ((id) % TABLE_STRIPES)
+
+static int compare_ids(const void *a, const void *b) {
+  size_t x = *(const size_t *)a;
+  size_t y = *(const size_t *)b;
+  return (x > y) - (x < y);
+}
+
+/// Collects the stripes touched by a set of keys in ascending order of id,
+/// which is the order every command locks them in so that commands cannot
+/// deadlock.
+/// @param num_keys Number of keys.
+/// @param keys Array of keys' strings.
+/// @param stripes Array of num_keys entries that receives the stripe ids.
+/// @return Number of stripes stored in stripes.
+static size_t collect_stripes(size_t num_keys, char keys[][MAX_STRING_SIZE], size_t stripes[]) {
+  for (size_t i = 0; i < num_keys; i++) {
+    stripes[i] = STRIPE_ID(shard_index(keys[i], num_shards), stripe_index(keys[i]));
+  }
+  qsort(stripes, num_keys, sizeof(size_t), compare_ids);
+
+  size_t num_stripes = 0;
+  for (size_t i = 0; i < num_keys; i++) {
+    if (num_stripes == 0 || stripes[num_stripes - 1] != stripes[i]) {
+      stripes[num_stripes++] = stripes[i];
+    }
+  }
+  return num_stripes;
+}
+
+/// Fills an array with the id of every stripe of every shard, in ascending
+/// order.
+/// @param stripes Array of num_shards * TABLE_STRIPES entries that receives
+/// the stripe ids.
+/// @return Number of stripes stored in stripes.
+static size_t all_stripes(size_t stripes[]) {
+  for (size_t i = 0; i < num_shards * TABLE_STRIPES; i++) {
+    stripes[i] = i;
+  }
+  return num_shards * TABLE_STRIPES;
+}
+
+/// Locks a set of stripes, in the given (ascending) order.
+/// @param num_stripes Number of stripes.
+/// @param stripes Stripe ids.
+/// @param exclusive Whether to lock for writing.
+static void lock_stripes(size_t num_stripes, const size_t stripes[], bool exclusive) {
+  for (size_t i = 0; i < num_stripes; i++) {
+    if (exclusive) {
+      stripe_write_lock(STRIPE_SHARD(stripes[i]), STRIPE_INDEX(stripes[i]));
+    } else {
+      pthread_rwlock_rdlock(&STRIPE_SHARD(stripes[i])->stripes[STRIPE_INDEX(stripes[i])].lock);
+    }
+  }
+}
+
+/// Unlocks a set of stripes.
+/// @param num_stripes Number of stripes.
+/// @param stripes Stripe ids.
+/// @param exclusive Whether they were locked for writing.
+static void unlock_stripes(size_t num_stripes, const size_t stripes[], bool exclusive) {
+  for (size_t i = num_stripes; i > 0; i--) {
+    if (exclusive) {
+      stripe_write_unlock(STRIPE_SHARD(stripes[i - 1]), STRIPE_INDEX(stripes[i - 1]));
+    } else {
+      pthread_rwlock_unlock(&STRIPE_SHARD(stripes[i - 1])->stripes[STRIPE_INDEX(stripes[i - 1])].lock);
+    }
+  }
+}
+
+/// Appends a change to the log, if there is one. Must be called with the
+/// key's stripe locked, so that the changes to a key are logged in order.
+/// @param logged Position the command has to commit up to, updated.
+/// @param op The operation.
+/// @param key The key.
+/// @param value The value, NULL for deletions and WAL_EXPIRE.
+/// @param deadline Time the pair expires at, in milliseconds since the epoch,
+/// 0 if never.
+static void log_change(uint64_t *logged, enum WalOp op, const char *key, const char *value,
+                       uint64_t deadline) {
+  if (!wal_enabled) {
+    return;
+  }
+  uint64_t position = wal_append(&wal, op, key, value, deadline);
+  if (position == 0) {
+    fprintf(stderr, "Failed to log change to %s\n", key);
+  } else if (position > *logged) {
+    *logged = position;
+  }
+}
+
+/// Waits for the changes of a command to be in the log. Called once its
+/// stripes are unlocked, the threads waiting meanwhile are committed together.
+/// A failed log takes no more changes, see wal_commit.
+/// @param logged Position the command has to commit up to, 0 for none.
+static void commit_changes(uint64_t logged) {
+  if (logged != 0 && wal_commit(&wal, logged) != 0) {
+    fprintf(stderr, "Failed to commit changes to the log\n");
+  }
+}
+
+/// Waits for the deletions of the pairs discarded so far to be in the log.
+/// Called once pairs were expired or evicted, with no stripe locked.
+static void commit_discards() {
+  commit_changes(atomic_load(&discards_logged));
+}
+
+/// Evicts pairs from the shards a command wrote to, if they are over their
+/// memory limit. Must be called once the command's stripes are unlocked,
+/// eviction locks stripes on its own, in its own order.
+/// @param num_stripes Number of stripes.
+/// @param stripes Stripe ids, in ascending order.
+static void evict_shards(size_t num_stripes, const size_t stripes[]) {
+  // Ids are sorted, so the stripes of a shard are next to each other
+  bool evicted = false;
+  for (size_t i = 0; i < num_stripes; i++) {
+    if ((i == 0 || STRIPE_SHARD(stripes[i]) != STRIPE_SHARD(stripes[i - 1])) &&
+        evict_pairs(STRIPE_SHARD(stripes[i])) > 0) {
+      evicted = true;
+    }
+  }
+  if (evicted) {
+    commit_discards();
+  }
+}
+
+/// Formats a pair as "(key<separator>value)<end>". Only uses async signal
+/// safe functions.
+/// @param aux Buffer of PAIR_STR_SIZE bytes, receives the terminated string.
+/// @param key The key.
+/// @param separator Written between the key and the value.
+/// @param value The value.
+/// @param end Written after the closing parenthesis.
+/// @return length of the string.
+static size_t format_pair_str(char *aux, const char *key, const char *separator,
+                              const char *value, const char *end) {
+  size_t len = 0;
+  aux[len++] = '(';
+  len += strn_memcpy(aux + len, key, MAX_STRING_SIZE - 1);
+  len += strn_memcpy(aux + len, separator, 2);
+  len += strn_memcpy(aux + len, value, MAX_VALUE_SIZE - 1);
+  aux[len++] = ')';
+  len += strn_memcpy(aux + len, end, 2);
+  aux[len] = '\0';
+  return len;
+}
+
+/// Adds a pair as "(key<separator>value)<end>" to an output, in one piece
+/// however long the value is.
+/// @param out The output.
+/// @param key The key.
+/// @param separator Written between the key and the value.
+/// @param value The value.
+/// @param end Written after the closing parenthesis.
+static void write_pair_str(Output *out, const char *key, const char *separator,
+                           const char *value, const char *end) {
+  char aux[PAIR_STR_SIZE];
+  size_t len = format_pair_str(aux, key, separator, value, end);
+  output_write(out, aux, len);
+}
+
+/// Reads a set of keys without locking, all from the same state of their
+/// stripes: the values are only kept if no stripe changed while they were
+/// looked up. Gives up after READ_OPTIMISTIC_TRIES attempts. Must be called
+/// inside an epoch, which keeps the values alive until it is left.
+/// @param num_pairs Number of keys.
+/// @param keys Array of keys' strings.
+/// @param num_stripes Number of stripes touched by the keys.
+/// @param stripes Stripe ids.
+/// @param values Receives the values, NULL for the keys not found.
+/// @return 0 if the values are consistent, 1 if the stripes must be locked.
+static int read_optimistic(size_t num_pairs, char keys[][MAX_STRING_SIZE],
+                           size_t num_stripes, const size_t stripes[],
+                           const Value *values[]) {
+  unsigned int seqs[num_stripes];
+  for (int tries = 0; tries < READ_OPTIMISTIC_TRIES; tries++) {
+    bool busy = false;
+    for (size_t i = 0; i < num_stripes && !busy; i++) {
+      seqs[i] = stripe_read_begin(STRIPE_SHARD(stripes[i]), STRIPE_INDEX(stripes[i]));
+      busy = seqs[i] & 1;
+    }
+    if (busy) {
+      continue;
+    }
+
+    for (size_t i = 0; i < num_pairs; i++) {
+      values[i] = peek_value(shard_of(keys[i]), keys[i]);
+    }
+
+    bool changed = false;
+    for (size_t i = 0; i < num_stripes && !changed; i++) {
+      changed = stripe_read_retry(STRIPE_SHARD(stripes[i]), STRIPE_INDEX(stripes[i]), seqs[i]);
+    }
+    if (!changed) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/// Logs the deletion of a pair that expired or was evicted, and reports it to
+/// its subscribers as deleted. Called with the pair's stripe locked.
+/// @param key Key of the pair.
+static void notify_discarded(const char *key) {
+  uint64_t logged = 0;
+  log_change(&logged, WAL_DELETE, key, NULL, 0);
+  uint64_t previous = atomic_load(&discards_logged);
+  while (logged > previous && !atomic_compare_exchange_weak(&discards_logged, &previous, logged)) {
+  }
+  notify_subscribers(key, NULL);
+}
+
+/// Background thread reclaiming the pairs whose TTL ran out, once per tick
+/// of the expiry wheel.
+static void *sweep_expired() {
+  // SIGUSR1 must be handled by the main thread
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+  struct timespec tick = delay_to_timespec(TIMER_TICK_MS);
+  while (!atomic_load(&stop_sweeper)) {
+    nanosleep(&tick, NULL);
+    size_t expired = 0;
+    for (size_t i = 0; i < num_shards; i++) {
+      expired += expire_pairs(kvs_shards[i]);
+    }
+    if (expired > 0) {
+      commit_discards();
+    }
+  }
+  return NULL;
+}
+
+/// Frees every shard.
+static void free_shards() {
+  for (size_t i = 0; i < num_shards; i++) {
+    free_table(kvs_shards[i]);
+  }
+  num_shards = 0;
+}
+
+int kvs_init(size_t shards) {
+  if (num_shards != 0) {
     fprintf(stderr, "KVS state has already been initialized\n");
     return 1;
   }
+  if (shards == 0 || shards > MAX_SHARDS) {
+    fprintf(stderr, "Invalid number of shards\n");
+    return 1;
+  }
+
+  for (; num_shards < shards; num_shards++) {
+    kvs_shards[num_shards] = create_hash_table();
+    if (kvs_shards[num_shards] == NULL) {
+      free_shards();
+      return 1;
+    }
+    kvs_shards[num_shards]->on_discard = notify_discarded;
+  }
 
-  kvs_table = create_hash_table();
-  return kvs_table == NULL;
+  atomic_store(&stop_sweeper, false);
+  if (pthread_create(&expiry_sweeper, NULL, sweep_expired, NULL) != 0) {
+    fprintf(stderr, "Failed to create the expiry thread\n");
+    free_shards();
+    return 1;
+  }
+  return 0;
 }
 
 int kvs_terminate() {
-  if (kvs_table == NULL) {
+  if (num_shards == 0) {
     fprintf(stderr, "KVS state must be initialized\n");
     return 1;
   }
 
-  free_table(kvs_table);
-  kvs_table = NULL;
+  atomic_store(&stop_sweeper, true);
+  pthread_join(expiry_sweeper, NULL);
+  stop_backup_threads();
+  if (wal_enabled) {
+    wal_close(&wal);
+    wal_enabled = false;
+  }
+  free_shards();
   return 0;
 }
 
 int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE],
-              char values[][MAX_STRING_SIZE]) {
-  if (kvs_table == NULL) {
+              char *values[], const unsigned int ttls[]) {
+  if (num_shards == 0) {
     fprintf(stderr, "KVS state must be initialized\n");
     return 1;
   }
 
-  pthread_rwlock_wrlock(&kvs_table->tablelock);
+  // Only the stripes owning the keys are locked, in every shard they live
+  // in, all of them for the whole command so that other commands see either
+  // none or all of its pairs
+  size_t stripes[num_pairs];
+  size_t num_stripes = collect_stripes(num_pairs, keys, stripes);
+  lock_stripes(num_stripes, stripes, true);
 
+  uint64_t logged = 0;
   for (size_t i = 0; i < num_pairs; i++) {
-    if (write_pair(kvs_table, keys[i], values[i]) != 0) {
+    struct HashTable *shard = shard_of(keys[i]);
+    if (write_pair(shard, keys[i], values[i]) != 0) {
       fprintf(stderr, "Failed to write key pair (%s,%s)\n", keys[i], values[i]);
     } else {
+      uint64_t deadline = 0;
+      if (ttls != NULL && ttls[i] > 0) {
+        set_expiry(shard, keys[i], ttls[i]);
+        deadline = ttl_to_deadline(ttls[i]);
+      }
+      log_change(&logged, WAL_WRITE, keys[i], values[i], deadline);
       notify_subscribers(keys[i], values[i]);
     }
   }
 
-  pthread_rwlock_unlock(&kvs_table->tablelock);
+  unlock_stripes(num_stripes, stripes, true);
+  commit_changes(logged);
+  evict_shards(num_stripes, stripes);
   return 0;
 }
 
-int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd) {
-  if (kvs_table == NULL) {
+void kvs_set_max_memory(size_t max_memory) {
+  // Every shard gets an equal part, keys are spread evenly among them
+  size_t shard_memory = max_memory / num_shards;
+  if (max_memory != 0 && shard_memory == 0) {
+    shard_memory = 1;
+  }
+  for (size_t i = 0; i < num_shards; i++) {
+    kvs_shards[i]->memory_limit = shard_memory;
+  }
+}
+
+int kvs_expire(const char *key, unsigned int ttl_ms, Output *out) {
+  if (num_shards == 0) {
     fprintf(stderr, "KVS state must be initialized\n");
     return 1;
   }
 
-  pthread_rwlock_rdlock(&kvs_table->tablelock);
+  struct HashTable *shard = shard_of(key);
+  size_t stripe = stripe_index(key);
+  uint64_t logged = 0;
+  stripe_write_lock(shard, stripe);
+  int missing = set_expiry(shard, key, ttl_ms);
+  if (!missing) {
+    log_change(&logged, WAL_EXPIRE, key, NULL, ttl_to_deadline(ttl_ms));
+  }
+  stripe_write_unlock(shard, stripe);
+  commit_changes(logged);
+
+  if (missing) {
+    output_str(out, "[");
+    write_pair_str(out, key, ",", "KVSMISSING", "]\n");
+  }
+  return 0;
+}
+
+int kvs_cas(size_t num_triples, char keys[][MAX_STRING_SIZE], char *expected[],
+            char *values[], Output *out) {
+  if (num_shards == 0) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return 1;
+  }
 
-  write_str(fd, "[");
+  // Comparing and writing under the same locks, no other command can change
+  // a pair in between
+  size_t stripes[num_triples];
+  size_t num_stripes = collect_stripes(num_triples, keys, stripes);
+  lock_stripes(num_stripes, stripes, true);
+
+  int aux = 0;
+  uint64_t logged = 0;
+  for (size_t i = 0; i < num_triples; i++) {
+    struct HashTable *shard = shard_of(keys[i]);
+    const Value *current = peek_value(shard, keys[i]);
+    const char *failure = NULL;
+    if (current == NULL) {
+      failure = "KVSMISSING";
+    } else if (strcmp(current->data, expected[i]) != 0) {
+      failure = "KVSMISMATCH";
+    } else if (write_pair(shard, keys[i], values[i]) != 0) {
+      failure = "KVSERROR";
+    } else {
+      log_change(&logged, WAL_WRITE, keys[i], values[i], 0);
+      notify_subscribers(keys[i], values[i]);
+    }
+
+    if (failure != NULL) {
+      if (!aux) {
+        output_str(out, "[");
+        aux = 1;
+      }
+      write_pair_str(out, keys[i], ",", failure, "");
+    }
+  }
+  if (aux) {
+    output_str(out, "]\n");
+  }
+
+  unlock_stripes(num_stripes, stripes, true);
+  commit_changes(logged);
+  evict_shards(num_stripes, stripes);
+  return 0;
+}
+
+int kvs_incr(const char *key, long long delta, Output *out) {
+  if (num_shards == 0) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return 1;
+  }
+
+  struct HashTable *shard = shard_of(key);
+  size_t stripe = stripe_index(key);
+  stripe_write_lock(shard, stripe);
+
+  // A missing key counts as 0
+  long long number = 0;
+  const Value *current = peek_value(shard, key);
+  char result[MAX_VALUE_SIZE];
+  bool valid = true;
+  if (current != NULL) {
+    char *end;
+    errno = 0;
+    number = strtoll(current->data, &end, 10);
+    valid = current->data[0] != '\0' && *end == '\0' && errno == 0;
+  }
+  if (valid && !__builtin_add_overflow(number, delta, &number)) {
+    snprintf(result, sizeof(result), "%lld", number);
+    valid = write_pair(shard, key, result) == 0;
+  } else {
+    valid = false;
+  }
+  uint64_t logged = 0;
+  if (valid) {
+    log_change(&logged, WAL_WRITE, key, result, 0);
+    notify_subscribers(key, result);
+  }
+
+  stripe_write_unlock(shard, stripe);
+  commit_changes(logged);
+  if (valid && evict_pairs(shard) > 0) {
+    commit_discards();
+  }
+
+  output_str(out, "[");
+  write_pair_str(out, key, ",", valid ? result : "KVSERROR", "]\n");
+  return 0;
+}
+
+int kvs_append(size_t num_pairs, char keys[][MAX_STRING_SIZE], char *suffixes[],
+               Output *out) {
+  if (num_shards == 0) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return 1;
+  }
+
+  size_t stripes[num_pairs];
+  size_t num_stripes = collect_stripes(num_pairs, keys, stripes);
+  lock_stripes(num_stripes, stripes, true);
+
+  int aux = 0;
+  uint64_t logged = 0;
+  char result[MAX_VALUE_SIZE];
+  for (size_t i = 0; i < num_pairs; i++) {
+    // A missing key is appended to as if it were empty. The current value is
+    // copied out before write_pair replaces it.
+    struct HashTable *shard = shard_of(keys[i]);
+    const Value *current = peek_value(shard, keys[i]);
+    size_t length = current != NULL ? current->length : 0;
+    size_t suffix_length = strlen(suffixes[i]);
+    bool valid = length + suffix_length < MAX_VALUE_SIZE;
+    if (valid) {
+      if (length > 0) {
+        memcpy(result, current->data, length);
+      }
+      memcpy(result + length, suffixes[i], suffix_length + 1);
+      valid = write_pair(shard, keys[i], result) == 0;
+    }
+
+    if (valid) {
+      log_change(&logged, WAL_WRITE, keys[i], result, 0);
+      notify_subscribers(keys[i], result);
+    } else {
+      if (!aux) {
+        output_str(out, "[");
+        aux = 1;
+      }
+      write_pair_str(out, keys[i], ",", "KVSERROR", "");
+    }
+  }
+  if (aux) {
+    output_str(out, "]\n");
+  }
+
+  unlock_stripes(num_stripes, stripes, true);
+  commit_changes(logged);
+  evict_shards(num_stripes, stripes);
+  return 0;
+}
+
+/// Writes the output of a READ command.
+/// @param num_pairs Number of keys.
+/// @param keys Array of keys' strings.
+/// @param values Value of each key, NULL for the keys not found.
+/// @param out Output to write to.
+static void write_read_output(size_t num_pairs, char keys[][MAX_STRING_SIZE],
+                              const Value *values[], Output *out) {
+  output_str(out, "[");
   for (size_t i = 0; i < num_pairs; i++) {
-    char *result = read_pair(kvs_table, keys[i]);
-    char aux[MAX_STRING_SIZE];
-    if (result == NULL) {
-      snprintf(aux, MAX_STRING_SIZE, "(%s,KVSERROR)", keys[i]);
+    write_pair_str(out, keys[i], ",", values[i] ? values[i]->data : "KVSERROR", "");
+  }
+  output_str(out, "]\n");
+}
+
+int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], Output *out) {
+  if (num_shards == 0) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return 1;
+  }
+
+  // Readers do not lock unless writers keep changing the stripes under them.
+  // Each key is looked up in its own shard, the values are kept by position
+  // so the output follows the order of the command. They are written
+  // straight from the tables, not copied: the epoch (or the stripe locks)
+  // keeps them alive until they are out.
+  size_t stripes[num_pairs];
+  size_t num_stripes = collect_stripes(num_pairs, keys, stripes);
+  const Value *values[num_pairs];
+  epoch_enter();
+  if (read_optimistic(num_pairs, keys, num_stripes, stripes, values) == 0) {
+    write_read_output(num_pairs, keys, values, out);
+    epoch_exit();
+    return 0;
+  }
+  // Never wait for a writer inside the epoch
+  epoch_exit();
+
+  lock_stripes(num_stripes, stripes, false);
+  for (size_t i = 0; i < num_pairs; i++) {
+    values[i] = peek_value(shard_of(keys[i]), keys[i]);
+  }
+  write_read_output(num_pairs, keys, values, out);
+  unlock_stripes(num_stripes, stripes, false);
+  return 0;
+}
+
+/// Writes a pair found by a scan in the READ output format.
+/// @param ctx The Output.
+/// @param key The key.
+/// @param value The value.
+static void write_scanned_pair(void *ctx, const char *key, const char *value) {
+  write_pair_str(ctx, key, ",", value, "");
+}
+
+// Pairs found by a scan of several shards, to be sorted before the output.
+typedef struct {
+  char key[MAX_STRING_SIZE];
+  char *value;
+} ScannedPair;
+
+typedef struct {
+  ScannedPair *pairs;
+  size_t count;
+  size_t capacity;
+  bool failed;  // Some pair could not be kept
+} ScannedPairs;
+
+/// Keeps a copy of a pair found by a scan.
+/// @param ctx The ScannedPairs.
+/// @param key The key.
+/// @param value The value.
+static void keep_scanned_pair(void *ctx, const char *key, const char *value) {
+  ScannedPairs *scanned = ctx;
+  if (scanned->count == scanned->capacity) {
+    size_t capacity = scanned->capacity ? scanned->capacity * 2 : 64;
+    ScannedPair *pairs = realloc(scanned->pairs, capacity * sizeof(ScannedPair));
+    if (pairs == NULL) {
+      scanned->failed = true;
+      return;
+    }
+    scanned->pairs = pairs;
+    scanned->capacity = capacity;
+  }
+  ScannedPair *pair = &scanned->pairs[scanned->count];
+  pair->value = strdup(value);
+  if (pair->value == NULL) {
+    scanned->failed = true;
+    return;
+  }
+  strcpy(pair->key, key);
+  scanned->count++;
+}
+
+static int compare_scanned(const void *a, const void *b) {
+  return strcmp(((const ScannedPair *)a)->key, ((const ScannedPair *)b)->key);
+}
+
+/// Runs a scan over every shard and writes the pairs found in key order.
+/// With a single shard the pairs are written as they are found, otherwise
+/// each shard yields its own ordered run and the runs are merged by sorting.
+/// @param from Smallest key (the prefix, for prefix scans).
+/// @param to Largest key, NULL for prefix scans.
+/// @param out Output to write to.
+static void scan_shards(const char *from, const char *to, Output *out) {
+  output_str(out, "[");
+  if (num_shards == 1) {
+    if (to != NULL) {
+      range_pairs(kvs_shards[0], from, to, write_scanned_pair, out);
+    } else {
+      prefix_pairs(kvs_shards[0], from, write_scanned_pair, out);
+    }
+    output_str(out, "]\n");
+    return;
+  }
+
+  ScannedPairs scanned = {NULL, 0, 0, false};
+  for (size_t i = 0; i < num_shards; i++) {
+    if (to != NULL) {
+      range_pairs(kvs_shards[i], from, to, keep_scanned_pair, &scanned);
     } else {
-      snprintf(aux, MAX_STRING_SIZE, "(%s,%s)", keys[i], result);
+      prefix_pairs(kvs_shards[i], from, keep_scanned_pair, &scanned);
     }
-    write_str(fd, aux);
-    free(result);
   }
-  write_str(fd, "]\n");
+  if (scanned.failed) {
+    fprintf(stderr, "Failed to keep every pair of the scan\n");
+  }
+
+  qsort(scanned.pairs, scanned.count, sizeof(ScannedPair), compare_scanned);
+  for (size_t i = 0; i < scanned.count; i++) {
+    write_scanned_pair(out, scanned.pairs[i].key, scanned.pairs[i].value);
+    free(scanned.pairs[i].value);
+  }
+  free(scanned.pairs);
+  output_str(out, "]\n");
+}
+
+int kvs_range(const char *from, const char *to, Output *out) {
+  if (num_shards == 0) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return 1;
+  }
+
+  scan_shards(from, to, out);
+  return 0;
+}
+
+int kvs_prefix(const char *prefix, Output *out) {
+  if (num_shards == 0) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return 1;
+  }
 
-  pthread_rwlock_unlock(&kvs_table->tablelock);
+  scan_shards(prefix, NULL, out);
   return 0;
 }
 
-int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd) {
-  if (kvs_table == NULL) {
+int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], Output *out) {
+  if (num_shards == 0) {
     fprintf(stderr, "KVS state must be initialized\n");
     return 1;
   }
 
-  pthread_rwlock_wrlock(&kvs_table->tablelock);
+  size_t stripes[num_pairs];
+  size_t num_stripes = collect_stripes(num_pairs, keys, stripes);
+  lock_stripes(num_stripes, stripes, true);
 
   int aux = 0;
+  uint64_t logged = 0;
   for (size_t i = 0; i < num_pairs; i++) {
-    if (delete_pair(kvs_table, keys[i]) != 0) {
+    if (delete_pair(shard_of(keys[i]), keys[i]) != 0) {
       if (!aux) {
-        write_str(fd, "[");
+        output_str(out, "[");
         aux = 1;
       }
-      char str[MAX_STRING_SIZE];
-      snprintf(str, MAX_STRING_SIZE, "(%s,KVSMISSING)", keys[i]);
-      write_str(fd, str);
+      write_pair_str(out, keys[i], ",", "KVSMISSING", "");
     } else {
+      log_change(&logged, WAL_DELETE, keys[i], NULL, 0);
       notify_subscribers(keys[i], NULL);
     }
   }
   if (aux) {
-    write_str(fd, "]\n");
+    output_str(out, "]\n");
   }
 
-  pthread_rwlock_unlock(&kvs_table->tablelock);
+  unlock_stripes(num_stripes, stripes, true);
+  commit_changes(logged);
   return 0;
 }
 
-void kvs_show(int fd) {
-  if (kvs_table == NULL) {
+/// Starts a snapshot of every shard. Writers are only held back while the
+/// stripes are locked to find a point where no command is halfway done.
+/// @param snapshot The snapshot.
+/// @param since Backup to find the stripes changed since, NULL if not needed.
+/// @param log_position Receives the position in the log of the first change
+/// the snapshot does not hold, NULL if not needed.
+/// @return bit i set if stripe i of any shard changed since the backup.
+static uint64_t take_snapshot(Snapshot *snapshot, const BackupBase *since,
+                              uint64_t *log_position) {
+  size_t stripes[num_shards * TABLE_STRIPES];
+  size_t num_stripes = all_stripes(stripes);
+  lock_stripes(num_stripes, stripes, false);
+  snapshot_begin(snapshot);
+  // Changes are logged with their stripe locked, none is halfway logged
+  if (log_position != NULL) {
+    *log_position = wal_enabled ? wal_position(&wal) : 0;
+  }
+  uint64_t changed = 0;
+  for (size_t i = 0; since != NULL && i < num_shards; i++) {
+    changed |= changed_stripes(kvs_shards[i], since->version, since->time_ms);
+  }
+  unlock_stripes(num_stripes, stripes, false);
+  return changed;
+}
+
+/// Ends a snapshot and releases the versions that were only kept for it.
+/// @param snapshot The snapshot.
+static void release_snapshot(Snapshot *snapshot) {
+  snapshot_end(snapshot);
+  for (size_t i = 0; i < num_shards; i++) {
+    snapshot_collect(kvs_shards[i]);
+  }
+}
+
+/// Writes a pair in the SHOW output format.
+/// @param ctx The Output.
+/// @param key The key.
+/// @param value The value.
+/// @param expires_at When the pair expires, not shown.
+static void write_shown_pair(void *ctx, const char *key, const char *value, uint64_t expires_at) {
+  (void)expires_at;
+  write_pair_str(ctx, key, ", ", value, "\n");
+}
+
+void kvs_show(Output *out) {
+  if (num_shards == 0) {
     fprintf(stderr, "KVS state must be initialized\n");
     return;
   }
 
-  pthread_rwlock_rdlock(&kvs_table->tablelock);
-  char aux[MAX_STRING_SIZE];
+  // Writers go on while the pairs are written out
+  Snapshot snapshot;
+  take_snapshot(&snapshot, NULL, NULL);
+  snapshot_pairs(kvs_shards, num_shards, &snapshot, write_shown_pair, out);
+  release_snapshot(&snapshot);
+}
+
+/// Adds a pair to a text backup, in the SHOW output format.
+/// @param ctx The FileWriter.
+/// @param key The key.
+/// @param value The value.
+/// @param expires_at When the pair expires, not kept in text backups.
+static void add_shown_pair(void *ctx, const char *key, const char *value, uint64_t expires_at) {
+  (void)expires_at;
+  char aux[PAIR_STR_SIZE];
+  size_t len = format_pair_str(aux, key, ", ", value, "\n");
+  file_writer_write(ctx, aux, len);
+}
+
+// Binary backup being written.
+typedef struct {
+  SnapshotWriter writer;
+  uint64_t partitions;  // Stripes whose pairs are added
+} BackupWriter;
+
+/// Adds a pair to a binary backup, if its stripe is one of the backup's.
+/// @param ctx The BackupWriter.
+/// @param key The key.
+/// @param value The value.
+/// @param expires_at When the pair expires, in monotonic milliseconds, 0 if never.
+static void add_snapshot_pair(void *ctx, const char *key, const char *value,
+                              uint64_t expires_at) {
+  BackupWriter *backup = ctx;
+  if (!(backup->partitions >> stripe_index(key) & 1)) {
+    return;
+  }
+  // After a failure the writes do nothing, finishing reports it
+  snapshot_writer_add(&backup->writer, key, value, expiry_to_deadline(expires_at));
+}
+
+// Keys of a shard from one key (included) to another (excluded), the unit
+// the pairs of a binary backup are split in between its segments.
+typedef struct {
+  struct HashTable *shard;
+  char from[MAX_STRING_SIZE];
+  char to[MAX_STRING_SIZE];  // Empty for the end of the shard
+} BackupRange;
+
+// File of a binary backup: the whole backup, or one of its segments.
+typedef struct {
+  const BackupRequest *request;
+  char path[SEGMENT_PATH_SIZE];
+  bool segment;
+  const BackupRange *ranges;  // Every range of the backup
+  size_t num_ranges;
+  size_t first;               // Ranges of the file, one in every step
+  size_t step;
+  uint64_t count;             // Once written
+  uint64_t checksum;
+  int failed;
+} BackupFile;
+
+/// Formats the path of a segment of a binary backup.
+/// @param buffer Buffer of SEGMENT_PATH_SIZE bytes.
+/// @param path Path of the backup file.
+/// @param segment Index of the segment.
+static void format_segment_path(char *buffer, const char *path, size_t segment) {
+  snprintf(buffer, SEGMENT_PATH_SIZE, "%s.%lu", path, (unsigned long)segment);
+}
+
+/// Renames a backup file into place if it is complete, drops it otherwise.
+/// @param file The file.
+/// @param failed Whether the caller could not write it all.
+/// @return 0 if the file is in place, 1 otherwise.
+static int commit_backup_file(FileWriter *file, int failed) {
+  if (failed || file->out.failed) {
+    file_writer_abort(file);
+    failed = 1;
+  } else {
+    // With a log, a full binary backup replaces it up to its snapshot and
+    // must be on disk before the log is cut
+    failed = file_writer_commit(file, backup_sync || (wal_enabled && backup_format == BACKUP_BINARY));
+  }
+  if (failed) {
+    fprintf(stderr, "Failed to write backup file: %s\n", file->path);
+  }
+  return failed;
+}
+
+/// Writes a file of a binary backup. Segments each run on their own thread.
+/// @param arg The BackupFile.
+static void *write_backup_file(void *arg) {
+  BackupFile *out = arg;
+  const BackupRequest *request = out->request;
+  FileWriter file;
+  if (file_writer_open(&file, out->path) != 0) {
+    fprintf(stderr, "Failed to open backup file: %s\n", out->path);
+    out->failed = 1;
+    return NULL;
+  }
+
+  BackupWriter backup = {.partitions = request->delta ? request->partitions : ~(uint64_t)0};
+  int failed = snapshot_writer_begin(&backup.writer, &file, request->id);
+  snapshot_writer_set_log_position(&backup.writer, request->log_position);
+  if (!failed && request->delta && !out->segment) {
+    failed = snapshot_writer_set_base(&backup.writer, request->base, request->base_id,
+                                      request->partitions);
+  }
+  for (size_t i = out->first; i < out->num_ranges && !failed; i += out->step) {
+    const BackupRange *range = &out->ranges[i];
+    snapshot_range_pairs(range->shard, &request->snapshot, range->from,
+                         range->to[0] != '\0' ? range->to : NULL, add_snapshot_pair, &backup);
+  }
+  out->count = backup.writer.count;
+  out->checksum = backup.writer.checksum;
+  failed = failed || snapshot_writer_finish(&backup.writer) != 0;
+  out->failed = commit_backup_file(&file, failed);
+  return NULL;
+}
 
-  for (int i = 0; i < TABLE_SIZE; i++) {
-    KeyNode *keyNode = kvs_table->table[i]; // Get the next list head
-    while (keyNode != NULL) {
-      snprintf(aux, MAX_STRING_SIZE, "(%s, %s)\n", keyNode->key,
-               keyNode->value);
-      write_str(fd, aux);
-      keyNode = keyNode->next; // Move to the next node of the list
+/// Writes a binary backup. With more than one segment, the key ranges of the
+/// shards are shared out between segment files written in parallel, and
+/// the manifest is written once they all are.
+/// @param request The backup.
+/// @param segments Number of segments, 1 for a single file.
+/// @return 0 on success, 1 on failure.
+static int write_binary_backup(const BackupRequest *request, size_t segments) {
+  // Enough ranges for every segment to get a part of the pairs
+  size_t parts = (segments + num_shards - 1) / num_shards;
+  BackupRange *ranges = malloc(num_shards * parts * sizeof(BackupRange));
+  if (ranges == NULL) {
+    return 1;
+  }
+  size_t num_ranges = 0;
+  for (size_t i = 0; i < num_shards; i++) {
+    char keys[parts][MAX_STRING_SIZE];
+    size_t num_keys = split_pairs(kvs_shards[i], parts, keys);
+    for (size_t j = 0; j <= num_keys; j++) {
+      BackupRange *range = &ranges[num_ranges++];
+      range->shard = kvs_shards[i];
+      strcpy(range->from, j > 0 ? keys[j - 1] : "");
+      strcpy(range->to, j < num_keys ? keys[j] : "");
     }
   }
 
-  pthread_rwlock_unlock(&kvs_table->tablelock);
+  BackupFile files[MAX_SNAPSHOT_SEGMENTS];
+  pthread_t threads[MAX_SNAPSHOT_SEGMENTS];
+  bool started[MAX_SNAPSHOT_SEGMENTS];
+  for (size_t i = 0; i < segments; i++) {
+    files[i] = (BackupFile){.request = request, .segment = segments > 1, .ranges = ranges,
+                            .num_ranges = num_ranges, .first = i, .step = segments};
+    if (segments > 1) {
+      format_segment_path(files[i].path, request->path, i);
+    } else {
+      strcpy(files[i].path, request->path);
+    }
+    // The first segment is left to this thread
+    started[i] = i > 0 && pthread_create(&threads[i], NULL, write_backup_file, &files[i]) == 0;
+  }
+  // Along with whatever could not be given to a thread
+  for (size_t i = 0; i < segments; i++) {
+    if (!started[i]) {
+      write_backup_file(&files[i]);
+    }
+  }
+
+  int failed = 0;
+  uint64_t count = 0;
+  uint64_t checksum = 0;
+  for (size_t i = 0; i < segments; i++) {
+    if (started[i]) {
+      pthread_join(threads[i], NULL);
+    }
+    failed |= files[i].failed;
+    count += files[i].count;
+    checksum += files[i].checksum;
+  }
+  free(ranges);
+  if (segments == 1 || failed) {
+    return failed;
+  }
+
+  // The manifest goes last, the backup only appears once every segment is in place
+  FileWriter file;
+  if (file_writer_open(&file, request->path) != 0) {
+    fprintf(stderr, "Failed to open backup file: %s\n", request->path);
+    return 1;
+  }
+  SnapshotWriter manifest;
+  failed = snapshot_writer_begin(&manifest, &file, request->id);
+  snapshot_writer_set_log_position(&manifest, request->log_position);
+  if (!failed && request->delta) {
+    failed = snapshot_writer_set_base(&manifest, request->base, request->base_id, request->partitions);
+  }
+  snapshot_writer_set_segments(&manifest, (uint32_t)segments, count, checksum);
+  failed = failed || snapshot_writer_finish(&manifest) != 0;
+  return commit_backup_file(&file, failed);
+}
+
+/// Links the file of a backup under the name of a BACKUP coalesced into it,
+/// so that both files share the data.
+/// @param path Path of the backup file.
+/// @param target Path of the coalesced backup file.
+/// @return 0 on success, 1 on failure.
+static int link_backup_file(const char *path, const char *target) {
+  size_t segments = backup_format == BACKUP_BINARY && backup_segments > 1 ? backup_segments : 0;
+  // The segments first, the manifest is what makes the backup appear
+  int failed = 0;
+  for (size_t i = 0; i < segments && !failed; i++) {
+    char segment_path[SEGMENT_PATH_SIZE];
+    char segment_target[SEGMENT_PATH_SIZE];
+    format_segment_path(segment_path, path, i);
+    format_segment_path(segment_target, target, i);
+    failed = file_writer_link(segment_path, segment_target, backup_sync);
+  }
+  failed = failed || file_writer_link(path, target, backup_sync) != 0;
+  if (failed) {
+    fprintf(stderr, "Failed to write backup file: %s\n", target);
+  }
+  return failed;
+}
+
+/// Writes a backup from its snapshot, then links the file under the names of
+/// the BACKUPs coalesced into it.
+/// @param request The backup.
+static void write_backup(BackupRequest *request) {
+  int failed = 0;
+  if (backup_format == BACKUP_BINARY) {
+    failed = write_binary_backup(request, backup_segments);
+  } else {
+    FileWriter file;
+    if (file_writer_open(&file, request->path) != 0) {
+      fprintf(stderr, "Failed to open backup file: %s\n", request->path);
+      failed = 1;
+    } else {
+      snapshot_pairs(kvs_shards, num_shards, &request->snapshot, add_shown_pair, &file);
+      // The backup file only appears once complete
+      failed = commit_backup_file(&file, 0);
+    }
+  }
+  if (!failed && wal_enabled && backup_format == BACKUP_BINARY && !request->delta &&
+      wal_checkpoint(&wal, request->log_position) != 0) {
+    // The log is left whole, restoring the backup replays the end of it still
+    fprintf(stderr, "Failed to checkpoint the log at %s\n", request->path);
+  } else if (failed) {
+    // Deltas of a missing base could not be restored
+    pthread_mutex_lock(&backup_base_lock);
+    if (has_backup_base && backup_base.id == request->id) {
+      has_backup_base = false;
+    }
+    pthread_mutex_unlock(&backup_base_lock);
+  }
+
+  // Written: BACKUPs coalesced into it from now on are queued as links
+  pthread_mutex_lock(&pending_backups_lock);
+  BackupLink *links = request->links;
+  if (has_last_backup && last_backup.request == request) {
+    last_backup.request = NULL;
+    has_last_backup = !failed;
+  }
+  pthread_mutex_unlock(&pending_backups_lock);
+  while (links != NULL) {
+    BackupLink *link = links;
+    links = link->next;
+    if (failed) {
+      fprintf(stderr, "Failed to write backup file: %s\n", link->path);
+    } else {
+      link_backup_file(request->path, link->path);
+    }
+    free(link);
+  }
+  release_snapshot(&request->snapshot);
+}
+
+/// Writes the backups requested to the pool, until it is stopped.
+static void *write_backups() {
+  // Signals are for the job and session threads to handle
+  sigset_t set;
+  sigfillset(&set);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+  pthread_mutex_lock(&pending_backups_lock);
+  while (1) {
+    while (backups_head == NULL && !stop_backups) {
+      pthread_cond_wait(&backups_queued, &pending_backups_lock);
+    }
+    if (backups_head == NULL) {
+      break;  // Stopped, and every request was taken
+    }
+    BackupRequest *request = backups_head;
+    backups_head = request->next;
+    if (backups_head == NULL) {
+      backups_tail = NULL;
+    }
+    pthread_mutex_unlock(&pending_backups_lock);
+
+    if (request->source[0] != '\0') {
+      // Coalesced into a backup already written, there is only a link to make
+      link_backup_file(request->source, request->path);
+    } else {
+      write_backup(request);
+    }
+    free(request);
+
+    pthread_mutex_lock(&pending_backups_lock);
+    if (--pending_backups == 0) {
+      pthread_cond_broadcast(&backups_done);
+    }
+  }
+  pthread_mutex_unlock(&pending_backups_lock);
+  return NULL;
+}
+
+/// Stops the backup threads once every requested backup is written.
+static void stop_backup_threads() {
+  if (num_backup_threads == 0) {
+    return;
+  }
+
+  pthread_mutex_lock(&pending_backups_lock);
+  stop_backups = true;
+  pthread_cond_broadcast(&backups_queued);
+  pthread_mutex_unlock(&pending_backups_lock);
+
+  for (size_t i = 0; i < num_backup_threads; i++) {
+    pthread_join(backup_threads[i], NULL);
+  }
+  free(backup_threads);
+  backup_threads = NULL;
+  num_backup_threads = 0;
+}
+
+int kvs_backups_init(size_t max_backups) {
+  if (num_backup_threads != 0) {
+    fprintf(stderr, "Backups have already been initialized\n");
+    return 1;
+  }
+
+  backup_threads = malloc(max_backups * sizeof(pthread_t));
+  if (backup_threads == NULL) {
+    return 1;
+  }
+
+  stop_backups = false;
+  for (; num_backup_threads < max_backups; num_backup_threads++) {
+    if (pthread_create(&backup_threads[num_backup_threads], NULL, write_backups, NULL) != 0) {
+      fprintf(stderr, "Failed to create backup thread\n");
+      stop_backup_threads();
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/// Makes the id of a binary backup, telling apart the backups of different
+/// runs of the server too.
+/// @param version Version of the backup's snapshot.
+/// @return the id.
+static uint64_t snapshot_id(uint64_t version) {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return ((uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec) ^ (version << 32);
+}
+
+/// Adds a request to the queue of the backup threads.
+/// pending_backups_lock must be held.
+/// @param request The request.
+static void queue_backup(BackupRequest *request) {
+  if (backups_tail != NULL) {
+    backups_tail->next = request;
+  } else {
+    backups_head = request;
+  }
+  backups_tail = request;
+  pending_backups++;
+  pthread_cond_signal(&backups_queued);
+}
+
+/// Coalesces a BACKUP into the last backup taken, if that one was taken less
+/// than backup_window_ms ago, to the same directory, and nothing changed
+/// since: its snapshot holds the pairs a new one would. The BACKUP is then
+/// only a link to its file, made once the file is written.
+/// pending_backups_lock must be held.
+/// @param request The request of the BACKUP, its path set. Queued as a link
+/// if the file is written already, to be freed by the caller otherwise.
+/// @return true if the BACKUP was coalesced, false if it must be taken.
+static bool coalesce_backup(BackupRequest *request) {
+  if (backup_window_ms == 0 || !has_last_backup ||
+      monotonic_ms() - last_backup.time_ms >= backup_window_ms) {
+    return false;
+  }
+  // A delta is only restored with its base in the same directory
+  size_t directory_length = (size_t)(strrchr(request->path, '/') - request->path);
+  if ((size_t)(strrchr(last_backup.path, '/') - last_backup.path) != directory_length ||
+      strncmp(request->path, last_backup.path, directory_length) != 0) {
+    return false;
+  }
+
+  // With every stripe locked, as a new snapshot would be taken
+  size_t stripes[num_shards * TABLE_STRIPES];
+  size_t num_stripes = all_stripes(stripes);
+  uint64_t changed = 0;
+  lock_stripes(num_stripes, stripes, false);
+  for (size_t i = 0; i < num_shards; i++) {
+    changed |= changed_stripes(kvs_shards[i], last_backup.version, last_backup.time_ms);
+  }
+  unlock_stripes(num_stripes, stripes, false);
+  if (changed != 0) {
+    return false;
+  }
+
+  if (last_backup.request == NULL) {
+    strcpy(request->source, last_backup.path);
+    queue_backup(request);
+    return true;
+  }
+  BackupLink *link = malloc(sizeof(BackupLink));
+  if (link == NULL) {
+    return false;
+  }
+  strcpy(link->path, request->path);
+  link->next = last_backup.request->links;
+  last_backup.request->links = link;
+  return true;
 }
 
 int kvs_backup(size_t num_backup, char *job_filename, char *directory) {
-  pid_t pid;
-  char bck_name[50];
-  snprintf(bck_name, sizeof(bck_name), "%s/%s-%ld.bck", directory,
+  if (num_backup_threads == 0) {
+    fprintf(stderr, "Backups must be initialized\n");
+    return -1;
+  }
+
+  BackupRequest *request = malloc(sizeof(BackupRequest));
+  if (request == NULL) {
+    return -1;
+  }
+  snprintf(request->path, sizeof(request->path), "%s/%s-%ld.bck", directory,
            strtok(job_filename, "."), num_backup);
+  const char *name = strrchr(request->path, '/') + 1;
+  request->links = NULL;
+  request->source[0] = '\0';
+  request->next = NULL;
 
-  pthread_rwlock_rdlock(&kvs_table->tablelock);
-  pid = fork();
-  pthread_rwlock_unlock(&kvs_table->tablelock);
-  if (pid == 0) {
-    // functions used here have to be async signal safe, since this
-    // fork happens in a multi thread context (see man fork)
-    int fd = open(bck_name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
-    for (int i = 0; i < TABLE_SIZE; i++) {
-      KeyNode *keyNode = kvs_table->table[i]; // Get the next list head
-      while (keyNode != NULL) {
-        char aux[MAX_STRING_SIZE];
-        aux[0] = '(';
-        size_t num_bytes_copied = 1; // the "("
-        // the - 1 are all to leave space for the '/0'
-        num_bytes_copied += strn_memcpy(aux + num_bytes_copied, keyNode->key,
-                                        MAX_STRING_SIZE - num_bytes_copied - 1);
-        num_bytes_copied += strn_memcpy(aux + num_bytes_copied, ", ",
-                                        MAX_STRING_SIZE - num_bytes_copied - 1);
-        num_bytes_copied += strn_memcpy(aux + num_bytes_copied, keyNode->value,
-                                        MAX_STRING_SIZE - num_bytes_copied - 1);
-        num_bytes_copied += strn_memcpy(aux + num_bytes_copied, ")\n",
-                                        MAX_STRING_SIZE - num_bytes_copied - 1);
-        aux[num_bytes_copied] = '\0';
-        write_str(fd, aux);
-        keyNode = keyNode->next; // Move to the next node of the list
-      }
+  // BACKUPs of several jobs at about the same time share one snapshot
+  pthread_mutex_lock(&pending_backups_lock);
+  bool coalesced = coalesce_backup(request);
+  // Once queued, the request is up to the backup threads
+  bool queued = coalesced && request->source[0] != '\0';
+  pthread_mutex_unlock(&pending_backups_lock);
+  if (coalesced) {
+    if (!queued) {
+      free(request);
     }
-    exit(1);
-  } else if (pid < 0) {
-    return -1;
+    return 0;
+  }
+
+  // The snapshot is all the job thread waits for, writers go on while a
+  // backup thread writes it out. The request is on the heap, the snapshot
+  // must stay in place until it ends.
+  pthread_mutex_lock(&backup_base_lock);
+  request->delta = backup_format == BACKUP_BINARY && has_backup_base &&
+                   backup_deltas < max_backup_deltas && strcmp(backup_base.directory, directory) == 0;
+  request->partitions = take_snapshot(&request->snapshot, request->delta ? &backup_base : NULL,
+                                      &request->log_position);
+  request->id = snapshot_id(request->snapshot.version);
+  // Past half the stripes a delta is about as big as a full backup, which
+  // also shortens the chain
+  if (request->delta && __builtin_popcountll(request->partitions) <= TABLE_STRIPES / 2) {
+    request->base_id = backup_base.id;
+    strcpy(request->base, backup_base.name);
+    backup_deltas++;
+  } else if (backup_format == BACKUP_BINARY) {
+    request->delta = false;
+    backup_base.id = request->id;
+    backup_base.version = request->snapshot.version;
+    backup_base.time_ms = request->snapshot.time_ms;
+    snprintf(backup_base.directory, sizeof(backup_base.directory), "%s", directory);
+    strcpy(backup_base.name, name);
+    has_backup_base = true;
+    backup_deltas = 0;
+  }
+  pthread_mutex_unlock(&backup_base_lock);
+
+  pthread_mutex_lock(&pending_backups_lock);
+  last_backup.request = request;
+  strcpy(last_backup.path, request->path);
+  last_backup.version = request->snapshot.version;
+  last_backup.time_ms = request->snapshot.time_ms;
+  has_last_backup = true;
+  queue_backup(request);
+  pthread_mutex_unlock(&pending_backups_lock);
+  return 0;
+}
+
+void kvs_set_backup_format(enum BackupFormat format) {
+  backup_format = format;
+}
+
+void kvs_set_backup_sync(bool sync) {
+  backup_sync = sync;
+}
+
+void kvs_set_backup_segments(size_t segments) {
+  backup_segments = segments;
+}
+
+void kvs_set_backup_window(unsigned int window_ms) {
+  backup_window_ms = window_ms;
+}
+
+void kvs_set_backup_deltas(size_t max_deltas) {
+  pthread_mutex_lock(&backup_base_lock);
+  max_backup_deltas = max_deltas;
+  pthread_mutex_unlock(&backup_base_lock);
+}
+
+// Part of a snapshot file loaded by a restore thread.
+typedef struct {
+  const SnapshotFile *file;
+  size_t first;
+  size_t last;        // Exclusive
+  uint64_t skip;      // Bit i set if the pairs of stripe i are not loaded
+  uint64_t checksum;  // Of the records read, loaded or not
+  size_t loaded;
+  int failed;
+} RestoreChunk;
+
+/// Loads a range of records of a snapshot file. Threads share the shards,
+/// each pair is written with its stripe locked like any other write.
+/// @param arg The RestoreChunk.
+static void *restore_chunk(void *arg) {
+  RestoreChunk *chunk = arg;
+  char key[MAX_STRING_SIZE];
+  char value[MAX_VALUE_SIZE];
+
+  for (size_t i = chunk->first; i < chunk->last; i++) {
+    const char *key_data, *value_data;
+    size_t key_length, value_length;
+    uint64_t deadline;
+    snapshot_file_record(chunk->file, i, &key_data, &key_length, &value_data, &value_length,
+                         &deadline);
+    chunk->checksum += snapshot_record_hash(key_data, key_length, value_data, value_length, deadline);
+    memcpy(key, key_data, key_length);
+    key[key_length] = '\0';
+    size_t stripe = stripe_index(key);
+    // Pairs that expired since the snapshot was taken are not brought back
+    uint64_t ttl = deadline_to_ttl(deadline);
+    if (chunk->skip >> stripe & 1 || (deadline != 0 && ttl == 0)) {
+      continue;
+    }
+    memcpy(value, value_data, value_length);
+    value[value_length] = '\0';
+
+    struct HashTable *shard = shard_of(key);
+    stripe_write_lock(shard, stripe);
+    int failed = write_pair(shard, key, value);
+    if (!failed && ttl > 0) {
+      set_expiry(shard, key, ttl);
+    }
+    chunk->failed |= failed;
+    stripe_write_unlock(shard, stripe);
+    chunk->loaded++;
+  }
+  return NULL;
+}
+
+/// Loads the pairs of a snapshot file with several threads and verifies its
+/// checksum.
+/// @param file The file.
+/// @param path Path of the file.
+/// @param skip Bit i set if the pairs of stripe i are not loaded.
+/// @param loaded Receives the number of pairs loaded.
+/// @return 0 on success, 1 on failure.
+static int restore_file(const SnapshotFile *file, const char *path, uint64_t skip, size_t *loaded) {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t num_threads = cpus < 1 ? 1 : cpus > MAX_RESTORE_THREADS ? MAX_RESTORE_THREADS : (size_t)cpus;
+  if (num_threads > file->count / RESTORE_MIN_CHUNK + 1) {
+    num_threads = file->count / RESTORE_MIN_CHUNK + 1;
+  }
+
+  pthread_t threads[MAX_RESTORE_THREADS];
+  RestoreChunk chunks[MAX_RESTORE_THREADS];
+  size_t started = 0;
+  for (; started < num_threads; started++) {
+    chunks[started] = (RestoreChunk){file, file->count * started / num_threads,
+                                     file->count * (started + 1) / num_threads, skip, 0, 0, 0};
+    if (pthread_create(&threads[started], NULL, restore_chunk, &chunks[started]) != 0) {
+      break;
+    }
+  }
+  // Whatever could not be given to a thread is loaded here
+  RestoreChunk rest = {file, started == 0 ? 0 : chunks[started - 1].last, file->count, skip, 0, 0, 0};
+  restore_chunk(&rest);
+
+  uint64_t checksum = rest.checksum;
+  int failed = rest.failed;
+  *loaded = rest.loaded;
+  for (size_t i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+    checksum += chunks[i].checksum;
+    failed |= chunks[i].failed;
+    *loaded += chunks[i].loaded;
+  }
+
+  if (checksum != file->checksum) {
+    fprintf(stderr, "Snapshot file is corrupted: %s\n", path);
+    failed = 1;
   }
+  return failed;
+}
+
+/// Loads the pairs of a snapshot, from its file or from the segments its
+/// file is the manifest of.
+/// @param file The file.
+/// @param path Path of the file.
+/// @param skip Bit i set if the pairs of stripe i are not loaded.
+/// @param loaded Receives the number of pairs loaded.
+/// @return 0 on success, 1 on failure.
+static int restore_snapshot(const SnapshotFile *file, const char *path, uint64_t skip, size_t *loaded) {
+  if (!(file->flags & SNAPSHOT_MANIFEST)) {
+    return restore_file(file, path, skip, loaded);
+  }
+
+  int failed = 0;
+  uint64_t count = 0;
+  uint64_t checksum = 0;
+  *loaded = 0;
+  for (uint32_t i = 0; i < file->segments && !failed; i++) {
+    char segment_path[SEGMENT_PATH_SIZE];
+    format_segment_path(segment_path, path, i);
+    SnapshotFile segment;
+    if (snapshot_file_open(&segment, segment_path) != 0) {
+      fprintf(stderr, "Invalid snapshot file: %s\n", segment_path);
+      return 1;
+    }
+    if (segment.flags != 0 || segment.id != file->id) {
+      fprintf(stderr, "%s is not a segment of %s\n", segment_path, path);
+      failed = 1;
+    } else {
+      size_t segment_loaded;
+      failed = restore_file(&segment, segment_path, skip, &segment_loaded);
+      *loaded += segment_loaded;
+      count += segment.count;
+      checksum += segment.checksum;
+    }
+    snapshot_file_close(&segment);
+  }
+  if (!failed && (count != file->count || checksum != file->checksum)) {
+    fprintf(stderr, "Snapshot file is corrupted: %s\n", path);
+    failed = 1;
+  }
+  return failed;
+}
+
+int kvs_restore(const char *path) {
+  if (num_shards == 0) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return 1;
+  }
+
+  SnapshotFile file;
+  if (snapshot_file_open(&file, path) != 0) {
+    fprintf(stderr, "Invalid snapshot file: %s\n", path);
+    return 1;
+  }
+
+  int failed = 0;
+  size_t base_loaded = 0;
+  if (file.flags & SNAPSHOT_DELTA) {
+    // The base is in the same directory, and gives the stripes the delta does not replace
+    const char *slash = strrchr(path, '/');
+    int directory_length = slash != NULL ? (int)(slash - path + 1) : 0;
+    char base_path[MAX_JOB_FILE_NAME_SIZE + SNAPSHOT_BASE_SIZE];
+    snprintf(base_path, sizeof(base_path), "%.*s%s", directory_length, path, file.base);
+
+    SnapshotFile base;
+    if (strchr(file.base, '/') != NULL || snapshot_file_open(&base, base_path) != 0) {
+      fprintf(stderr, "Invalid snapshot file: %s\n", base_path);
+      snapshot_file_close(&file);
+      return 1;
+    }
+    if ((base.flags & SNAPSHOT_DELTA) || base.id != file.base_id) {
+      fprintf(stderr, "%s is not the base of %s\n", base_path, path);
+      failed = 1;
+    } else {
+      failed = restore_snapshot(&base, base_path, file.partitions, &base_loaded);
+    }
+    snapshot_file_close(&base);
+  }
+
+  size_t loaded = 0;
+  if (!failed) {
+    failed = restore_snapshot(&file, path, 0, &loaded);
+  }
+  if (!failed) {
+    printf("Restored %lu pairs from %s\n", (unsigned long)(base_loaded + loaded), path);
+    restored_log_position = file.log_position;
+  }
+  snapshot_file_close(&file);
+
+  for (size_t i = 0; i < num_shards; i++) {
+    evict_pairs(kvs_shards[i]);
+  }
+  return failed;
+}
+
+/// Applies a change read back from the log.
+/// @param ctx Unused.
+/// @param op The operation.
+/// @param key The key.
+/// @param value The value, NULL for deletions and WAL_EXPIRE.
+/// @param deadline Time the pair expires at, 0 if never.
+static void apply_logged_change(void *ctx, enum WalOp op, const char *key, const char *value,
+                                uint64_t deadline) {
+  (void)ctx;
+  struct HashTable *shard = shard_of(key);
+  size_t stripe = stripe_index(key);
+  uint64_t ttl = deadline_to_ttl(deadline);
+  stripe_write_lock(shard, stripe);
+  if (op == WAL_DELETE || (deadline != 0 && ttl == 0)) {
+    // A pair that expired since is not brought back, and neither is the
+    // value it replaced
+    delete_pair(shard, key);
+  } else if (op == WAL_WRITE) {
+    if (write_pair(shard, key, value) == 0 && ttl > 0) {
+      set_expiry(shard, key, ttl);
+    }
+  } else {
+    set_expiry(shard, key, ttl);
+  }
+  stripe_write_unlock(shard, stripe);
+}
+
+int kvs_wal_open(const char *path, enum WalSync policy, unsigned int interval_ms) {
+  if (num_shards == 0) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return 1;
+  }
+
+  // The changes logged before the snapshot restored are in it already,
+  // replaying the rest over it gives the state the log ended with
+  long records = wal_replay(path, restored_log_position, apply_logged_change, NULL);
+  if (records < 0 || wal_open(&wal, path, policy, interval_ms) != 0) {
+    fprintf(stderr, "Failed to open log: %s\n", path);
+    return 1;
+  }
+  wal_enabled = true;
+  printf("Replayed %ld changes from %s\n", records, path);
+
+  for (size_t i = 0; i < num_shards; i++) {
+    evict_pairs(kvs_shards[i]);
+  }
+  commit_discards();
   return 0;
 }
 
+void kvs_wait_backup() {
+  pthread_mutex_lock(&pending_backups_lock);
+  while (pending_backups > 0) {
+    pthread_cond_wait(&backups_done, &pending_backups_lock);
+  }
+  pthread_mutex_unlock(&pending_backups_lock);
+}
+
 void kvs_wait(unsigned int delay_ms) {
   struct timespec delay = delay_to_timespec(delay_ms);
   nanosleep(&delay, NULL);
@@ -210,16 +1655,15 @@ void kvs_subscribe_init(char *notif_pipe_name, client_t *client) {
 
 int kvs_subscribe(const char* key, client_t *client) {
 
-    pthread_rwlock_wrlock(&subscriptions_lock);
-
-    // Check if the key exists
-    char *result = read_pair(kvs_table, key);
-    if (result == NULL) {
-        pthread_rwlock_unlock(&subscriptions_lock);
+    // Check if the key exists (before taking subscriptions_lock, writers
+    // hold their stripe locks while notifying subscribers)
+    if (read_pair(shard_of(key), key, NULL) != 0) {
         fprintf(stderr, "Key does not exist in the kvs table: %s\n", key);  
         return 0; // Key does not exist
     }
 
+    pthread_rwlock_wrlock(&subscriptions_lock);
+
     for (int i = 0; i < MAX_NUMBER_SUB; i++) {
         if (!client->subscriptions[i].active) {
             strcpy(client->subscriptions[i].key, key);
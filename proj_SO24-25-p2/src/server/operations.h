@@ -4,13 +4,18 @@
 #include <stddef.h>
 #include <stdbool.h>
 #include "constants.h"
+#include "output.h"
+#include "wal.h"
 #include "../common/constants.h"
 #include "../common/io.h"
 
 
 /// Initializes the KVS state.
+/// @param shards Number of independent tables the keys are spread over, up
+/// to MAX_SHARDS. Each shard has its own locks, index, expiry wheel and
+/// allocators, so commands on different shards never touch shared state.
 /// @return 0 if the KVS state was initialized successfully, 1 otherwise.
-int kvs_init();
+int kvs_init(size_t shards);
 
 /// Destroys the KVS state.
 /// @return 0 if the KVS state was terminated successfully, 1 otherwise.
@@ -19,51 +24,152 @@ int kvs_terminate();
 /// Writes a key value pair to the KVS. If key already exists it is updated.
 /// @param num_pairs Number of pairs being written.
 /// @param keys Array of keys' strings.
-/// @param values Array of values' strings.
+/// @param values Array of values' strings, up to MAX_VALUE_SIZE bytes each.
+/// @param ttls Time to live of each pair in milliseconds, 0 for none. May be NULL.
 /// @return 0 if the pairs were written successfully, 1 otherwise.
-int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE]);
+int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE], char *values[],
+              const unsigned int ttls[]);
+
+/// Caps the memory used by the pairs. Once a write crosses the limit, pairs
+/// are evicted (least recently used first, approximately) and reported to
+/// their subscribers as deleted. The limit is split evenly among the shards.
+/// @param max_memory Limit in bytes, 0 for none.
+void kvs_set_max_memory(size_t max_memory);
+
+/// Makes a key expire after some time.
+/// @param key The key.
+/// @param ttl_ms Time to live in milliseconds.
+/// @param out Output to write to (if the key is missing).
+/// @return 0 if the command was executed, 1 otherwise.
+int kvs_expire(const char *key, unsigned int ttl_ms, Output *out);
+
+/// Replaces the value of each key with a new one, but only if it currently
+/// holds the expected value. All keys are compared and written in one
+/// critical section.
+/// @param num_triples Number of keys.
+/// @param keys Array of keys' strings.
+/// @param expected Array of the values each key must hold.
+/// @param values Array of the new values, up to MAX_VALUE_SIZE bytes each.
+/// @param out Output to write to (for the keys that were
+/// missing, KVSMISSING, or held another value, KVSMISMATCH).
+/// @return 0 if the command was executed, 1 otherwise.
+int kvs_cas(size_t num_triples, char keys[][MAX_STRING_SIZE], char *expected[],
+            char *values[], Output *out);
+
+/// Adds a number to the integer value of a key, a missing key counting as 0.
+/// @param key The key.
+/// @param delta Number to add, may be negative.
+/// @param out Output to write to: the new value, KVSERROR if
+/// the value is not an integer or the result overflows.
+/// @return 0 if the command was executed, 1 otherwise.
+int kvs_incr(const char *key, long long delta, Output *out);
+
+/// Appends a suffix to the value of each key, a missing key counting as an
+/// empty value. All keys are updated in one critical section.
+/// @param num_pairs Number of keys.
+/// @param keys Array of keys' strings.
+/// @param suffixes Array of the suffixes.
+/// @param out Output to write to (KVSERROR for the keys whose
+/// value would grow past MAX_VALUE_SIZE).
+/// @return 0 if the command was executed, 1 otherwise.
+int kvs_append(size_t num_pairs, char keys[][MAX_STRING_SIZE], char *suffixes[],
+               Output *out);
 
 /// Reads values from the KVS.
 /// @param num_pairs Number of pairs to read.
 /// @param keys Array of keys' strings.
 /// @param fd File descriptor to write the (successful) output.
 /// @return 0 if the key reading, 1 otherwise.
-int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd);
+int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], Output *out);
+
+/// Writes, in key order, the pairs whose key is between two keys (both included).
+/// @param from Smallest key.
+/// @param to Largest key.
+/// @param out Output to write to.
+/// @return 0 if the scan was successful, 1 otherwise.
+int kvs_range(const char *from, const char *to, Output *out);
+
+/// Writes, in key order, the pairs whose key starts with a prefix.
+/// @param prefix The prefix.
+/// @param out Output to write to.
+/// @return 0 if the scan was successful, 1 otherwise.
+int kvs_prefix(const char *prefix, Output *out);
 
 /// Deletes key value pairs from the KVS.
 /// @param num_pairs Number of pairs to read.
 /// @param keys Array of keys' strings.
 /// @return 0 if the pairs were deleted successfully, 1 otherwise.
-int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd);
+int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], Output *out);
+
+/// Writes the state of the KVS, in key order across every shard.
+/// @param out Output to write to.
+void kvs_show(Output *out);
 
-/// Writes the state of the KVS.
-/// @param fd File descriptor to write the output.
-void kvs_show(int fd);
+enum BackupFormat {
+  BACKUP_TEXT,    // "(key, value)" lines, as written by SHOW
+  BACKUP_BINARY,  // Snapshot file, see snapshot_file.h, that kvs_restore loads
+};
+
+/// Starts the threads that write the backups.
+/// @param max_backups Number of backups written at the same time.
+/// @return 0 if the threads were started, 1 otherwise.
+int kvs_backups_init(size_t max_backups);
 
 /// Creates a backup of the KVS state and stores it in the correspondent
-/// backup file
-/// @return 0 if the backup was successful, 1 otherwise.
+/// backup file. Only the snapshot is taken by the calling thread, the file
+/// is written by a backup thread. Never waits for other backups: while every
+/// backup thread is busy, the request is queued.
+/// @return 0 if the backup was requested, -1 otherwise.
 int kvs_backup(size_t num_backup,char* job_filename , char* directory);
 
-/// Waits for the last backup to be called.
+/// Sets the format of the backups requested from now on.
+/// @param format The format.
+void kvs_set_backup_format(enum BackupFormat format);
+
+/// Makes the backups requested from now on durable: each file is synced
+/// before it is renamed into place, and its directory after.
+/// @param sync Whether to sync the backups.
+void kvs_set_backup_sync(bool sync);
+
+/// Splits the binary backups requested from now on in segment files written
+/// by as many threads, tied together by the backup file as a manifest.
+/// @param segments Number of segments, up to MAX_SNAPSHOT_SEGMENTS, 1 for a
+/// single file.
+void kvs_set_backup_segments(size_t segments);
+
+/// Coalesces BACKUPs requested within a window of the previous one, while
+/// nothing was written in between: rather than a snapshot of its own, each
+/// gets a hard link to the file of the previous one.
+/// @param window_ms The window, 0 to take every BACKUP on its own.
+void kvs_set_backup_window(unsigned int window_ms);
+
+/// Makes binary backups deltas of the last full one, holding only the pairs
+/// of the stripes that changed since. A full backup is written once there
+/// were max_deltas deltas, or once most of the stripes changed.
+/// @param max_deltas Deltas between full backups, 0 for full backups only.
+void kvs_set_backup_deltas(size_t max_deltas);
+
+/// Loads the pairs of a binary backup. Several threads build the tables
+/// straight from the mapped file. A delta is loaded along with its base.
+/// @param path Path of the backup.
+/// @return 0 if every pair was loaded and the checksum matched, 1 otherwise.
+int kvs_restore(const char *path);
+
+/// Replays a write-ahead log and then logs every change to it: WRITE, CAS,
+/// INCR, APPEND and DELETE. Expiry, eviction and TTLs are not logged.
+/// @param path Path of the log.
+/// @param policy When the log is synced, see WalSync.
+/// @param interval_ms Time between syncs for WAL_SYNC_PERIODIC.
+/// @return 0 if the log was replayed and opened, 1 otherwise.
+int kvs_wal_open(const char *path, enum WalSync policy, unsigned int interval_ms);
+
+/// Waits for every requested backup to be written.
 void kvs_wait_backup();
 
 /// Waits for a given amount of time.
 /// @param delay_us Delay in milliseconds.
 void kvs_wait(unsigned int delay_ms);
 
-// Setter for max_backups
-// @param _max_backups
-void set_max_backups(int _max_backups);
-
-// Setter for n_current_backups
-// @param _n_current_backups
-void set_n_current_backups(int _n_current_backups);
-
-// Getter for n_current_backups
-// @return n_current_backups
-int get_n_current_backups();
-
 
 /// Initializes the subscription system
 /// @param notif_pipe_name Name of the notification pipe.
@@ -0,0 +1,354 @@
+#ifdef __linux__
+#define _DEFAULT_SOURCE  // For syscall, io_uring has no libc wrappers
+#endif
+
+#include "output.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+static bool io_uring_enabled = false;
+
+// Writes every byte of an array of buffers, retrying on short writes.
+// @param fd File descriptor to write to.
+// @param iov The buffers, consumed as they are written.
+// @param count Number of buffers.
+// Returns 0 on success, 1 on failure.
+static int writev_all(int fd, struct iovec *iov, int count) {
+  while (count > 0) {
+    ssize_t written = writev(fd, iov, count);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return 1;
+    }
+    // Skip what was written, the next call goes on from there
+    size_t left = (size_t)written;
+    while (count > 0 && left >= iov->iov_len) {
+      left -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0) {
+      iov->iov_base = (char *)iov->iov_base + left;
+      iov->iov_len -= left;
+    }
+  }
+  return 0;
+}
+
+#ifdef __linux__
+
+// Writes every byte of a buffer at an offset, retrying on short writes.
+// Returns 0 on success, 1 on failure.
+static int pwrite_all(int fd, const char *data, size_t length, off_t offset) {
+  while (length > 0) {
+    ssize_t written = pwrite(fd, data, length, offset);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return 1;
+    }
+    data += written;
+    length -= (size_t)written;
+    offset += written;
+  }
+  return 0;
+}
+
+// Field of a ring mapping, at an offset given by the kernel.
+static unsigned *ring_field(void *ring, uint32_t offset) {
+  return (unsigned *)((char *)ring + offset);
+}
+
+// Unmaps and closes the ring of an output.
+static void ring_teardown(Output *out) {
+  munmap(out->sqes, out->sqes_size);
+  if (out->cq_ring != out->sq_ring) {
+    munmap(out->cq_ring, out->cq_ring_size);
+  }
+  munmap(out->sq_ring, out->sq_ring_size);
+  close(out->ring_fd);
+  out->ring_fd = -1;
+}
+
+// Sets up the ring of an output and maps its queues.
+// Returns 0 on success, 1 on failure.
+static int ring_setup(Output *out) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  long ring_fd = syscall(__NR_io_uring_setup, OUTPUT_BUFFERS, &params);
+  if (ring_fd < 0) {
+    return 1;
+  }
+  out->ring_fd = (int)ring_fd;
+
+  // Both queues may be in one mapping, as big as the bigger of the two
+  out->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  out->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (single_mmap && out->cq_ring_size > out->sq_ring_size) {
+    out->sq_ring_size = out->cq_ring_size;
+  }
+  out->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+  out->sq_ring = mmap(NULL, out->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      out->ring_fd, IORING_OFF_SQ_RING);
+  out->cq_ring = out->sq_ring;
+  if (!single_mmap && out->sq_ring != MAP_FAILED) {
+    out->cq_ring = mmap(NULL, out->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        out->ring_fd, IORING_OFF_CQ_RING);
+  }
+  out->sqes = MAP_FAILED;
+  if (out->cq_ring != MAP_FAILED) {
+    out->sqes = mmap(NULL, out->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     out->ring_fd, IORING_OFF_SQES);
+  }
+  if (out->sqes == MAP_FAILED) {
+    if (out->cq_ring != MAP_FAILED && out->cq_ring != out->sq_ring) {
+      munmap(out->cq_ring, out->cq_ring_size);
+    }
+    if (out->sq_ring != MAP_FAILED) {
+      munmap(out->sq_ring, out->sq_ring_size);
+    }
+    close(out->ring_fd);
+    out->ring_fd = -1;
+    return 1;
+  }
+
+  out->sq_tail = ring_field(out->sq_ring, params.sq_off.tail);
+  out->sq_mask = ring_field(out->sq_ring, params.sq_off.ring_mask);
+  out->sq_array = ring_field(out->sq_ring, params.sq_off.array);
+  out->cq_head = ring_field(out->cq_ring, params.cq_off.head);
+  out->cq_tail = ring_field(out->cq_ring, params.cq_off.tail);
+  out->cq_mask = ring_field(out->cq_ring, params.cq_off.ring_mask);
+  out->cqes = (char *)out->cq_ring + params.cq_off.cqes;
+  return 0;
+}
+
+// Submits the write of the buffer being filled, at out->offset.
+static void ring_submit(Output *out) {
+  size_t i = out->current;
+  unsigned tail = *out->sq_tail;
+  unsigned index = tail & *out->sq_mask;
+  struct io_uring_sqe *sqe = &((struct io_uring_sqe *)out->sqes)[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_WRITE;
+  sqe->fd = out->fd;
+  sqe->addr = (uint64_t)(uintptr_t)out->buffers[i];
+  sqe->len = (uint32_t)out->length;
+  sqe->off = (uint64_t)out->offset;
+  sqe->user_data = i;
+  out->sq_array[index] = index;
+  // The entry must be in place before the kernel sees the new tail
+  __atomic_store_n(out->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+  long submitted;
+  do {
+    submitted = syscall(__NR_io_uring_enter, out->ring_fd, 1, 0, 0, NULL, 0);
+  } while (submitted < 0 && errno == EINTR);
+  if (submitted != 1) {
+    out->failed = true;
+    return;
+  }
+  out->sizes[i] = out->length;
+  out->offsets[i] = out->offset;
+  out->in_flight++;
+}
+
+// Waits for at least one write submitted to complete, and frees the buffers
+// of every write completed. A short write is finished by pwrite.
+static void ring_wait(Output *out) {
+  while (1) {
+    unsigned head = *out->cq_head;
+    unsigned tail = __atomic_load_n(out->cq_tail, __ATOMIC_ACQUIRE);
+    if (head != tail) {
+      for (; head != tail; head++) {
+        const struct io_uring_cqe *cqe = &((struct io_uring_cqe *)out->cqes)[head & *out->cq_mask];
+        size_t i = (size_t)cqe->user_data;
+        if (cqe->res < 0) {
+          out->failed = true;
+        } else if ((size_t)cqe->res < out->sizes[i] &&
+                   pwrite_all(out->fd, out->buffers[i] + cqe->res, out->sizes[i] - (size_t)cqe->res,
+                              out->offsets[i] + cqe->res) != 0) {
+          out->failed = true;
+        }
+        out->sizes[i] = 0;
+        out->in_flight--;
+      }
+      __atomic_store_n(out->cq_head, head, __ATOMIC_RELEASE);
+      return;
+    }
+
+    if (syscall(__NR_io_uring_enter, out->ring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+        errno != EINTR) {
+      // Nothing more will complete, give up on the writes
+      out->failed = true;
+      memset(out->sizes, 0, sizeof(out->sizes));
+      out->in_flight = 0;
+      return;
+    }
+  }
+}
+
+int output_use_io_uring(void) {
+  Output probe;
+  if (ring_setup(&probe) != 0) {
+    return 1;
+  }
+  ring_teardown(&probe);
+  io_uring_enabled = true;
+  return 0;
+}
+
+#else
+
+static void ring_teardown(Output *out) {
+  (void)out;
+}
+
+static int ring_setup(Output *out) {
+  (void)out;
+  return 1;
+}
+
+static void ring_submit(Output *out) {
+  (void)out;
+}
+
+static void ring_wait(Output *out) {
+  (void)out;
+}
+
+int output_use_io_uring(void) {
+  return 1;
+}
+
+#endif // __linux__
+
+int output_open(Output *out, int fd, size_t buffer_size) {
+  out->fd = fd;
+  out->buffer_size = buffer_size;
+  out->current = 0;
+  out->length = 0;
+  out->failed = false;
+  out->ring_fd = -1;
+  out->in_flight = 0;
+  memset(out->sizes, 0, sizeof(out->sizes));
+
+  // Writes through the ring are at explicit offsets
+  if (io_uring_enabled && ring_setup(out) == 0) {
+    out->offset = lseek(fd, 0, SEEK_CUR);
+    if (out->offset < 0) {
+      ring_teardown(out);
+    }
+  }
+  out->num_buffers = out->ring_fd != -1 ? OUTPUT_BUFFERS : 1;
+
+  for (size_t i = 0; i < out->num_buffers; i++) {
+    void *buffer;
+    if (posix_memalign(&buffer, OUTPUT_ALIGNMENT, buffer_size) != 0) {
+      while (i-- > 0) {
+        free(out->buffers[i]);
+      }
+      if (out->ring_fd != -1) {
+        ring_teardown(out);
+      }
+      return 1;
+    }
+    out->buffers[i] = buffer;
+  }
+  return 0;
+}
+
+// Submits the buffer being filled and moves on to the next one, once its
+// previous write is done.
+static void submit_buffer(Output *out) {
+  ring_submit(out);
+  out->offset += (off_t)out->length;
+  out->length = 0;
+  out->current = (out->current + 1) % out->num_buffers;
+  while (out->sizes[out->current] != 0) {
+    ring_wait(out);
+  }
+}
+
+int output_write(Output *out, const void *data, size_t length) {
+  if (out->failed) {
+    return 1;
+  }
+  char *buffer = out->buffers[out->current];
+  if (out->ring_fd == -1) {
+    if (length <= out->buffer_size - out->length) {
+      memcpy(buffer + out->length, data, length);
+      out->length += length;
+      return 0;
+    }
+    struct iovec iov[2] = {{buffer, out->length}, {(void *)data, length}};
+    out->failed = writev_all(out->fd, iov, 2) != 0;
+    out->length = 0;
+    return out->failed;
+  }
+
+  const char *bytes = data;
+  while (length > 0 && !out->failed) {
+    size_t room = out->buffer_size - out->length;
+    size_t copied = length < room ? length : room;
+    memcpy(out->buffers[out->current] + out->length, bytes, copied);
+    out->length += copied;
+    bytes += copied;
+    length -= copied;
+    if (out->length == out->buffer_size) {
+      submit_buffer(out);
+    }
+  }
+  return out->failed;
+}
+
+int output_str(Output *out, const char *str) {
+  return output_write(out, str, strlen(str));
+}
+
+int output_flush(Output *out) {
+  if (out->ring_fd == -1) {
+    if (!out->failed && out->length > 0) {
+      struct iovec iov = {out->buffers[0], out->length};
+      out->failed = writev_all(out->fd, &iov, 1) != 0;
+    }
+    out->length = 0;
+    return out->failed;
+  }
+
+  if (!out->failed && out->length > 0) {
+    submit_buffer(out);
+  }
+  while (out->in_flight > 0) {
+    ring_wait(out);
+  }
+  return out->failed;
+}
+
+int output_close(Output *out) {
+  int failed = output_flush(out);
+  if (out->ring_fd != -1) {
+    ring_teardown(out);
+    // Leave the file offset after the data, as plain writes would have
+    lseek(out->fd, out->offset, SEEK_SET);
+  }
+  for (size_t i = 0; i < out->num_buffers; i++) {
+    free(out->buffers[i]);
+  }
+  return failed;
+}
@@ -0,0 +1,86 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define OUTPUT_BUFFERS 4       // In flight at once with io_uring
+#define OUTPUT_ALIGNMENT 4096  // Of the buffers, a page
+#define OUTPUT_JOB_BUFFER_SIZE 65536
+
+// Writes to a file through buffers, so that however small the pieces added
+// are, the file takes one system call per buffer.
+//
+// With io_uring (see output_use_io_uring), a full buffer is submitted to the
+// kernel, which writes it while the caller goes on filling the next one: the
+// caller only waits for the writes when flushing, or once every buffer is in
+// flight. Otherwise there is a single buffer, written out by the caller
+// (along with any piece that does not fit in it, by one writev).
+// Not thread safe.
+typedef struct {
+  int fd;
+  size_t buffer_size;
+  char *buffers[OUTPUT_BUFFERS];
+  size_t num_buffers;            // 1 without io_uring
+  size_t current;                // Buffer being filled
+  size_t length;                 // Bytes in it
+  bool failed;                   // A write failed, the rest of the data is dropped
+
+  // io_uring only
+  int ring_fd;                   // -1 without io_uring
+  off_t offset;                  // Where the next buffer submitted goes
+  size_t in_flight;
+  size_t sizes[OUTPUT_BUFFERS];  // Of the write of each buffer, 0 if it is free
+  off_t offsets[OUTPUT_BUFFERS];
+  unsigned *sq_tail;             // Fields of the rings shared with the kernel
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  void *sqes;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  void *cqes;
+  void *sq_ring;                 // The mappings, to unmap them
+  size_t sq_ring_size;
+  void *cq_ring;                 // The same as sq_ring on most kernels
+  size_t cq_ring_size;
+  size_t sqes_size;
+} Output;
+
+// Makes the outputs opened from now on submit their writes through io_uring.
+// Returns 0 on success, 1 if the kernel does not support it.
+int output_use_io_uring(void);
+
+// Starts writing to a file, at its current offset.
+// @param out The output.
+// @param fd File descriptor to write to, left open by output_close.
+// @param buffer_size Bytes gathered before each write.
+// Returns 0 on success, 1 on failure.
+int output_open(Output *out, int fd, size_t buffer_size);
+
+// Adds bytes to the file.
+// @param out The output.
+// @param data The bytes.
+// @param length Number of bytes.
+// Returns 0 on success, 1 if this or an earlier write failed.
+int output_write(Output *out, const void *data, size_t length);
+
+// Adds a string to the file, without its terminator.
+// @param out The output.
+// @param str The string.
+// Returns 0 on success, 1 if this or an earlier write failed.
+int output_str(Output *out, const char *str);
+
+// Writes out what is buffered and waits for every write submitted, so that
+// the file holds every byte added.
+// @param out The output.
+// Returns 0 on success, 1 if this or an earlier write failed.
+int output_flush(Output *out);
+
+// Flushes the output and frees its buffers.
+// @param out The output.
+// Returns 0 on success, 1 if this or an earlier write failed.
+int output_close(Output *out);
+
+#endif // OUTPUT_H
@@ -43,6 +43,9 @@ static int read_string(int fd, char *buffer, size_t max) {
       break;
     }
 
+    if (i == max - 1) {
+      return -1;  // No room left for the terminator
+    }
     buffer[i++] = ch;
   }
 
@@ -51,6 +54,59 @@ static int read_string(int fd, char *buffer, size_t max) {
   return value;
 }
 
+// Reads the value of a pair. Unlike keys, values may hold small JSON
+// documents: commas, parentheses and spaces are allowed inside brackets,
+// braces or double quotes (where \ escapes the next character), only a
+// ',' or ')' outside of them ends the value.
+// @param fd File to read from.
+// @param buffer To write the value in.
+// @param max Maximum value size, including the terminator.
+// @return 0 if the value ended with ',', 1 if it ended with ')', -1 on error.
+static int read_value(int fd, char *buffer, size_t max) {
+  char ch;
+  size_t i = 0;
+  unsigned int depth = 0;
+  int quoted = 0;
+  int escaped = 0;
+
+  while (read(fd, &ch, 1) == 1) {
+    if (ch == '\n') {
+      return -1;
+    }
+
+    if (quoted) {
+      if (escaped) {
+        escaped = 0;
+      } else if (ch == '\\') {
+        escaped = 1;
+      } else if (ch == '"') {
+        quoted = 0;
+      }
+    } else if (ch == '"') {
+      quoted = 1;
+    } else if (ch == '{' || ch == '[') {
+      depth++;
+    } else if ((ch == '}' || ch == ']') && depth > 0) {
+      depth--;
+    } else if (depth == 0) {
+      if (ch == ',' || ch == ')') {
+        buffer[i] = '\0';
+        return ch == ',' ? 0 : 1;
+      }
+      if (ch == ' ' || ch == ']') {
+        return -1;
+      }
+    }
+
+    if (i == max - 1) {
+      return -1;  // No room left for the terminator
+    }
+    buffer[i++] = ch;
+  }
+
+  return -1;
+}
+
 // Reads a number and stores it in an unsigned integer
 // variable.
 // @param fd File to read from.
@@ -115,11 +171,22 @@ enum Command get_next(int fd) {
 
     case 'R':
       if (read(fd, buf + 1, 4) != 4 || strncmp(buf, "READ ", 5) != 0) {
+        if (read(fd, buf + 5, 1) != 1 || strncmp(buf, "RANGE ", 6) != 0) {
+          cleanup(fd);
+          return CMD_INVALID;
+        }
+        return CMD_RANGE;
+      }
+
+      return CMD_READ;
+
+    case 'P':
+      if (read(fd, buf + 1, 6) != 6 || strncmp(buf, "PREFIX ", 7) != 0) {
         cleanup(fd);
         return CMD_INVALID;
       }
 
-      return CMD_READ;
+      return CMD_PREFIX;
 
     case 'D':
       if (read(fd, buf + 1, 6) != 6 || strncmp(buf, "DELETE ", 7) != 0) {
@@ -168,6 +235,38 @@ enum Command get_next(int fd) {
 
       return CMD_HELP;
 
+    case 'E':
+      if (read(fd, buf + 1, 6) != 6 || strncmp(buf, "EXPIRE ", 7) != 0) {
+        cleanup(fd);
+        return CMD_INVALID;
+      }
+
+      return CMD_EXPIRE;
+
+    case 'C':
+      if (read(fd, buf + 1, 3) != 3 || strncmp(buf, "CAS ", 4) != 0) {
+        cleanup(fd);
+        return CMD_INVALID;
+      }
+
+      return CMD_CAS;
+
+    case 'I':
+      if (read(fd, buf + 1, 4) != 4 || strncmp(buf, "INCR ", 5) != 0) {
+        cleanup(fd);
+        return CMD_INVALID;
+      }
+
+      return CMD_INCR;
+
+    case 'A':
+      if (read(fd, buf + 1, 6) != 6 || strncmp(buf, "APPEND ", 7) != 0) {
+        cleanup(fd);
+        return CMD_INVALID;
+      }
+
+      return CMD_APPEND;
+
     case '#':
       cleanup(fd);
       return CMD_EMPTY;
@@ -181,18 +280,27 @@ enum Command get_next(int fd) {
   }
 }
 
-// Parses a key value pair.
+// Parses a key value pair, optionally followed by a TTL: (key,value[,ttl]).
 // @param fd File decriptor to read from.
 // @param key Pointer where the key will be stored
-// @param value Pointer where the value will be stored
+// @param value Pointer where the value will be stored, MAX_VALUE_SIZE bytes
+// @param ttl Pointer where the TTL (0 if absent) will be stored
 // @return 1 if successful, 0 otherwise.
-int parse_pair(int fd, char *key, char *value) {
+int parse_pair(int fd, char *key, char *value, unsigned int *ttl) {
   if (read_string(fd, key, MAX_STRING_SIZE) != 0) {
     cleanup(fd);
     return 0;
   }
 
-  if (read_string(fd, value, MAX_STRING_SIZE) != 1) {
+  int output = read_value(fd, value, MAX_VALUE_SIZE);
+  *ttl = 0;
+  if (output == 0) {
+    char ch;
+    if (read_uint(fd, ttl, &ch) != 0 || ch != ')') {
+      cleanup(fd);
+      return 0;
+    }
+  } else if (output != 1) {
     cleanup(fd);
     return 0;
   }
@@ -200,7 +308,14 @@ int parse_pair(int fd, char *key, char *value) {
   return 1;
 }
 
-size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], size_t max_pairs, size_t max_string_size) {
+void free_values(char *values[], size_t num_pairs) {
+  for (size_t i = 0; i < num_pairs; i++) {
+    free(values[i]);
+    values[i] = NULL;
+  }
+}
+
+size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char *values[], unsigned int ttls[], size_t max_pairs, size_t max_string_size) {
   char ch;
 
   if (read(fd, &ch, 1) != 1 || ch != '[') {
@@ -215,18 +330,26 @@ size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRIN
 
   size_t num_pairs = 0;
   char key[max_string_size];
-  char value[max_string_size];
+  char value[MAX_VALUE_SIZE];
   while (num_pairs < max_pairs) {
-    if(parse_pair(fd, key, value) == 0) {
+    if(parse_pair(fd, key, value, &ttls[num_pairs]) == 0) {
       cleanup(fd);
+      free_values(values, num_pairs);
       return 0;
     }
 
-    strcpy(keys[num_pairs], key);
-    strcpy(values[num_pairs++], value);
+    // Values are only as large as they need to be
+    values[num_pairs] = strdup(value);
+    if (values[num_pairs] == NULL) {
+      cleanup(fd);
+      free_values(values, num_pairs);
+      return 0;
+    }
+    strcpy(keys[num_pairs++], key);
 
     if (read(fd, &ch, 1) != 1 || (ch != '(' && ch != ']')) {
       cleanup(fd);
+      free_values(values, num_pairs);
       return 0;
     }
 
@@ -237,17 +360,73 @@ size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRIN
 
   if (num_pairs == max_pairs) {
     cleanup(fd);
+    free_values(values, num_pairs);
     return 0;
   }
 
   if (read(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
     cleanup(fd);
+    free_values(values, num_pairs);
     return 0;
   }
 
   return num_pairs;
 }
 
+size_t parse_cas(int fd, char keys[][MAX_STRING_SIZE], char *expected[], char *values[], size_t max_triples, size_t max_string_size) {
+  char ch;
+
+  if (read(fd, &ch, 1) != 1 || ch != '[') {
+    cleanup(fd);
+    return 0;
+  }
+
+  if (read(fd, &ch, 1) != 1 || ch != '(') {
+    cleanup(fd);
+    return 0;
+  }
+
+  size_t num_triples = 0;
+  char key[max_string_size];
+  char old_value[MAX_VALUE_SIZE];
+  char new_value[MAX_VALUE_SIZE];
+  while (num_triples < max_triples) {
+    if (read_string(fd, key, max_string_size) != 0 ||
+        read_value(fd, old_value, MAX_VALUE_SIZE) != 0 ||
+        read_value(fd, new_value, MAX_VALUE_SIZE) != 1) {
+      cleanup(fd);
+      free_values(expected, num_triples);
+      free_values(values, num_triples);
+      return 0;
+    }
+
+    expected[num_triples] = strdup(old_value);
+    values[num_triples] = strdup(new_value);
+    strcpy(keys[num_triples++], key);
+    if (expected[num_triples - 1] == NULL || values[num_triples - 1] == NULL ||
+        read(fd, &ch, 1) != 1 || (ch != '(' && ch != ']')) {
+      cleanup(fd);
+      free_values(expected, num_triples);
+      free_values(values, num_triples);
+      return 0;
+    }
+
+    if (ch == ']') {
+      break;
+    }
+  }
+
+  if (num_triples == max_triples ||
+      read(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
+    cleanup(fd);
+    free_values(expected, num_triples);
+    free_values(values, num_triples);
+    return 0;
+  }
+
+  return num_triples;
+}
+
 size_t parse_read_delete(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys, size_t max_string_size) {
   char ch;
 
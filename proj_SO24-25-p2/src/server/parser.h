@@ -8,6 +8,12 @@ enum Command {
   CMD_WRITE,
   CMD_READ,
   CMD_DELETE,
+  CMD_RANGE,
+  CMD_PREFIX,
+  CMD_EXPIRE,
+  CMD_CAS,
+  CMD_INCR,
+  CMD_APPEND,
   CMD_SHOW,
   CMD_WAIT,
   CMD_BACKUP,
@@ -23,17 +29,36 @@ enum Command {
 // @return enum Command Command code.
 enum Command get_next(int fd);
 
-/// Parses a WRITE command.
+/// Parses a WRITE or APPEND command.
 /// @param fd File descriptor to read from.
 /// @param keys Array to store the keys
-/// @param values Array to store the values
+/// @param values Array to store the values, each allocated with malloc (up to
+///               MAX_VALUE_SIZE bytes) and released with free_values
+/// @param ttls Array to store the TTLs in milliseconds (0 when not given)
 /// @param max_pairs Maximum number of pairs it will write.
-/// @param max_string_size Maximum string size allowed.
+/// @param max_string_size Maximum key size allowed.
 /// @return 0 if the command was not parsed successfully, otherwise return the
 //          of pairs parsed.
-size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], size_t max_pairs, size_t max_string_size);
+size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char *values[], unsigned int ttls[], size_t max_pairs, size_t max_string_size);
 
-// Parses a READ or a DELETE command.
+/// Releases the values parsed by parse_write.
+/// @param values Array of values.
+/// @param num_pairs Number of values parsed.
+void free_values(char *values[], size_t num_pairs);
+
+/// Parses a CAS command: [(key,expected,new)(key2,expected2,new2),...].
+/// @param fd File descriptor to read from.
+/// @param keys Array to store the keys
+/// @param expected Array to store the expected values, allocated like the
+///                 values of parse_write and released with free_values
+/// @param values Array to store the new values, released with free_values
+/// @param max_triples Maximum number of triples it will write.
+/// @param max_string_size Maximum key size allowed.
+/// @return 0 if the command was not parsed successfully, otherwise return the
+//          of triples parsed.
+size_t parse_cas(int fd, char keys[][MAX_STRING_SIZE], char *expected[], char *values[], size_t max_triples, size_t max_string_size);
+
+// Parses a READ, DELETE, RANGE, PREFIX, EXPIRE or INCR command.
 // @param fd File descriptor to read from.
 // @param keys Array to store the keys
 // @param max_pairs Maximum number of pairs it will write.
@@ -0,0 +1,176 @@
+#include "skiplist.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define NEXT_LOAD(node, level) atomic_load_explicit(&(node)->next[level], memory_order_acquire)
+#define NEXT_STORE(node, level, value) \
+  atomic_store_explicit(&(node)->next[level], (value), memory_order_release)
+
+// Allocates an unlinked node.
+// @param height Number of levels the node is linked in.
+// Returns the node, NULL on failure.
+#define NODE_SIZE(height) (sizeof(SkipNode) + (size_t)(height) * sizeof(_Atomic(SkipNode *)))
+
+static SkipNode *alloc_node(int height) {
+  SkipNode *node = malloc(NODE_SIZE(height));
+  if (node == NULL) {
+    return NULL;
+  }
+  node->key = NULL;
+  node->pair = NULL;
+  atomic_init(&node->removed, false);
+  node->height = height;
+  for (int i = 0; i < height; i++) {
+    atomic_init(&node->next[i], NULL);
+  }
+  return node;
+}
+
+static void release_node(void *ctx, void *ptr) {
+  (void)ctx;
+  free(ptr);
+}
+
+// Draws the height of a new node, each level has a 1/4 chance of the next.
+// @param list The list, locked.
+// Returns the height.
+static int random_height(SkipList *list) {
+  int height = 1;
+  unsigned int bits = (unsigned int)rand_r(&list->seed);
+  while (height < SKIPLIST_MAX_LEVEL && (bits & 3) == 0) {
+    height++;
+    bits >>= 2;
+    if (bits == 0) {
+      bits = (unsigned int)rand_r(&list->seed);
+    }
+  }
+  return height;
+}
+
+// Finds, on every level, the last node whose key is smaller than the given one.
+// @param list The list.
+// @param key The key.
+// @param preds Receives the nodes, may be NULL.
+// Returns the first node whose key is not smaller, NULL if there is none.
+static SkipNode *find(SkipList *list, const char *key, SkipNode *preds[SKIPLIST_MAX_LEVEL]) {
+  SkipNode *pred = list->head;
+  SkipNode *node = NULL;
+  for (int level = SKIPLIST_MAX_LEVEL - 1; level >= 0; level--) {
+    node = NEXT_LOAD(pred, level);
+    while (node != NULL && strcmp(node->key, key) < 0) {
+      pred = node;
+      node = NEXT_LOAD(pred, level);
+    }
+    if (preds != NULL) {
+      preds[level] = pred;
+    }
+  }
+  return node;
+}
+
+int skiplist_init(SkipList *list) {
+  list->head = alloc_node(SKIPLIST_MAX_LEVEL);
+  if (list->head == NULL) {
+    return 1;
+  }
+  pthread_mutex_init(&list->lock, NULL);
+  list->seed = 1;
+  retire_list_init(&list->retired);
+  return 0;
+}
+
+int skiplist_insert(SkipList *list, const char *key, struct KeyNode *pair, size_t *node_size) {
+  pthread_mutex_lock(&list->lock);
+
+  SkipNode *node = alloc_node(random_height(list));
+  if (node == NULL) {
+    pthread_mutex_unlock(&list->lock);
+    return 1;
+  }
+  node->key = key;
+  node->pair = pair;
+  *node_size = NODE_SIZE(node->height);
+
+  SkipNode *preds[SKIPLIST_MAX_LEVEL];
+  find(list, key, preds);
+
+  // The node is complete before the first level makes it visible, and it is
+  // linked bottom up so that readers never reach it without the lower levels
+  for (int level = 0; level < node->height; level++) {
+    atomic_store_explicit(&node->next[level], NEXT_LOAD(preds[level], level), memory_order_relaxed);
+    NEXT_STORE(preds[level], level, node);
+  }
+
+  pthread_mutex_unlock(&list->lock);
+  return 0;
+}
+
+size_t skiplist_remove(SkipList *list, const char *key) {
+  pthread_mutex_lock(&list->lock);
+
+  size_t node_size = 0;
+  SkipNode *preds[SKIPLIST_MAX_LEVEL];
+  SkipNode *node = find(list, key, preds);
+  if (node != NULL && strcmp(node->key, key) == 0) {
+    node_size = NODE_SIZE(node->height);
+    atomic_store_explicit(&node->removed, true, memory_order_relaxed);
+    // Readers standing on the node can still follow its links
+    for (int level = node->height - 1; level >= 0; level--) {
+      NEXT_STORE(preds[level], level, NEXT_LOAD(node, level));
+    }
+    if (retire(&list->retired, node) != 0) {
+      epoch_synchronize();
+      free(node);
+    }
+  }
+  retire_collect(&list->retired, release_node, NULL);
+
+  pthread_mutex_unlock(&list->lock);
+  return node_size;
+}
+
+SkipNode *skiplist_seek(SkipList *list, const char *key) {
+  return find(list, key, NULL);
+}
+
+SkipNode *skiplist_next(SkipNode *node) {
+  return NEXT_LOAD(node, 0);
+}
+
+size_t skiplist_split(SkipList *list, size_t parts, const char *keys[]) {
+  size_t wanted = parts - 1;
+  for (int level = SKIPLIST_MAX_LEVEL - 1; level >= 0 && wanted > 0; level--) {
+    size_t count = 0;
+    for (SkipNode *node = NEXT_LOAD(list->head, level); node != NULL; node = NEXT_LOAD(node, level)) {
+      count++;
+    }
+    if (count < parts * SKIPLIST_SPLIT_SAMPLES && level > 0) {
+      continue;
+    }
+
+    // Writers may have changed the level since it was counted, it only makes
+    // the parts a little less even
+    size_t found = 0;
+    size_t index = 0;
+    for (SkipNode *node = NEXT_LOAD(list->head, level); node != NULL && found < wanted;
+         node = NEXT_LOAD(node, level), index++) {
+      if (index == (found + 1) * count / parts) {
+        keys[found++] = node->key;
+      }
+    }
+    return found;
+  }
+  return 0;
+}
+
+void skiplist_destroy(SkipList *list) {
+  SkipNode *node = list->head;
+  while (node != NULL) {
+    SkipNode *next = atomic_load_explicit(&node->next[0], memory_order_relaxed);
+    free(node);
+    node = next;
+  }
+  retire_list_destroy(&list->retired, release_node, NULL);
+  pthread_mutex_destroy(&list->lock);
+}
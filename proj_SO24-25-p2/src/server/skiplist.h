@@ -0,0 +1,79 @@
+#ifndef SKIPLIST_H
+#define SKIPLIST_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "epoch.h"
+
+#define SKIPLIST_MAX_LEVEL 24  // Enough for 4^24 keys with a 1/4 promotion chance
+#define SKIPLIST_SPLIT_SAMPLES 256  // Nodes per part looked at by skiplist_split
+
+struct KeyNode;
+
+typedef struct SkipNode {
+  const char *key;        // Points into pair, never changes
+  struct KeyNode *pair;
+  atomic_bool removed;    // Set when the pair is deleted from the table
+  int height;
+  _Atomic(struct SkipNode *) next[];
+} SkipNode;
+
+// Skip list keeping the pairs of the table sorted by key. Writers are
+// serialized by lock; readers do not lock, they walk the list between
+// epoch_enter and epoch_exit and unlinked nodes are retired, not freed.
+typedef struct {
+  pthread_mutex_t lock;
+  SkipNode *head;           // Sentinel with a full height tower
+  unsigned int seed;        // Random level generator, protected by lock
+  RetireList retired;
+} SkipList;
+
+// Initializes an empty skip list.
+// @param list The list.
+// Returns 0 on success, 1 on failure.
+int skiplist_init(SkipList *list);
+
+// Links a pair into the list. The key must not be in the list yet.
+// @param list The list.
+// @param key Key of the pair, must stay valid while the pair is linked.
+// @param pair The pair.
+// @param node_size Receives the size of the node allocated.
+// Returns 0 on success, 1 on failure.
+int skiplist_insert(SkipList *list, const char *key, struct KeyNode *pair, size_t *node_size);
+
+// Unlinks the pair with the given key, marking its node removed.
+// @param list The list.
+// @param key The key.
+// Returns the size of the node unlinked, 0 if the key was not in the list.
+size_t skiplist_remove(SkipList *list, const char *key);
+
+// Finds the first node whose key is not smaller than the given one. Must be
+// called inside epoch_enter/epoch_exit, the node is valid until epoch_exit.
+// @param list The list.
+// @param key Lower bound.
+// Returns the node, NULL if every key is smaller.
+SkipNode *skiplist_seek(SkipList *list, const char *key);
+
+// Gets the node that follows another in key order, same rules as skiplist_seek.
+// @param node The node.
+// Returns the next node, NULL at the end of the list.
+SkipNode *skiplist_next(SkipNode *node);
+
+// Picks keys splitting the list in about equal parts, from the highest level
+// with SKIPLIST_SPLIT_SAMPLES nodes per part: heights are random, so the
+// nodes of a level are spread evenly over the list. Same rules as skiplist_seek, the keys are
+// valid until epoch_exit.
+// @param list The list.
+// @param parts Number of parts wanted.
+// @param keys Receives up to parts - 1 keys, in order.
+// Returns the number of keys, less than parts - 1 if the list is too short.
+size_t skiplist_split(SkipList *list, size_t parts, const char *keys[]);
+
+// Frees every node, linked or retired. No reader may be using the list.
+// @param list The list.
+void skiplist_destroy(SkipList *list);
+
+#endif // SKIPLIST_H
@@ -0,0 +1,105 @@
+#include "slab.h"
+
+#include <stdalign.h>
+#include <stdlib.h>
+
+// Chunk header padded so that the objects after it keep max alignment
+#define CHUNK_HEADER_SIZE \
+  ((sizeof(SlabChunk) + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1))
+
+void slab_init(Slab *slab, size_t object_size) {
+  size_t align = alignof(max_align_t);
+  if (object_size < sizeof(void *)) {
+    object_size = sizeof(void *);  // Room for the free list link
+  }
+  slab->object_size = (object_size + align - 1) & ~(align - 1);
+  slab->chunk_objects = SLAB_CHUNK_OBJECTS;
+  slab->free_list = NULL;
+  slab->chunks = NULL;
+  slab->live = 0;
+}
+
+// Allocates a new chunk and threads all its objects onto the free list.
+// @param slab The slab to grow.
+// Returns 0 on success, 1 on failure.
+static int slab_grow(Slab *slab) {
+  SlabChunk *chunk = malloc(CHUNK_HEADER_SIZE + slab->object_size * slab->chunk_objects);
+  if (chunk == NULL) {
+    return 1;
+  }
+  chunk->next = slab->chunks;
+  slab->chunks = chunk;
+
+  char *objects = (char *)chunk + CHUNK_HEADER_SIZE;
+  for (size_t i = slab->chunk_objects; i > 0; i--) {
+    void **object = (void **)(void *)(objects + (i - 1) * slab->object_size);
+    *object = slab->free_list;
+    slab->free_list = object;
+  }
+  return 0;
+}
+
+void *slab_alloc(Slab *slab) {
+  if (slab->free_list == NULL && slab_grow(slab) != 0) {
+    return NULL;
+  }
+  void **object = slab->free_list;
+  slab->free_list = *object;
+  slab->live++;
+  return object;
+}
+
+void slab_free(Slab *slab, void *object) {
+  *(void **)object = slab->free_list;
+  slab->free_list = object;
+  slab->live--;
+}
+
+void slab_destroy(Slab *slab) {
+  while (slab->chunks != NULL) {
+    SlabChunk *chunk = slab->chunks;
+    slab->chunks = chunk->next;
+    free(chunk);
+  }
+  slab->free_list = NULL;
+  slab->live = 0;
+}
+
+size_t slab_class_size(unsigned int size_class) {
+  // Even classes are powers of two, odd ones sit halfway to the next
+  size_t base = (size_t)16 << (size_class / 2);
+  return size_class % 2 == 0 ? base : base + base / 2;
+}
+
+unsigned int slab_class_of(size_t size) {
+  unsigned int size_class = 0;
+  while (size_class < SLAB_CLASSES && slab_class_size(size_class) < size) {
+    size_class++;
+  }
+  return size_class;
+}
+
+void slab_classes_init(SlabClasses *classes) {
+  for (unsigned int i = 0; i < SLAB_CLASSES; i++) {
+    size_t size = slab_class_size(i);
+    slab_init(&classes->classes[i], size);
+    // Keep the chunks of large classes from pinning too much memory
+    size_t objects = SLAB_CLASS_CHUNK_SIZE / size;
+    classes->classes[i].chunk_objects =
+        objects < SLAB_CLASS_MIN_OBJECTS ? SLAB_CLASS_MIN_OBJECTS : objects;
+  }
+}
+
+void *slab_classes_alloc(SlabClasses *classes, unsigned int size_class) {
+  return slab_alloc(&classes->classes[size_class]);
+}
+
+void slab_classes_free(SlabClasses *classes, unsigned int size_class, void *object) {
+  slab_free(&classes->classes[size_class], object);
+}
+
+void slab_classes_destroy(SlabClasses *classes) {
+  for (unsigned int i = 0; i < SLAB_CLASSES; i++) {
+    slab_destroy(&classes->classes[i]);
+  }
+}
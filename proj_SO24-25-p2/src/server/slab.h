@@ -0,0 +1,84 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+
+#define SLAB_CHUNK_OBJECTS 256  // Objects carved out of each chunk
+#define SLAB_CLASS_CHUNK_SIZE 16384  // Target chunk size of the size classes
+#define SLAB_CLASS_MIN_OBJECTS 4
+#define SLAB_CLASSES 18         // 16, 24, 32, 48, ... 4096, 6144 bytes
+
+typedef struct SlabChunk {
+  struct SlabChunk *next;
+} SlabChunk;
+
+// Pool of equally sized objects. Memory is requested from malloc one chunk
+// at a time and freed objects are kept in a free list for reuse, so only the
+// first use of every object reaches the system allocator.
+// Not thread safe, the owner must serialize the calls.
+typedef struct {
+  size_t object_size;  // Rounded up to keep every object aligned
+  size_t chunk_objects;
+  void *free_list;     // Freed objects, linked through their first bytes
+  SlabChunk *chunks;   // Every chunk allocated so far
+  size_t live;         // Objects currently handed out
+} Slab;
+
+// Initializes a slab.
+// @param slab The slab to initialize.
+// @param object_size Size of each object.
+void slab_init(Slab *slab, size_t object_size);
+
+// Allocates an object.
+// @param slab The slab to allocate from.
+// Returns the object, NULL on failure.
+void *slab_alloc(Slab *slab);
+
+// Returns an object to the slab.
+// @param slab The slab the object was allocated from.
+// @param object The object to release.
+void slab_free(Slab *slab, void *object);
+
+// Releases every chunk of the slab, including objects still in use.
+// @param slab The slab to destroy.
+void slab_destroy(Slab *slab);
+
+// Slabs for objects of varying size. Sizes are rounded up to the next class,
+// classes go up in steps of a power of two and a half (16, 24, 32, 48, ...),
+// so at most a third of an object is wasted.
+// Not thread safe, the owner must serialize the calls.
+typedef struct {
+  Slab classes[SLAB_CLASSES];
+} SlabClasses;
+
+// Initializes the size classes.
+// @param classes The size classes.
+void slab_classes_init(SlabClasses *classes);
+
+// Finds the smallest class holding a given size.
+// @param size Size of the object.
+// Returns the class index, SLAB_CLASSES if the size is too large.
+unsigned int slab_class_of(size_t size);
+
+// Gets the size of the objects of a class.
+// @param size_class The class index.
+// Returns the size in bytes.
+size_t slab_class_size(unsigned int size_class);
+
+// Allocates an object from a class.
+// @param classes The size classes.
+// @param size_class Class index, as given by slab_class_of.
+// Returns the object, NULL on failure.
+void *slab_classes_alloc(SlabClasses *classes, unsigned int size_class);
+
+// Returns an object to its class.
+// @param classes The size classes.
+// @param size_class Class the object was allocated from.
+// @param object The object to release.
+void slab_classes_free(SlabClasses *classes, unsigned int size_class, void *object);
+
+// Releases every chunk of every class.
+// @param classes The size classes.
+void slab_classes_destroy(SlabClasses *classes);
+
+#endif // SLAB_H
@@ -0,0 +1,204 @@
+#include "snapshot_file.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "constants.h"
+
+#define RECORD_HEADER_SIZE (2 * sizeof(uint32_t) + sizeof(uint64_t))
+
+// FNV-1a of a byte range, continuing from a given hash.
+static uint64_t fnv1a(uint64_t h, const char *bytes, size_t length) {
+  for (size_t i = 0; i < length; i++) {
+    h ^= (unsigned char)bytes[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+uint64_t snapshot_record_hash(const char *key, size_t key_length, const char *value,
+                              size_t value_length, uint64_t deadline) {
+  // The lengths are hashed too, so that bytes cannot move between key and value
+  uint32_t lengths[2] = {(uint32_t)key_length, (uint32_t)value_length};
+  uint64_t h = fnv1a(14695981039346656037ULL, (const char *)lengths, sizeof(lengths));
+  // Only if set, pairs without a TTL hash as they always did
+  if (deadline != 0) {
+    h = fnv1a(h, (const char *)&deadline, sizeof(deadline));
+  }
+  h = fnv1a(h, key, key_length);
+  h = fnv1a(h, value, value_length);
+  // murmur3 finalizer, sums of raw FNV hashes cancel out too easily
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+int snapshot_writer_begin(SnapshotWriter *writer, FileWriter *file, uint64_t id) {
+  writer->file = file;
+  writer->count = 0;
+  writer->checksum = 0;
+  memset(&writer->header, 0, sizeof(writer->header));
+  writer->header.id = id;
+
+  // Room for the header, left zeroed (and so invalid) until the end
+  SnapshotHeader header = {0};
+  return file_writer_write(file, &header, sizeof(header));
+}
+
+int snapshot_writer_set_base(SnapshotWriter *writer, const char *base, uint64_t base_id,
+                             uint64_t partitions) {
+  if (strlen(base) >= sizeof(writer->header.base)) {
+    return 1;
+  }
+  writer->header.flags |= SNAPSHOT_DELTA;
+  writer->header.base_id = base_id;
+  writer->header.partitions = partitions;
+  strcpy(writer->header.base, base);
+  return 0;
+}
+
+void snapshot_writer_set_segments(SnapshotWriter *writer, uint32_t segments, uint64_t count,
+                                  uint64_t checksum) {
+  writer->header.flags |= SNAPSHOT_MANIFEST;
+  writer->header.segments = segments;
+  writer->count = count;
+  writer->checksum = checksum;
+}
+
+void snapshot_writer_set_log_position(SnapshotWriter *writer, uint64_t position) {
+  writer->header.log_position = position;
+}
+
+int snapshot_writer_add(SnapshotWriter *writer, const char *key, const char *value,
+                        uint64_t deadline) {
+  size_t key_length = strnlen(key, MAX_STRING_SIZE - 1);
+  size_t value_length = strnlen(value, MAX_VALUE_SIZE - 1);
+  char record_header[RECORD_HEADER_SIZE];
+  uint32_t lengths[2] = {(uint32_t)key_length, (uint32_t)value_length};
+  memcpy(record_header, lengths, sizeof(lengths));
+  memcpy(record_header + sizeof(lengths), &deadline, sizeof(deadline));
+
+  // Copied straight into the file's buffer
+  if (file_writer_write(writer->file, record_header, RECORD_HEADER_SIZE) != 0 ||
+      file_writer_write(writer->file, key, key_length) != 0 ||
+      file_writer_write(writer->file, value, value_length) != 0) {
+    return 1;
+  }
+
+  writer->count++;
+  writer->checksum += snapshot_record_hash(key, key_length, value, value_length, deadline);
+  return 0;
+}
+
+int snapshot_writer_finish(SnapshotWriter *writer) {
+  SnapshotHeader header = writer->header;
+  memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+  header.version = SNAPSHOT_VERSION;
+  header.count = writer->count;
+  header.checksum = writer->checksum;
+  if (file_writer_flush(writer->file) != 0 ||
+      pwrite(writer->file->fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header)) {
+    writer->file->out.failed = true;
+    return 1;
+  }
+  return 0;
+}
+
+int snapshot_file_open(SnapshotFile *file, const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    return 1;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SnapshotHeader)) {
+    close(fd);
+    return 1;
+  }
+  file->size = (size_t)st.st_size;
+  void *data = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);  // The mapping keeps the file
+  if (data == MAP_FAILED) {
+    return 1;
+  }
+  file->data = data;
+  posix_madvise(data, file->size, POSIX_MADV_WILLNEED);
+
+  SnapshotHeader header;
+  memcpy(&header, file->data, sizeof(header));
+  // The records of a manifest are in its segments
+  uint64_t records = (header.flags & SNAPSHOT_MANIFEST) ? 0 : header.count;
+  size_t max_records = (file->size - sizeof(header)) / RECORD_HEADER_SIZE;
+  if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != SNAPSHOT_VERSION || records > max_records ||
+      ((header.flags & SNAPSHOT_DELTA) && memchr(header.base, '\0', sizeof(header.base)) == NULL) ||
+      ((header.flags & SNAPSHOT_MANIFEST) &&
+       (header.segments == 0 || header.segments > MAX_SNAPSHOT_SEGMENTS))) {
+    munmap(data, file->size);
+    return 1;
+  }
+  file->count = header.count;
+  file->checksum = header.checksum;
+  file->flags = header.flags;
+  file->id = header.id;
+  file->base_id = header.base_id;
+  file->partitions = header.partitions;
+  file->segments = header.segments;
+  file->log_position = header.log_position;
+  memcpy(file->base, header.base, sizeof(file->base));
+
+  // Records have variable length, they are found by walking the file once
+  file->offsets = malloc(records * sizeof(size_t) + 1);
+  if (file->offsets == NULL) {
+    munmap(data, file->size);
+    return 1;
+  }
+  size_t offset = sizeof(header);
+  size_t i = 0;
+  for (; i < records; i++) {
+    uint32_t lengths[2];
+    if (file->size - offset < RECORD_HEADER_SIZE) {
+      break;
+    }
+    memcpy(lengths, file->data + offset, sizeof(lengths));
+    if (lengths[0] == 0 || lengths[0] >= MAX_STRING_SIZE || lengths[1] >= MAX_VALUE_SIZE ||
+        file->size - offset - RECORD_HEADER_SIZE < (size_t)lengths[0] + lengths[1]) {
+      break;
+    }
+    file->offsets[i] = offset;
+    offset += RECORD_HEADER_SIZE + lengths[0] + lengths[1];
+  }
+  if (i != records || offset != file->size) {
+    // Truncated, or records past the count: not a file we wrote
+    snapshot_file_close(file);
+    return 1;
+  }
+  return 0;
+}
+
+void snapshot_file_record(const SnapshotFile *file, size_t index, const char **key,
+                          size_t *key_length, const char **value, size_t *value_length,
+                          uint64_t *deadline) {
+  const char *record = file->data + file->offsets[index];
+  uint32_t lengths[2];
+  memcpy(lengths, record, sizeof(lengths));
+  memcpy(deadline, record + sizeof(lengths), sizeof(*deadline));
+  *key = record + RECORD_HEADER_SIZE;
+  *key_length = lengths[0];
+  *value = *key + lengths[0];
+  *value_length = lengths[1];
+}
+
+void snapshot_file_close(SnapshotFile *file) {
+  free(file->offsets);
+  file->offsets = NULL;
+  munmap((void *)file->data, file->size);
+  file->data = NULL;
+}
@@ -0,0 +1,155 @@
+#ifndef SNAPSHOT_FILE_H
+#define SNAPSHOT_FILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "file_writer.h"
+
+#define SNAPSHOT_MAGIC "KVSSNAP"  // Followed by its terminator, 8 bytes
+#define SNAPSHOT_VERSION 5
+#define SNAPSHOT_BASE_SIZE 256  // File name of the base of a delta, with its terminator
+
+#define SNAPSHOT_DELTA 0x1     // Header flags, see SnapshotHeader
+#define SNAPSHOT_MANIFEST 0x2
+#define MAX_SNAPSHOT_SEGMENTS 16
+
+// Binary snapshot file: a header followed by one record per pair, each a
+// key length and a value length (uint32_t) and the time the pair expires at
+// (uint64_t, milliseconds since the epoch, 0 if never) followed by the key
+// and the value bytes, without terminators. Integers are in host byte order.
+//
+// A full snapshot holds every pair. A delta (SNAPSHOT_DELTA) only holds the
+// pairs of the stripes that changed since a full snapshot, its base: the
+// state it was taken at is the base without the pairs of those stripes,
+// plus the delta's pairs.
+//
+// Either kind may be split in segments written in parallel: the file named
+// after the snapshot is then a manifest (SNAPSHOT_MANIFEST) without any
+// record, and the records are in the segment files, named after it plus
+// ".<index>". Segments are plain files with the manifest's id.
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t flags;
+  uint64_t count;       // Number of records, in every segment for a manifest
+  uint64_t checksum;    // Sum of the hashes of every record, see snapshot_record_hash
+  uint64_t id;          // Identifies the snapshot, for the deltas based on it
+  uint64_t base_id;     // Deltas only: id of the base
+  uint64_t partitions;  // Deltas only: bit i set if the pairs of stripe i are replaced
+  uint32_t segments;    // Manifests only: number of segment files
+  uint32_t reserved;
+  uint64_t log_position;  // Position in the log of the first change not held, see wal.h
+  char base[SNAPSHOT_BASE_SIZE];  // Deltas only: file name of the base, in the same directory
+} SnapshotHeader;
+
+// Writes a snapshot file record by record. The header is written last, a
+// file whose writer did not finish has no valid header.
+typedef struct {
+  FileWriter *file;
+  uint64_t count;
+  uint64_t checksum;
+  SnapshotHeader header;  // Filled in by snapshot_writer_finish
+} SnapshotWriter;
+
+// A snapshot file mapped in memory, with the offset of every record.
+typedef struct {
+  const char *data;
+  size_t size;
+  uint64_t count;
+  uint64_t checksum;  // As stored in the header
+  uint32_t flags;
+  uint64_t id;
+  uint64_t base_id;
+  uint64_t partitions;
+  uint32_t segments;
+  uint64_t log_position;
+  char base[SNAPSHOT_BASE_SIZE];
+  size_t *offsets;    // count entries, none for a manifest
+} SnapshotFile;
+
+// Hashes a record, the checksum of a file is the sum of the hashes of its
+// records so that they can be verified in any order and by several threads.
+// @param key The key.
+// @param key_length Length of the key.
+// @param value The value.
+// @param value_length Length of the value.
+// @param deadline Time the pair expires at, 0 if never.
+// Returns the hash.
+uint64_t snapshot_record_hash(const char *key, size_t key_length, const char *value,
+                              size_t value_length, uint64_t deadline);
+
+// Starts writing a full snapshot file.
+// @param writer The writer.
+// @param file File to write to, nothing written to it yet.
+// @param id Id of the snapshot.
+// Returns 0 on success, 1 on failure.
+int snapshot_writer_begin(SnapshotWriter *writer, FileWriter *file, uint64_t id);
+
+// Makes the file being written a delta. Only the pairs of the partitions
+// are to be added.
+// @param writer The writer.
+// @param base File name of the base, in the same directory.
+// @param base_id Id of the base.
+// @param partitions Bit i set for the stripes whose pairs the delta replaces.
+// Returns 0 on success, 1 if the name is too long.
+int snapshot_writer_set_base(SnapshotWriter *writer, const char *base, uint64_t base_id,
+                             uint64_t partitions);
+
+// Makes the file being written the manifest of a segmented snapshot. No
+// pair is to be added.
+// @param writer The writer.
+// @param segments Number of segments, each with the same id as the manifest.
+// @param count Number of records in the segments.
+// @param checksum Sum of the checksums of the segments.
+void snapshot_writer_set_segments(SnapshotWriter *writer, uint32_t segments, uint64_t count,
+                                  uint64_t checksum);
+
+// Records the position in the log the snapshot was taken at, the changes
+// logged before it are the ones the snapshot holds.
+// @param writer The writer.
+// @param position As returned by wal_position, 0 without a log.
+void snapshot_writer_set_log_position(SnapshotWriter *writer, uint64_t position);
+
+// Writes a pair.
+// @param writer The writer.
+// @param key The key.
+// @param value The value.
+// @param deadline Time the pair expires at, in milliseconds since the epoch,
+// 0 if never.
+// Returns 0 on success, 1 if this or an earlier write failed.
+int snapshot_writer_add(SnapshotWriter *writer, const char *key, const char *value,
+                        uint64_t deadline);
+
+// Flushes the records and writes the header, once every pair was added.
+// The file is left to be committed by the caller.
+// @param writer The writer.
+// Returns 0 on success, 1 on failure.
+int snapshot_writer_finish(SnapshotWriter *writer);
+
+// Maps a snapshot file and checks its header and the bounds of its records.
+// The checksum is not verified, that is left to whoever reads the records,
+// and neither is the base of a delta.
+// @param file The file.
+// @param path Path of the file.
+// Returns 0 on success, 1 on failure.
+int snapshot_file_open(SnapshotFile *file, const char *path);
+
+// Gets a record of a mapped file. Neither the key nor the value are
+// terminated.
+// @param file The file.
+// @param index Index of the record, less than file->count.
+// @param key Receives the key.
+// @param key_length Receives the length of the key.
+// @param value Receives the value.
+// @param value_length Receives the length of the value.
+// @param deadline Receives the time the pair expires at, 0 if never.
+void snapshot_file_record(const SnapshotFile *file, size_t index, const char **key,
+                          size_t *key_length, const char **value, size_t *value_length,
+                          uint64_t *deadline);
+
+// Unmaps a snapshot file.
+// @param file The file.
+void snapshot_file_close(SnapshotFile *file);
+
+#endif // SNAPSHOT_FILE_H
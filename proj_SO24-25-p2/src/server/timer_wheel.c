@@ -0,0 +1,145 @@
+#include "timer_wheel.h"
+
+#define SLOT_MASK ((uint64_t)TIMER_SLOTS - 1)
+
+static void list_init(TimerEntry *head) {
+  head->prev = head;
+  head->next = head;
+}
+
+static void list_push(TimerEntry *head, TimerEntry *entry) {
+  entry->prev = head->prev;
+  entry->next = head;
+  head->prev->next = entry;
+  head->prev = entry;
+}
+
+// Picks the list a timer belongs to, given the tick the wheel is at.
+// @param wheel The wheel.
+// @param expires Tick at which the timer fires, not before wheel->now.
+// @return list head.
+static TimerEntry *slot_for(TimerWheel *wheel, uint64_t expires) {
+  uint64_t delta = expires - wheel->now;
+  for (int level = 0; level < TIMER_LEVELS; level++) {
+    if (delta < (uint64_t)1 << (TIMER_LEVEL_BITS * (level + 1))) {
+      return &wheel->slots[level][(expires >> (TIMER_LEVEL_BITS * level)) & SLOT_MASK];
+    }
+  }
+  // Beyond the last level: park it in the furthest slot, it is placed again
+  // when that slot cascades
+  int top = TIMER_LEVELS - 1;
+  uint64_t parked = wheel->now + ((uint64_t)1 << (TIMER_LEVEL_BITS * TIMER_LEVELS)) - 1;
+  return &wheel->slots[top][(parked >> (TIMER_LEVEL_BITS * top)) & SLOT_MASK];
+}
+
+// Empties a slot, placing its timers again (they land on lower levels).
+// @param wheel The wheel.
+// @param head The slot.
+static void cascade(TimerWheel *wheel, TimerEntry *head) {
+  TimerEntry pending;
+  list_init(&pending);
+  if (head->next != head) {
+    // Take the whole list at once
+    pending.next = head->next;
+    pending.prev = head->prev;
+    pending.next->prev = &pending;
+    pending.prev->next = &pending;
+    list_init(head);
+  }
+  while (pending.next != &pending) {
+    TimerEntry *entry = pending.next;
+    timer_cancel(entry);
+    list_push(slot_for(wheel, entry->expires), entry);
+  }
+}
+
+void timer_wheel_init(TimerWheel *wheel, uint64_t now_tick) {
+  pthread_mutex_init(&wheel->lock, NULL);
+  wheel->now = now_tick;
+  for (int level = 0; level < TIMER_LEVELS; level++) {
+    for (int slot = 0; slot < TIMER_SLOTS; slot++) {
+      list_init(&wheel->slots[level][slot]);
+    }
+  }
+  list_init(&wheel->due);
+}
+
+void timer_wheel_lock(TimerWheel *wheel) {
+  pthread_mutex_lock(&wheel->lock);
+}
+
+void timer_wheel_unlock(TimerWheel *wheel) {
+  pthread_mutex_unlock(&wheel->lock);
+}
+
+void timer_entry_init(TimerEntry *entry) {
+  entry->prev = NULL;
+  entry->next = NULL;
+  entry->expires = 0;
+}
+
+void timer_schedule(TimerWheel *wheel, TimerEntry *entry, uint64_t expires) {
+  timer_cancel(entry);
+  entry->expires = expires;
+  // The current tick was already processed, timers due by now fire on the next one
+  list_push(slot_for(wheel, expires > wheel->now ? expires : wheel->now + 1), entry);
+}
+
+void timer_cancel(TimerEntry *entry) {
+  if (entry->next == NULL) {
+    return;
+  }
+  entry->prev->next = entry->next;
+  entry->next->prev = entry->prev;
+  entry->prev = NULL;
+  entry->next = NULL;
+}
+
+TimerEntry *timer_wheel_pop(TimerWheel *wheel, uint64_t now_tick) {
+  while (wheel->due.next == &wheel->due && wheel->now < now_tick) {
+    wheel->now++;
+    // Each time a level wraps around, the next slot of the level above is
+    // spread over the levels below, starting from the highest one
+    int top = 0;
+    while (top + 1 < TIMER_LEVELS && ((wheel->now >> (TIMER_LEVEL_BITS * top)) & SLOT_MASK) == 0) {
+      top++;
+    }
+    for (int level = top; level > 0; level--) {
+      cascade(wheel, &wheel->slots[level][(wheel->now >> (TIMER_LEVEL_BITS * level)) & SLOT_MASK]);
+    }
+
+    TimerEntry *head = &wheel->slots[0][wheel->now & SLOT_MASK];
+    while (head->next != head) {
+      TimerEntry *entry = head->next;
+      timer_cancel(entry);
+      if (entry->expires <= wheel->now) {
+        list_push(&wheel->due, entry);
+      } else {
+        // Parked beyond the last level, not due yet
+        list_push(slot_for(wheel, entry->expires), entry);
+      }
+    }
+  }
+
+  TimerEntry *entry = wheel->due.next;
+  if (entry == &wheel->due) {
+    return NULL;
+  }
+  timer_cancel(entry);
+  return entry;
+}
+
+void timer_wheel_destroy(TimerWheel *wheel) {
+  for (int level = 0; level < TIMER_LEVELS; level++) {
+    for (int slot = 0; slot < TIMER_SLOTS; slot++) {
+      TimerEntry *head = &wheel->slots[level][slot];
+      while (head->next != head) {
+        timer_cancel(head->next);
+      }
+    }
+  }
+  while (wheel->due.next != &wheel->due) {
+    timer_cancel(wheel->due.next);
+  }
+  pthread_mutex_destroy(&wheel->lock);
+}
@@ -0,0 +1,68 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define TIMER_TICK_MS 10     // Resolution of the wheel
+#define TIMER_LEVEL_BITS 6
+#define TIMER_SLOTS (1 << TIMER_LEVEL_BITS)  // Slots per level
+#define TIMER_LEVELS 4       // Covers 64^4 ticks (about 46 hours), later timers wait at the top
+
+// Timer embedded in the object it belongs to. Unlinked when next is NULL.
+typedef struct TimerEntry {
+  struct TimerEntry *prev;
+  struct TimerEntry *next;
+  uint64_t expires;  // Tick at which the timer fires
+} TimerEntry;
+
+// Hierarchical timer wheel: level L slots are TIMER_SLOTS^L ticks wide, and
+// timers move down a level each time the lower level wraps around, so that
+// scheduling, cancelling and firing a timer are all O(1).
+// Calls are serialized by lock, which the caller takes with timer_wheel_lock.
+typedef struct {
+  pthread_mutex_t lock;
+  uint64_t now;  // Last tick processed
+  TimerEntry slots[TIMER_LEVELS][TIMER_SLOTS];  // List heads
+  TimerEntry due;                               // Fired timers not popped yet
+} TimerWheel;
+
+// Converts a monotonic time in milliseconds to wheel ticks.
+#define TIMER_TICKS(ms) ((ms) / TIMER_TICK_MS)
+
+// Initializes an empty wheel.
+// @param wheel The wheel.
+// @param now_tick Current tick.
+void timer_wheel_init(TimerWheel *wheel, uint64_t now_tick);
+
+void timer_wheel_lock(TimerWheel *wheel);
+
+void timer_wheel_unlock(TimerWheel *wheel);
+
+// Initializes an entry as unlinked.
+// @param entry The entry.
+void timer_entry_init(TimerEntry *entry);
+
+// Schedules (or reschedules) a timer. The wheel must be locked.
+// @param wheel The wheel.
+// @param entry The timer.
+// @param expires Tick at which it fires.
+void timer_schedule(TimerWheel *wheel, TimerEntry *entry, uint64_t expires);
+
+// Cancels a timer if it is scheduled. The wheel must be locked.
+// @param entry The timer.
+void timer_cancel(TimerEntry *entry);
+
+// Moves the wheel forward and pops fired timers, which are left unlinked.
+// The wheel must be locked.
+// @param wheel The wheel.
+// @param now_tick Current tick.
+// @return a fired timer, NULL if there is none.
+TimerEntry *timer_wheel_pop(TimerWheel *wheel, uint64_t now_tick);
+
+// Destroys the wheel, leaving every entry unlinked.
+// @param wheel The wheel.
+void timer_wheel_destroy(TimerWheel *wheel);
+
+#endif // TIMER_WHEEL_H
@@ -0,0 +1,401 @@
+#include "wal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "constants.h"
+#include "file_writer.h"
+#include "snapshot_file.h"
+#include "../common/io.h"
+
+#define RECORD_HEADER_SIZE (1 + 2 * sizeof(uint32_t) + 2 * sizeof(uint64_t))
+#define DEADLINE_OFFSET (1 + 2 * sizeof(uint32_t))
+#define CHECKSUM_OFFSET (DEADLINE_OFFSET + sizeof(uint64_t))
+
+// Checksum of a record, the snapshot record hash tagged with the operation.
+static uint64_t record_checksum(enum WalOp op, const char *key, size_t key_length,
+                                const char *value, size_t value_length, uint64_t deadline) {
+  return snapshot_record_hash(key, key_length, value, value_length, deadline) ^ (uint64_t)op;
+}
+
+// Fills in the header of a log file.
+static void init_header(WalHeader *header, uint64_t start) {
+  memset(header, 0, sizeof(*header));
+  strcpy(header->magic, WAL_MAGIC);
+  header->version = WAL_VERSION;
+  header->start = start;
+}
+
+// Checks the header of a log file.
+static bool valid_header(const WalHeader *header) {
+  return memcmp(header->magic, WAL_MAGIC, sizeof(WAL_MAGIC)) == 0 &&
+         header->version == WAL_VERSION;
+}
+
+long wal_replay(const char *path, uint64_t from,
+                void (*apply)(void *ctx, enum WalOp op, const char *key, const char *value,
+                              uint64_t deadline),
+                void *ctx) {
+  int fd = open(path, O_RDWR);
+  if (fd == -1) {
+    return errno == ENOENT ? 0 : -1;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return -1;
+  }
+  size_t size = (size_t)st.st_size;
+  if (size == 0) {
+    close(fd);
+    return 0;
+  }
+  const char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED) {
+    close(fd);
+    return -1;
+  }
+
+  // Never truncated, whatever it holds is not a log
+  WalHeader header;
+  if (size >= sizeof(header)) {
+    memcpy(&header, data, sizeof(header));
+  }
+  if (size < sizeof(header) || !valid_header(&header)) {
+    fprintf(stderr, "Invalid log file: %s\n", path);
+    munmap((void *)data, size);
+    close(fd);
+    return -1;
+  }
+  if (from < header.start) {
+    fprintf(stderr, "%s was checkpointed at position %lu, the changes before it are only in the "
+            "snapshots taken since\n", path, (unsigned long)header.start);
+  }
+
+  long records = 0;
+  size_t offset = sizeof(header);
+  char key[MAX_STRING_SIZE];
+  char value[MAX_VALUE_SIZE];
+  while (size - offset >= RECORD_HEADER_SIZE) {
+    char op = data[offset];
+    uint32_t lengths[2];
+    uint64_t deadline;
+    uint64_t checksum;
+    memcpy(lengths, data + offset + 1, sizeof(lengths));
+    memcpy(&deadline, data + offset + DEADLINE_OFFSET, sizeof(deadline));
+    memcpy(&checksum, data + offset + CHECKSUM_OFFSET, sizeof(checksum));
+    if ((op != WAL_WRITE && op != WAL_DELETE && op != WAL_EXPIRE) || lengths[0] == 0 ||
+        lengths[0] >= MAX_STRING_SIZE || lengths[1] >= MAX_VALUE_SIZE ||
+        size - offset - RECORD_HEADER_SIZE < (size_t)lengths[0] + lengths[1]) {
+      break;
+    }
+
+    const char *record_key = data + offset + RECORD_HEADER_SIZE;
+    const char *record_value = record_key + lengths[0];
+    if (record_checksum((enum WalOp)op, record_key, lengths[0], record_value, lengths[1],
+                        deadline) != checksum) {
+      break;
+    }
+    memcpy(key, record_key, lengths[0]);
+    key[lengths[0]] = '\0';
+    memcpy(value, record_value, lengths[1]);
+    value[lengths[1]] = '\0';
+    // Those before the position are in the snapshot already
+    if (header.start + (offset - sizeof(header)) >= from) {
+      apply(ctx, (enum WalOp)op, key, op == WAL_WRITE ? value : NULL, deadline);
+      records++;
+    }
+    offset += RECORD_HEADER_SIZE + lengths[0] + lengths[1];
+  }
+  munmap((void *)data, size);
+
+  if (offset != size) {
+    fprintf(stderr, "Discarding %lu bytes of incomplete records at the end of %s\n",
+            (unsigned long)(size - offset), path);
+    if (ftruncate(fd, (off_t)offset) != 0) {
+      records = -1;
+    }
+  }
+  close(fd);
+  return records;
+}
+
+// Calls fdatasync every interval, for WAL_SYNC_PERIODIC.
+static void *sync_periodically(void *arg) {
+  Wal *wal = arg;
+  struct timespec interval = {wal->interval_ms / 1000, (wal->interval_ms % 1000) * 1000000L};
+
+  pthread_mutex_lock(&wal->lock);
+  while (!wal->stop) {
+    pthread_mutex_unlock(&wal->lock);
+    nanosleep(&interval, NULL);
+    fdatasync(wal->fd);
+    pthread_mutex_lock(&wal->lock);
+  }
+  pthread_mutex_unlock(&wal->lock);
+  return NULL;
+}
+
+int wal_open(Wal *wal, const char *path, enum WalSync policy, unsigned int interval_ms) {
+  if (strlen(path) >= sizeof(wal->path)) {
+    return 1;
+  }
+  // Readable too, checkpoints copy records out of it
+  wal->fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0666);
+  if (wal->fd == -1) {
+    return 1;
+  }
+
+  // A new log gets its header, the one of an existing log was checked when
+  // it was replayed
+  struct stat st;
+  WalHeader header;
+  if (fstat(wal->fd, &st) != 0) {
+    close(wal->fd);
+    return 1;
+  }
+  if (st.st_size == 0) {
+    init_header(&header, 0);
+    if (write_all(wal->fd, &header, sizeof(header)) != 1) {
+      close(wal->fd);
+      return 1;
+    }
+  } else if ((size_t)st.st_size < sizeof(header) ||
+             pread(wal->fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+             !valid_header(&header)) {
+    close(wal->fd);
+    return 1;
+  }
+  uint64_t end = st.st_size == 0 ? 0 : header.start + (uint64_t)st.st_size - sizeof(header);
+
+  strcpy(wal->path, path);
+  wal->policy = policy;
+  wal->interval_ms = interval_ms;
+  wal->buffer = malloc(WAL_INITIAL_CAPACITY);
+  wal->spare = malloc(WAL_INITIAL_CAPACITY);
+  if (wal->buffer == NULL || wal->spare == NULL) {
+    free(wal->buffer);
+    free(wal->spare);
+    close(wal->fd);
+    return 1;
+  }
+  wal->length = 0;
+  wal->capacity = WAL_INITIAL_CAPACITY;
+  wal->spare_capacity = WAL_INITIAL_CAPACITY;
+  wal->start = header.start;
+  wal->appended = end;
+  wal->written = end;
+  wal->writing = false;
+  wal->failed = false;
+  wal->stop = false;
+  pthread_mutex_init(&wal->lock, NULL);
+  pthread_cond_init(&wal->written_cond, NULL);
+
+  if (policy == WAL_SYNC_PERIODIC &&
+      pthread_create(&wal->syncer, NULL, sync_periodically, wal) != 0) {
+    pthread_mutex_destroy(&wal->lock);
+    pthread_cond_destroy(&wal->written_cond);
+    free(wal->buffer);
+    free(wal->spare);
+    close(wal->fd);
+    return 1;
+  }
+  return 0;
+}
+
+uint64_t wal_append(Wal *wal, enum WalOp op, const char *key, const char *value,
+                    uint64_t deadline) {
+  size_t key_length = strnlen(key, MAX_STRING_SIZE - 1);
+  size_t value_length = value != NULL ? strnlen(value, MAX_VALUE_SIZE - 1) : 0;
+  size_t record_length = RECORD_HEADER_SIZE + key_length + value_length;
+  uint32_t lengths[2] = {(uint32_t)key_length, (uint32_t)value_length};
+  uint64_t checksum =
+      record_checksum(op, key, key_length, value != NULL ? value : "", value_length, deadline);
+
+  pthread_mutex_lock(&wal->lock);
+  if (wal->failed) {
+    pthread_mutex_unlock(&wal->lock);
+    return 0;
+  }
+  if (wal->length + record_length > wal->capacity) {
+    size_t capacity = wal->capacity * 2;
+    while (wal->length + record_length > capacity) {
+      capacity *= 2;
+    }
+    char *buffer = realloc(wal->buffer, capacity);
+    if (buffer == NULL) {
+      // The change is lost, so are the ones after it
+      fprintf(stderr, "Failed to append to the log\n");
+      wal->failed = true;
+      pthread_mutex_unlock(&wal->lock);
+      return 0;
+    }
+    wal->buffer = buffer;
+    wal->capacity = capacity;
+  }
+
+  char *record = wal->buffer + wal->length;
+  record[0] = (char)op;
+  memcpy(record + 1, lengths, sizeof(lengths));
+  memcpy(record + DEADLINE_OFFSET, &deadline, sizeof(deadline));
+  memcpy(record + CHECKSUM_OFFSET, &checksum, sizeof(checksum));
+  memcpy(record + RECORD_HEADER_SIZE, key, key_length);
+  if (value_length > 0) {
+    memcpy(record + RECORD_HEADER_SIZE + key_length, value, value_length);
+  }
+  wal->length += record_length;
+  wal->appended += record_length;
+  uint64_t position = wal->appended;
+  pthread_mutex_unlock(&wal->lock);
+  return position;
+}
+
+int wal_commit(Wal *wal, uint64_t position) {
+  pthread_mutex_lock(&wal->lock);
+  // After a failed write the log has a hole, nothing is written past it
+  while (wal->written < position && !wal->failed) {
+    if (wal->writing) {
+      pthread_cond_wait(&wal->written_cond, &wal->lock);
+      continue;
+    }
+
+    // Write everything appended so far, on behalf of every waiting thread.
+    // Appends go on in the spare buffer meanwhile.
+    wal->writing = true;
+    char *buffer = wal->buffer;
+    size_t length = wal->length;
+    size_t capacity = wal->capacity;
+    uint64_t end = wal->appended;
+    wal->buffer = wal->spare;
+    wal->capacity = wal->spare_capacity;
+    wal->length = 0;
+    pthread_mutex_unlock(&wal->lock);
+
+    bool failed = write_all(wal->fd, buffer, length) != 1 ||
+                  (wal->policy == WAL_SYNC_ALWAYS && fdatasync(wal->fd) != 0);
+
+    pthread_mutex_lock(&wal->lock);
+    wal->spare = buffer;
+    wal->spare_capacity = capacity;
+    if (failed && !wal->failed) {
+      fprintf(stderr, "Failed to write the log: %s\n", strerror(errno));
+    }
+    wal->failed |= failed;
+    wal->written = end;
+    wal->writing = false;
+    pthread_cond_broadcast(&wal->written_cond);
+  }
+  bool failed = wal->failed;
+  pthread_mutex_unlock(&wal->lock);
+  return failed;
+}
+
+uint64_t wal_position(Wal *wal) {
+  pthread_mutex_lock(&wal->lock);
+  uint64_t position = wal->appended;
+  pthread_mutex_unlock(&wal->lock);
+  return position;
+}
+
+// Writes the records of the log file from a position on to a new file, which
+// replaces it, and makes wal->fd refer to the new file.
+// Returns 0 on success, 1 if the log was left as it was, -1 if it was
+// replaced but cannot be appended to.
+static int rewrite_log(Wal *wal, uint64_t position, uint64_t start, uint64_t end) {
+  size_t skipped = sizeof(WalHeader) + (size_t)(position - start);
+  size_t size = sizeof(WalHeader) + (size_t)(end - start);
+  const char *data = mmap(NULL, size, PROT_READ, MAP_SHARED, wal->fd, 0);
+  if (data == MAP_FAILED) {
+    return 1;
+  }
+
+  // Synced whatever the policy, as the file it replaces may have been
+  FileWriter file;
+  WalHeader header;
+  init_header(&header, position);
+  int failed = file_writer_open(&file, wal->path);
+  if (!failed) {
+    file_writer_write(&file, &header, sizeof(header));
+    file_writer_write(&file, data + skipped, size - skipped);
+    failed = file_writer_commit(&file, true);
+  }
+  munmap((void *)data, size);
+  if (failed) {
+    return 1;
+  }
+
+  // Same descriptor, the sync thread may be using it
+  int fd = open(wal->path, O_RDWR | O_APPEND);
+  if (fd == -1 || dup2(fd, wal->fd) == -1) {
+    if (fd != -1) {
+      close(fd);
+    }
+    return -1;
+  }
+  close(fd);
+  return 0;
+}
+
+int wal_checkpoint(Wal *wal, uint64_t position) {
+  // The file must hold every record before the position to be cut there
+  if (wal_commit(wal, position) != 0) {
+    return 1;
+  }
+
+  pthread_mutex_lock(&wal->lock);
+  while (wal->writing) {
+    pthread_cond_wait(&wal->written_cond, &wal->lock);
+  }
+  if (wal->failed || position <= wal->start) {
+    bool failed = wal->failed;
+    pthread_mutex_unlock(&wal->lock);
+    return failed;
+  }
+  wal->writing = true;
+  uint64_t start = wal->start;
+  uint64_t end = wal->written;
+  pthread_mutex_unlock(&wal->lock);
+
+  int result = rewrite_log(wal, position, start, end);
+
+  pthread_mutex_lock(&wal->lock);
+  if (result == 0) {
+    wal->start = position;
+  } else if (result < 0) {
+    // The records appended from now on would be lost
+    fprintf(stderr, "Failed to reopen the log: %s\n", wal->path);
+    wal->failed = true;
+  }
+  wal->writing = false;
+  pthread_cond_broadcast(&wal->written_cond);
+  pthread_mutex_unlock(&wal->lock);
+  return result != 0;
+}
+
+void wal_close(Wal *wal) {
+  pthread_mutex_lock(&wal->lock);
+  uint64_t position = wal->appended;
+  wal->stop = true;
+  pthread_mutex_unlock(&wal->lock);
+
+  wal_commit(wal, position);
+  if (wal->policy == WAL_SYNC_PERIODIC) {
+    pthread_join(wal->syncer, NULL);
+  }
+  if (wal->policy != WAL_SYNC_NEVER) {
+    fdatasync(wal->fd);
+  }
+  close(wal->fd);
+  pthread_mutex_destroy(&wal->lock);
+  pthread_cond_destroy(&wal->written_cond);
+  free(wal->buffer);
+  free(wal->spare);
+}
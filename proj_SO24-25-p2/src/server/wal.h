@@ -0,0 +1,132 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "constants.h"
+
+#define WAL_INITIAL_CAPACITY 65536
+#define WAL_MAGIC "KVSWAL"  // Followed by its terminator and padding, 8 bytes
+#define WAL_VERSION 1
+
+enum WalOp {
+  WAL_WRITE = 'W',
+  WAL_DELETE = 'D',
+  WAL_EXPIRE = 'E',  // Gives a pair a deadline, without a value
+};
+
+enum WalSync {
+  WAL_SYNC_ALWAYS,    // Commits wait for fdatasync
+  WAL_SYNC_PERIODIC,  // A thread calls fdatasync every interval
+  WAL_SYNC_NEVER,     // Left to the kernel
+};
+
+// Append only log of the changes to the store. Every record is an operation,
+// a key length and a value length (uint32_t), the time the pair expires at
+// (uint64_t, milliseconds since the epoch, 0 if never), a checksum (uint64_t)
+// and the key and value bytes, after a header.
+//
+// Positions in the log count the bytes of every record appended since it was
+// created. A checkpoint cuts off the records before a snapshot's position,
+// the file then starts at that position.
+//
+// Records are appended to a buffer, which commits write out in one write
+// (and sync, depending on the policy) for every thread that committed in the
+// meantime: the first thread to commit writes for all the others, which wait
+// for it (group commit).
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+  uint64_t start;  // Position of the first record in the file
+} WalHeader;
+
+typedef struct {
+  int fd;
+  char path[MAX_JOB_FILE_NAME_SIZE];
+  enum WalSync policy;
+  unsigned int interval_ms;
+
+  pthread_mutex_t lock;
+  pthread_cond_t written_cond;
+  char *buffer;       // Records appended and not yet being written
+  size_t length;
+  size_t capacity;
+  char *spare;        // Buffer swapped in while the other one is written
+  size_t spare_capacity;
+  uint64_t start;     // Position of the first record in the file
+  uint64_t appended;  // Position after the last record appended
+  uint64_t written;   // Position after the last record written (and synced,
+                      // if the policy says so)
+  bool writing;       // A thread is writing for the others, or checkpointing
+  bool failed;
+
+  pthread_t syncer;   // WAL_SYNC_PERIODIC only
+  bool stop;
+} Wal;
+
+// Replays a log and truncates it after its last complete record, so that a
+// record torn by a crash does not hide the ones appended afterwards.
+// @param path Path of the log, a missing file is an empty log.
+// @param from Position to replay from, the records before it are skipped.
+// @param apply Called with each record, in order. The key and value are
+// terminated, value is NULL for deletions and WAL_EXPIRE. The deadline may
+// have passed since the record was logged, that is left to apply.
+// @param ctx Context given to apply.
+// Returns the number of records replayed, -1 on failure.
+long wal_replay(const char *path, uint64_t from,
+                void (*apply)(void *ctx, enum WalOp op, const char *key, const char *value,
+                              uint64_t deadline),
+                void *ctx);
+
+// Opens a log for appending, creating it if needed.
+// @param wal The log.
+// @param path Path of the log.
+// @param policy When the log is synced.
+// @param interval_ms Time between syncs for WAL_SYNC_PERIODIC.
+// Returns 0 on success, 1 on failure.
+int wal_open(Wal *wal, const char *path, enum WalSync policy, unsigned int interval_ms);
+
+// Appends a record to the buffer. Changes to a key must be appended in the
+// order they are made, so it is called with the key's stripe locked.
+// @param wal The log.
+// @param op The operation.
+// @param key The key.
+// @param value The value, NULL for deletions and WAL_EXPIRE.
+// @param deadline Time the pair expires at, in milliseconds since the epoch,
+// 0 if never.
+// Returns the position to commit up to, 0 on failure or if the log failed.
+uint64_t wal_append(Wal *wal, enum WalOp op, const char *key, const char *value,
+                    uint64_t deadline);
+
+// Waits for every record up to a position to be written, writing them (and
+// the ones appended by other threads) if no other thread is.
+// @param wal The log.
+// @param position As returned by wal_append.
+// Returns 0 on success, 1 if the log could not be written. Once a write
+// failed the log is failed for good, and every commit returns 1.
+int wal_commit(Wal *wal, uint64_t position);
+
+// Gets the position after the last record appended. Called with every
+// stripe locked, it tells the changes a snapshot holds from those it does not.
+// @param wal The log.
+// Returns the position.
+uint64_t wal_position(Wal *wal);
+
+// Cuts off the records before a position, once a snapshot holding every
+// change up to it is on disk. The records after it are copied to a new file,
+// which replaces the log; appends go on meanwhile, commits wait.
+// @param wal The log.
+// @param position As returned by wal_position when the snapshot was taken.
+// Returns 0 on success (or if the log starts at or after the position
+// already), 1 on failure.
+int wal_checkpoint(Wal *wal, uint64_t position);
+
+// Writes what is left in the buffer, syncs and closes the log.
+// @param wal The log.
+void wal_close(Wal *wal);
+
+#endif // WAL_H
@@ -0,0 +1,30 @@
+#!/bin/sh
+# Runs the example jobs of src/server/jobs that have an expected output in
+# tests/expected, in a directory of their own, and diffs what they write.
+# Usage: tests/run_jobs.sh <kvs binary>
+
+kvs="$1"
+root="$(dirname "$0")/.."
+work="$(mktemp -d)"
+trap 'rm -rf "$work" "/tmp/kvs_test_$$"' EXIT
+
+for expected in "$root"/tests/expected/*.out; do
+  name="$(basename "$expected" .out)"
+  cp "$root/src/server/jobs/$name.job" "$work/"
+done
+
+# The server keeps serving its FIFO once the jobs are done, the longest job
+# waits 2 seconds
+timeout 5 "$kvs" "$work" 4 1 "kvs_test_$$" > "$work/server.log" 2>&1
+
+failed=0
+for expected in "$root"/tests/expected/*.out; do
+  name="$(basename "$expected" .out)"
+  if diff -u "$expected" "$work/$name.out"; then
+    echo "PASS $name"
+  else
+    echo "FAIL $name"
+    failed=1
+  fi
+done
+exit $failed